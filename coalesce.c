@@ -0,0 +1,355 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "xsatmgr.h"
+
+/*******************************************************************************
+ * Coalescing of concurrent one-shot runs
+ *
+ * A dock connect fires a burst of udev events, each launching a one-shot
+ * run. Rather than having all of them race through the whole apply, only
+ * one run per display is in flight at a time. A run that finds another in
+ * flight leaves its request in a pending slot and exits; the run in flight
+ * picks the slot up once done with its own request, and applies the newest
+ * request of each output only.
+ *
+ * Two files back this, named after the display: the flight lock, held for
+ * the whole apply, and the pending slot, locked only while it is read or
+ * written. The run in flight only lets go of the flight lock while holding
+ * the slot lock, after finding the slot empty, so no request left in the
+ * slot is ever lost. A run that died in flight may leave requests behind:
+ * the next run in flight drops those superseded by its own, newer ones.
+ *
+ * The files live in a directory private to the user, so that no one else
+ * can plant requests or links there: $XDG_RUNTIME_DIR, or COALESCE_DIR for
+ * root.
+ */
+
+#define COALESCE_DIR "/run/xsatmgr"
+
+#define COALESCE_MAGIC 0x50435358	/* "XSCP" */
+
+struct slot_header {
+	uint32_t magic;
+	uint32_t nrequests;
+	uint32_t handed_over;	/* Runs that left their request */
+	uint32_t superseded;	/* Requests replaced by newer ones */
+};
+
+/*
+ * Find the directory of the files, which must belong to us and be writable
+ * by no one else.
+ *
+ * Return: The directory, or NULL if there is no safe one.
+ */
+static const char *coalesce_dir(void)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	struct stat st;
+
+	if (!dir) {
+		dir = COALESCE_DIR;
+		if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+			printf("Cannot create %s. %s\n", dir, strerror(errno));
+			return NULL;
+		}
+	}
+
+	if (lstat(dir, &st) < 0) {
+		printf("Cannot access %s. %s\n", dir, strerror(errno));
+		return NULL;
+	}
+	if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		printf("%s is not a private directory.\n", dir);
+		return NULL;
+	}
+	return dir;
+}
+
+/* Build the path of one of the files of a display. */
+static void coalesce_path(char *path, size_t len, const char *dir,
+			  const char *display, const char *suffix)
+{
+	size_t i, start;
+
+	snprintf(path, len, "%s/xsatmgr-", dir);
+	start = strlen(path);
+	snprintf(path + start, len - start, "%s%s", display ? display : "",
+		 suffix);
+
+	/* Display names may contain slashes, e.g. a launchd socket */
+	for (i = start; path[i] && strcmp(path + i, suffix); i++)
+		if (path[i] == '/')
+			path[i] = '_';
+}
+
+static int coalesce_open(const char *dir, const char *display,
+			 const char *suffix)
+{
+	char path[LINE_LEN];
+	struct stat st;
+	int fd;
+
+	coalesce_path(path, sizeof(path), dir, display, suffix);
+	fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		printf("Cannot open %s. %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    st.st_uid != geteuid()) {
+		printf("%s is not a file of ours.\n", path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Read the slot. The slot lock must be held. */
+static int slot_read(int fd, struct slot_header *hdr,
+		     struct pending_request *reqs)
+{
+	ssize_t len = pread(fd, hdr, sizeof(*hdr), 0);
+
+	if (len != sizeof(*hdr) || hdr->magic != COALESCE_MAGIC ||
+	    hdr->nrequests > MAX_OUTPUTS) {
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->magic = COALESCE_MAGIC;
+		return 0;
+	}
+
+	len = hdr->nrequests * sizeof(*reqs);
+	if (pread(fd, reqs, len, sizeof(*hdr)) != len)
+		hdr->nrequests = 0;
+	return hdr->nrequests;
+}
+
+/* Write the slot. The slot lock must be held. */
+static int slot_write(int fd, const struct slot_header *hdr,
+		      const struct pending_request *reqs)
+{
+	size_t len = hdr->nrequests * sizeof(*reqs);
+
+	if (pwrite(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr) ||
+	    pwrite(fd, reqs, len, sizeof(*hdr)) != (ssize_t)len ||
+	    ftruncate(fd, sizeof(*hdr) + len)) {
+		printf("Cannot write the pending slot. %s\n", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static int slot_same_output(const struct pending_request *a,
+			    const struct pending_request *b)
+{
+	return a->monitor == b->monitor && !strcmp(a->name, b->name);
+}
+
+/* Replace the request of the same output in the slot, or add it. */
+static void slot_merge(struct slot_header *hdr, struct pending_request *reqs,
+		       const struct pending_request *req)
+{
+	uint32_t i;
+
+	for (i = 0; i < hdr->nrequests; i++) {
+		if (slot_same_output(&reqs[i], req)) {
+			reqs[i] = *req;
+			hdr->superseded++;
+			return;
+		}
+	}
+
+	/* Full: the oldest request is the least likely to still matter */
+	if (hdr->nrequests == MAX_OUTPUTS) {
+		memmove(reqs, reqs + 1, sizeof(*reqs) * (MAX_OUTPUTS - 1));
+		hdr->nrequests--;
+		hdr->superseded++;
+	}
+	reqs[hdr->nrequests++] = *req;
+}
+
+/*
+ * Drop the requests of the slot for the same outputs as newer ones. The slot
+ * lock must be held.
+ *
+ * Return: Number of requests dropped.
+ */
+static int slot_supersede(int fd, const struct pending_request *newer,
+			  int nnewer)
+{
+	struct pending_request slot[MAX_OUTPUTS];
+	struct slot_header hdr;
+	uint32_t i, n = 0;
+	int j;
+
+	if (!slot_read(fd, &hdr, slot))
+		return 0;
+
+	for (i = 0; i < hdr.nrequests; i++) {
+		for (j = 0; j < nnewer; j++)
+			if (slot_same_output(&slot[i], &newer[j]))
+				break;
+		if (j == nnewer)
+			slot[n++] = slot[i];
+	}
+
+	if (n == hdr.nrequests)
+		return 0;
+
+	j = hdr.nrequests - n;
+	hdr.nrequests = n;
+	slot_write(fd, &hdr, slot);
+	return j;
+}
+
+/**
+ * Join the flight of a display: either become the run in flight, or hand
+ * the requests over to it.
+ *
+ * @c: Coalescing state. Release with coalesce_next().
+ * @display: X display name, or NULL for the DISPLAY environment variable.
+ * @reqs: Requests of this run, one per output or monitor.
+ * @nreqs: Number of requests.
+ *
+ * Return: 0 if this run is in flight and must apply its requests, 1 if they
+ *         were handed over to the run in flight, or -1 if runs cannot be
+ *         coalesced and this one should apply on its own.
+ */
+int coalesce_begin(struct coalesce *c, const char *display,
+		   const struct pending_request *reqs, int nreqs)
+{
+	struct pending_request slot[MAX_OUTPUTS];
+	struct slot_header hdr;
+	const char *dir;
+	int i, ret = -1;
+
+	memset(c, 0, sizeof(*c));
+	c->lock_fd = c->slot_fd = -1;
+	if (!display)
+		display = getenv("DISPLAY");
+
+	dir = coalesce_dir();
+	if (!dir)
+		goto fail;
+
+	c->lock_fd = coalesce_open(dir, display, ".lock");
+	c->slot_fd = coalesce_open(dir, display, ".pending");
+	if (c->lock_fd < 0 || c->slot_fd < 0 ||
+	    flock(c->slot_fd, LOCK_EX))
+		goto fail;
+
+	if (!flock(c->lock_fd, LOCK_EX | LOCK_NB)) {
+		/* Whatever a dead run left behind is older than ours */
+		c->superseded = slot_supersede(c->slot_fd, reqs, nreqs);
+		if (c->superseded)
+			printf("Dropped %lu stale request(s) left by a run "
+			       "that did not land.\n", c->superseded);
+		flock(c->slot_fd, LOCK_UN);
+		return 0;
+	}
+	if (errno != EWOULDBLOCK) {
+		flock(c->slot_fd, LOCK_UN);
+		goto fail;
+	}
+
+	/* Another run is in flight, and cannot finish until we let go */
+	slot_read(c->slot_fd, &hdr, slot);
+	for (i = 0; i < nreqs; i++)
+		slot_merge(&hdr, slot, &reqs[i]);
+	hdr.handed_over++;
+	if (!slot_write(c->slot_fd, &hdr, slot))
+		ret = 1;
+	flock(c->slot_fd, LOCK_UN);
+
+	if (ret == 1) {
+		printf("Handed over to the run in flight.\n");
+		close(c->lock_fd);
+		close(c->slot_fd);
+		return 1;
+	}
+
+fail:
+	/* The failure was reported, apply without coordination */
+	if (c->lock_fd >= 0)
+		close(c->lock_fd);
+	if (c->slot_fd >= 0)
+		close(c->slot_fd);
+	c->lock_fd = c->slot_fd = -1;
+	return -1;
+}
+
+/**
+ * Take the requests handed over while this run was in flight. When there
+ * are none left, the flight is over, and the next run will be in flight.
+ *
+ * @c: Coalescing state, from coalesce_begin() returning 0.
+ * @reqs: Filled in with the newest request of each output or monitor.
+ *
+ * Return: Number of requests to apply, 0 when done.
+ */
+int coalesce_next(struct coalesce *c, struct pending_request *reqs)
+{
+	struct slot_header hdr;
+	int n;
+
+	if (c->slot_fd < 0)
+		return 0;
+
+	flock(c->slot_fd, LOCK_EX);
+	n = slot_read(c->slot_fd, &hdr, reqs);
+	if (n) {
+		c->handed_over += hdr.handed_over;
+		c->superseded += hdr.superseded;
+		hdr.nrequests = hdr.handed_over = hdr.superseded = 0;
+		slot_write(c->slot_fd, &hdr, reqs);
+		flock(c->slot_fd, LOCK_UN);
+		return n;
+	}
+
+	/* Nothing left: land while no one can hand anything over */
+	flock(c->lock_fd, LOCK_UN);
+	flock(c->slot_fd, LOCK_UN);
+	close(c->lock_fd);
+	close(c->slot_fd);
+	c->lock_fd = c->slot_fd = -1;
+
+	if (c->handed_over)
+		printf("Collapsed %lu run(s) into this one, %lu superseded "
+		       "request(s) skipped.\n", c->handed_over,
+		       c->superseded);
+	return 0;
+}
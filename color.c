@@ -0,0 +1,413 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "xsatmgr.h"
+
+/*******************************************************************************
+ * Color math helpers
+ */
+
+/**
+ * Convert a double to S31.32 sign-magnitude, exactly.
+ *
+ * Scaling by 2^32 is exact, and llrint() rounds half to even in the default
+ * rounding mode; below 2^31 the result fits in 63 bits. Larger magnitudes,
+ * infinities and NaNs saturate. contrib/s3132check.c checks this against an
+ * integer reference.
+ *
+ * @v: Input value
+ *
+ * Return: The S31.32 sign-magnitude value.
+ */
+static inline uint64_t double_to_s31_32(double v)
+{
+	int64_t q;
+
+	/* NaNs fail the compare too */
+	if (!(fabs(v) < 2147483648.0))
+		return (signbit(v) ? 1ULL << 63 : 0) | INT64_MAX;
+
+	/* No negative zero, so that equal matrices have equal blobs */
+	q = llrint(v * 4294967296.0);
+	return q < 0 ? (1ULL << 63) | -(uint64_t)q : (uint64_t)q;
+}
+
+/**
+ * Translate coefficients to a color CTM format that DRM accepts.
+ *
+ * DRM requres the CTM to be in signed-magnitude, not 2's complement.
+ * It is also in 31.32 fixed-point format. The conversion is exact and
+ * rounds half to even, see double_to_s31_32().
+ *
+ * @coeffs: Input coefficients
+ * @ctm: DRM CTM struct, used to create the blob. The translated values will be
+ *       placed here.
+ */
+void coeffs_to_ctm(const double *coeffs, struct _drm_color_ctm *ctm)
+{
+	int i;
+
+	for (i = 0; i < 9; i++)
+		ctm->matrix[i] = double_to_s31_32(coeffs[i]);
+}
+
+/**
+ * Translate a DRM CTM back into coefficients, e.g. to print it.
+ *
+ * @ctm: DRM CTM, in S31.32 sign-magnitude.
+ * @coeffs: Array of 9 doubles. The coefficients will be placed here.
+ */
+void ctm_to_coeffs(const struct _drm_color_ctm *ctm, double *coeffs)
+{
+	uint64_t v;
+	int i;
+
+	for (i = 0; i < 9; i++) {
+		v = ctm->matrix[i];
+		coeffs[i] = (v & ~(1ULL << 63)) / 4294967296.0;
+		if (v >> 63)
+			coeffs[i] = -coeffs[i];
+	}
+}
+
+/**
+ * Pack a DRM CTM into the long-padded layout RandR expects for 32-bit format
+ * properties. See set_ctm() for why this padding is needed.
+ *
+ * @ctm: The DRM CTM, as produced by coeffs_to_ctm().
+ * @padded_ctm: Array of 18 longs. Each 32-bit half of the S31.32 values is
+ *              stored in its own element.
+ */
+void pack_ctm(const struct _drm_color_ctm *ctm, long *padded_ctm)
+{
+	int i;
+
+	for (i = 0; i < 18; i++)
+		/* Think of this as a padded 'memcpy()'. */
+		padded_ctm[i] = ((const uint32_t*)ctm->matrix)[i];
+}
+
+/**
+ * Undo pack_ctm().
+ *
+ * @padded_ctm: Array of 18 longs, as packed by pack_ctm().
+ * @ctm: The DRM CTM will be filled in here.
+ */
+void unpack_ctm(const long *padded_ctm, struct _drm_color_ctm *ctm)
+{
+	int i;
+
+	for (i = 0; i < 18; i++)
+		((uint32_t *)ctm->matrix)[i] = padded_ctm[i];
+}
+
+/**
+ * Build the CTM coefficients of a saturation adjustment. The matrix keeps
+ * the gray axis in place, and scales the distance of each color from it.
+ *
+ * @value: Saturation. 1.0 is identity, 0.0 is grayscale.
+ * @coeffs: Array of 9 doubles. The CTM will be filled in here.
+ */
+void saturation_to_coeffs(double value, double *coeffs)
+{
+	double s = (1.0 - value) / 3.0;
+	int i;
+
+	for (i = 0; i < 9; i++)
+		coeffs[i] = (i % 4 == 0) ? s + value : s;
+}
+
+/**
+ * Parse a saturation value, or "default", into CTM coefficients. Unlike
+ * parse_user_ctm(), nothing is printed, so it can be used on every apply of
+ * the long-running modes.
+ *
+ * @opt: Saturation value, or "default" for the identity CTM.
+ * @coeffs: Array of 9 doubles. The requested CTM will be filled in here.
+ *
+ * Return: True if the value is valid. False otherwise.
+ */
+int parse_saturation(const char *opt, double *coeffs)
+{
+	char *end;
+	double value;
+
+	if (!strcmp(opt, "default")) {
+		saturation_to_coeffs(1.0, coeffs);
+		return 1;
+	}
+
+	value = strtod(opt, &end);
+	if (!value || *end)
+		return 0;
+
+	saturation_to_coeffs(value, coeffs);
+	return 1;
+}
+
+/**
+ * Parse a full matrix given as 9 colon separated coefficients in row major
+ * order (the same format the custom CTM is printed in), or a saturation
+ * value as accepted by parse_saturation().
+ *
+ * @opt: Matrix or saturation value.
+ * @coeffs: Array of 9 doubles. The requested CTM will be filled in here.
+ *
+ * Return: True if the value is valid. False otherwise.
+ */
+int parse_matrix(const char *opt, double *coeffs)
+{
+	const char *p = opt;
+	char *end;
+	int i;
+
+	if (!strchr(opt, ':'))
+		return parse_saturation(opt, coeffs);
+
+	for (i = 0; i < 9; i++) {
+		coeffs[i] = strtod(p, &end);
+		if (end == p || (i < 8 && *end != ':') || (i == 8 && *end))
+			return 0;
+		p = end + 1;
+	}
+	return 1;
+}
+
+/**
+ * Multiply two 3x3 matrices in row major order: out = a * b. out may not
+ * alias a or b.
+ */
+void mat3_mul(const double *a, const double *b, double *out)
+{
+	int r, c;
+
+	for (r = 0; r < 3; r++)
+		for (c = 0; c < 3; c++)
+			out[r * 3 + c] = a[r * 3 + 0] * b[0 * 3 + c] +
+					 a[r * 3 + 1] * b[1 * 3 + c] +
+					 a[r * 3 + 2] * b[2 * 3 + c];
+}
+
+/**
+ * Parse user input, and fill the coefficients array with the requested CTM.
+ *
+ * @ctm_opt: user input
+ * @coeffs: Array of 9 doubles. The requested CTM will be filled in here.
+ *
+ * Return: True if user has requested CTM change. False otherwise.
+ */
+int parse_user_ctm(char *ctm_opt, double *coeffs)
+{
+	if (!ctm_opt)
+        return 0;
+
+    if (!strcmp(ctm_opt, "default")) {
+        printf("Using identity CTM\n");
+        double temp[9] = {
+            1, 0, 0,
+            0, 1, 0,
+            0, 0, 1
+        };
+        memcpy(coeffs, temp, sizeof(double) * 9);
+        return 1;
+    }
+
+    double value = strtod(ctm_opt, NULL);
+    if(!value) {
+        printf("%s is not a valid Saturation value. Skipping.\n",
+               ctm_opt);
+        return 0;
+    }
+
+
+    double temp[9];
+    saturation_to_coeffs(value, temp);
+
+
+    printf("Using custom CTM:\n");
+    printf("    %2.4f:%2.4f:%2.4f\n", temp[0], temp[1], temp[2]);
+    printf("    %2.4f:%2.4f:%2.4f\n", temp[3], temp[4], temp[5]);
+    printf("    %2.4f:%2.4f:%2.4f\n", temp[6], temp[7], temp[8]);
+
+
+
+    memcpy(coeffs, temp, sizeof(double) * 9);
+    return 1;
+}
+
+/**
+ * Parse user input, and fill the coefficients array with the requested LUT.
+ * If predefined SRGB LUT is requested, the coefficients array is not touched,
+ * and is_srgb is set to true. See set_gamma() for why.
+ *
+ * @gamma_opt: User input
+ * @coeffs: Array of color3d structs. The requested LUT will be filled in here.
+ * @is_srgb: Will be set to true if user requested SRGB LUT.
+ *
+ * Return: True if user has requested gamma change. False otherwise.
+ */
+int parse_user_gamma(char *gamma_opt, struct color3d *coeffs, int *is_srgb)
+{
+	const char *p;
+	char *end;
+	double exps[3], x;
+	int i, n = 0;
+
+	if (!gamma_opt)
+		return 0;
+
+	*is_srgb = !strcmp(gamma_opt, "srgb");
+	if (*is_srgb) {
+		printf("Using SRGB LUT\n");
+		return 1;
+	}
+
+	/* "linear", or the exponent of a power law, either one for all
+	 * channels or three colon separated ones */
+	p = strcmp(gamma_opt, "linear") ? gamma_opt : "1.0";
+	do {
+		exps[n] = strtod(p, &end);
+		if (end == p || exps[n] <= 0)
+			break;
+		n++;
+		p = end + 1;
+	} while (n < 3 && *end == ':');
+
+	if (*end || (n != 1 && n != 3)) {
+		printf("%s is not a valid gamma value. Skipping.\n", gamma_opt);
+		return 0;
+	}
+	if (n == 1)
+		exps[1] = exps[2] = exps[0];
+
+	for (i = 0; i < LUT_SIZE; i++) {
+		x = (double)i / (LUT_SIZE - 1);
+		coeffs[i].r = pow(x, exps[0]);
+		coeffs[i].g = pow(x, exps[1]);
+		coeffs[i].b = pow(x, exps[2]);
+	}
+
+	printf("Using power law LUT: %2.4f:%2.4f:%2.4f\n", exps[0], exps[1],
+	       exps[2]);
+	return 1;
+}
+
+static double color3d_channel(const struct color3d *c, int ch)
+{
+	return ch == 0 ? c->r : ch == 1 ? c->g : c->b;
+}
+
+static uint16_t lut_channel(const struct _drm_color_lut *e, int ch)
+{
+	return ch == 0 ? e->red : ch == 1 ? e->green : e->blue;
+}
+
+/* Quantize a LUT value in [0, 1] to U0.16. */
+static uint16_t lut_quantize(double v)
+{
+	v = v < 0 ? 0 : v > 1 ? 1 : v;
+	return lround(v * 0xffff);
+}
+
+static void lut_entry(struct _drm_color_lut *e, double r, double g, double b)
+{
+	e->red = lut_quantize(r);
+	e->green = lut_quantize(g);
+	e->blue = lut_quantize(b);
+	e->reserved = 0;
+}
+
+/* Sample a full size LUT at x in [0, 1], between its entries if need be. */
+static double lut_sample(const struct color3d *coeffs, int ch, double x)
+{
+	double pos = x * (LUT_SIZE - 1);
+	int i = pos;
+
+	if (i >= LUT_SIZE - 1)
+		return color3d_channel(&coeffs[LUT_SIZE - 1], ch);
+	return color3d_channel(&coeffs[i], ch) + (pos - i) *
+	       (color3d_channel(&coeffs[i + 1], ch) -
+		color3d_channel(&coeffs[i], ch));
+}
+
+/**
+ * Build the DRM LUT blob of a curve, at the legacy size if that is close
+ * enough.
+ *
+ * The curve is sampled at the LEGACY_LUT_SIZE entries of the legacy LUT,
+ * and the reduced LUT, interpolated linearly between its entries as the
+ * hardware does, is compared to the full size LUT at each of its entries.
+ * If the largest difference is within max_error, the reduced LUT is kept.
+ *
+ * @coeffs: The curve, LUT_SIZE entries.
+ * @lut: Filled in with the LUT blob, room for LUT_SIZE entries.
+ * @max_error: Largest difference allowed, in LUT units. 0 never reduces.
+ * @error: Set to the largest difference of the reduced LUT.
+ *
+ * Return: Number of entries of the LUT, LEGACY_LUT_SIZE or LUT_SIZE.
+ */
+int coeffs_to_lut(const struct color3d *coeffs, struct _drm_color_lut *lut,
+		  unsigned int max_error, unsigned int *error)
+{
+	double x, pos, reduced, diff, worst = 0;
+	int i, j, ch;
+
+	for (i = 0; i < LEGACY_LUT_SIZE; i++) {
+		x = (double)i / (LEGACY_LUT_SIZE - 1);
+		lut_entry(&lut[i], lut_sample(coeffs, 0, x),
+			  lut_sample(coeffs, 1, x), lut_sample(coeffs, 2, x));
+	}
+
+	for (j = 0; j < LUT_SIZE; j++) {
+		pos = (double)j * (LEGACY_LUT_SIZE - 1) / (LUT_SIZE - 1);
+		i = pos;
+		if (i >= LEGACY_LUT_SIZE - 1)
+			i = LEGACY_LUT_SIZE - 2;
+
+		for (ch = 0; ch < 3; ch++) {
+			reduced = lut_channel(&lut[i], ch) + (pos - i) *
+				  (lut_channel(&lut[i + 1], ch) -
+				   lut_channel(&lut[i], ch));
+			diff = fabs(reduced - lut_quantize(
+				    color3d_channel(&coeffs[j], ch)));
+			if (diff > worst)
+				worst = diff;
+		}
+	}
+
+	*error = lround(worst);
+	if (max_error && *error <= max_error)
+		return LEGACY_LUT_SIZE;
+
+	for (j = 0; j < LUT_SIZE; j++)
+		lut_entry(&lut[j], coeffs[j].r, coeffs[j].g, coeffs[j].b);
+	return LUT_SIZE;
+}
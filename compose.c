@@ -0,0 +1,206 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "xsatmgr.h"
+
+/*******************************************************************************
+ * Layered color composition
+ *
+ * Night-light tools, accessibility filters and saturation managers all want
+ * a say in the single CTM of an output. Instead of each of them overwriting
+ * the others, they register a named layer with the composing service, which
+ * multiplies all layers of an output into the one matrix that gets written.
+ */
+
+/**
+ * Add or replace a layer. Layers are kept sorted by priority; layers of equal
+ * priority keep their registration order.
+ *
+ * @c: The compositor
+ * @name: Layer name.
+ * @priority: Layer priority, see struct layer.
+ * @outputs: Comma separated outputs the layer applies to, "*" for all.
+ * @coeffs: The layer's matrix.
+ *
+ * Return: 0 on success, -ENOSPC if there are too many layers.
+ */
+int compositor_set_layer(struct compositor *c, const char *name,
+			 int priority, const char *outputs,
+			 const double *coeffs)
+{
+	struct layer layer;
+	int i;
+
+	memset(&layer, 0, sizeof(layer));
+	snprintf(layer.name, sizeof(layer.name), "%s", name);
+	snprintf(layer.outputs, sizeof(layer.outputs), "%s", outputs);
+	layer.priority = priority;
+	memcpy(layer.coeffs, coeffs, sizeof(layer.coeffs));
+
+	compositor_remove_layer(c, layer.name);
+	if (c->nlayers == MAX_LAYERS)
+		return -ENOSPC;
+
+	for (i = c->nlayers; i > 0; i--) {
+		if (c->layers[i - 1].priority <= priority)
+			break;
+		c->layers[i] = c->layers[i - 1];
+	}
+	c->layers[i] = layer;
+	c->nlayers++;
+	return 0;
+}
+
+/**
+ * Remove a layer by name.
+ *
+ * Return: 0 on success, -ENOENT if there is no such layer.
+ */
+int compositor_remove_layer(struct compositor *c, const char *name)
+{
+	int i;
+
+	for (i = 0; i < c->nlayers; i++) {
+		if (strcmp(c->layers[i].name, name))
+			continue;
+		memmove(&c->layers[i], &c->layers[i + 1],
+			sizeof(c->layers[0]) * (c->nlayers - i - 1));
+		c->nlayers--;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+/**
+ * Compose all layers applying to an output into a single matrix. Layers are
+ * applied in increasing priority order, i.e. for layers L1 < L2 < L3 the
+ * result is L3 * L2 * L1. With no layers, this is the identity.
+ *
+ * @c: The compositor
+ * @output: Output name.
+ * @coeffs: Array of 9 doubles. The composed matrix is placed here.
+ */
+void compositor_compose(const struct compositor *c, const char *output,
+			double *coeffs)
+{
+	const struct layer *layer;
+	double tmp[9];
+	int i;
+
+	saturation_to_coeffs(1.0, coeffs);
+
+	for (i = 0; i < c->nlayers; i++) {
+		layer = &c->layers[i];
+		if (strcmp(layer->outputs, "*") &&
+		    !name_in_list(output, layer->outputs))
+			continue;
+
+		mat3_mul(layer->coeffs, coeffs, tmp);
+		memcpy(coeffs, tmp, sizeof(tmp));
+	}
+}
+
+/**
+ * Connect to a control socket of a running service, send one request line
+ * and print the reply.
+ *
+ * @socket_path: Unix socket the service listens on.
+ * @request: Request line, without the trailing newline.
+ *
+ * Return: 0 if the service accepted the request, non-zero otherwise.
+ */
+int send_request(const char *socket_path, const char *request)
+{
+	struct sockaddr_un addr;
+	char reply[LINE_LEN];
+	ssize_t n, len = 0;
+	int fd, ret = 1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		printf("Cannot connect to %s. %s\n", socket_path,
+		       strerror(errno));
+		goto out;
+	}
+
+	if (dprintf(fd, "%s\n", request) < 0)
+		goto out;
+	shutdown(fd, SHUT_WR);
+
+	while (len < (ssize_t)sizeof(reply) - 1 &&
+	       (n = read(fd, reply + len, sizeof(reply) - 1 - len)) > 0)
+		len += n;
+	reply[len] = '\0';
+
+	printf("%s", reply);
+	ret = strncmp(reply, "ok", 2) != 0;
+out:
+	close(fd);
+	return ret;
+}
+
+/**
+ * Register a layer with a running composing service.
+ *
+ * @socket_path: Unix socket the service listens on.
+ * @layer: Layer name, optionally followed by ":<priority>".
+ * @outputs: Comma separated outputs, NULL for all.
+ * @value: Saturation, "default", or a full matrix, see parse_matrix().
+ *
+ * Return: 0 if the service accepted the layer, non-zero otherwise.
+ */
+int send_layer_request(const char *socket_path, const char *layer,
+		       const char *outputs, const char *value)
+{
+	char request[LINE_LEN];
+	char name[LAYER_NAME_LEN];
+	const char *colon = strchr(layer, ':');
+	int priority = 0;
+
+	snprintf(name, sizeof(name), "%.*s",
+		 colon ? (int)(colon - layer) : (int)strlen(layer), layer);
+	if (colon)
+		priority = atoi(colon + 1);
+
+	snprintf(request, sizeof(request), "layer %s %d %s %s", name,
+		 priority, outputs ? outputs : "*", value);
+	return send_request(socket_path, request);
+}
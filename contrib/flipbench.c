@@ -0,0 +1,404 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xpresent.h>
+
+/*******************************************************************************
+ * Frame pacing analyzer
+ *
+ * Checks whether color writes delay page flips. A test client flips a
+ * window every vblank with Present, and timestamps the completion of each
+ * flip, first on its own (baseline), then while a writer command is fed
+ * color requests on stdin at a given rate. Flips that missed their vblank
+ * are counted in both phases, and those landing shortly after a write are
+ * compared against the baseline miss rate, which leaves what the writes
+ * are responsible for.
+ *
+ * The writer is typically cmdemo in stream mode. Any command reading lines
+ * works, e.g. `cat > /dev/null` to check the harness itself on Xvfb.
+ *
+ * Usage: flipbench [-t <seconds>] [-r <rate>] [-b <burst>] [-v <a>,<b>]
+ *                  -- <writer command>
+ * e.g.:  flipbench -r 30 -b 4 -- ./cmdemo -s -o DisplayPort-0
+ *
+ * On real hardware, run without a compositor, so that the window covering
+ * the screen is flipped rather than copied.
+ */
+
+/* Up to this many frames per second are recorded */
+#define MAX_RATE 360
+
+/* A flip is late if it took this many frame periods, in 1/100th */
+#define LATE_PCT 150
+
+/* Late flips up to this many frame periods after a write are near it */
+#define NEAR_FRAMES 2
+
+enum phase {
+	PHASE_BASELINE,
+	PHASE_WRITES,
+	NUM_PHASES,
+};
+
+static const char *const phase_names[] = { "baseline", "writes" };
+
+/* A completed flip, timed by the server. */
+struct frame {
+	uint64_t ust;	/* Microseconds, CLOCK_MONOTONIC */
+	uint64_t msc;
+	enum phase phase;
+};
+
+static struct frame *frames;
+static int nframes, max_frames;
+static uint64_t *writes;
+static int nwrites, max_writes;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+/* Start the writer, with its stdin on the returned pipe. */
+static int start_writer(char *const argv[], pid_t *pid)
+{
+	int fds[2], fd;
+
+	if (pipe(fds)) {
+		printf("Cannot create pipe. %s\n", strerror(errno));
+		return -1;
+	}
+
+	*pid = fork();
+	if (*pid < 0) {
+		printf("Cannot start %s. %s\n", argv[0], strerror(errno));
+		return -1;
+	}
+
+	if (!*pid) {
+		dup2(fds[0], STDIN_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0)
+			dup2(fd, STDOUT_FILENO);
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	/* Never let a stuck writer hold up the flips being measured */
+	close(fds[0]);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	return fds[1];
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Interval before each flip of a phase, sorted. */
+static int phase_intervals(enum phase phase, uint64_t *intervals)
+{
+	int i, n = 0;
+
+	for (i = 1; i < nframes; i++)
+		if (frames[i].phase == phase && frames[i - 1].phase == phase)
+			intervals[n++] = frames[i].ust - frames[i - 1].ust;
+	qsort(intervals, n, sizeof(*intervals), cmp_u64);
+	return n;
+}
+
+/* Check if a flip missed its vblank. */
+static int frame_late(int i, uint64_t period)
+{
+	return frames[i].msc - frames[i - 1].msc > 1 ||
+	       (frames[i].ust - frames[i - 1].ust) * 100 > period * LATE_PCT;
+}
+
+/* Check if a flip completed shortly after a write. */
+static int frame_near_write(int i, uint64_t period)
+{
+	uint64_t start = frames[i - 1].ust;
+	uint64_t end = frames[i].ust;
+	int j;
+
+	/* Writes are sorted, and so are frames, but this runs once */
+	for (j = 0; j < nwrites; j++)
+		if (writes[j] < end && writes[j] + NEAR_FRAMES * period >= start)
+			return 1;
+	return 0;
+}
+
+static void report(int dropped)
+{
+	uint64_t *intervals = calloc(nframes, sizeof(*intervals));
+	uint64_t period;
+	int late[NUM_PHASES] = { 0 }, count[NUM_PHASES] = { 0 };
+	int i, n, near = 0, near_late = 0;
+	enum phase p;
+	double expected;
+
+	if (!intervals || phase_intervals(PHASE_BASELINE, intervals) < 2) {
+		printf("Not enough flips to analyze.\n");
+		free(intervals);
+		return;
+	}
+	period = intervals[phase_intervals(PHASE_BASELINE, intervals) / 2];
+
+	for (i = 1; i < nframes; i++) {
+		p = frames[i].phase;
+		if (frames[i - 1].phase != p)
+			continue;
+		count[p]++;
+		late[p] += frame_late(i, period);
+
+		if (p == PHASE_WRITES && frame_near_write(i, period)) {
+			near++;
+			near_late += frame_late(i, period);
+		}
+	}
+
+	printf("Frame period %.3f ms (baseline median)\n", period / 1e3);
+	printf("%-9s %7s %6s %7s %8s %8s %8s\n", "", "flips", "late", "late%",
+	       "p50 ms", "p99 ms", "max ms");
+	for (p = 0; p < NUM_PHASES; p++) {
+		n = phase_intervals(p, intervals);
+		if (!n)
+			continue;
+		printf("%-9s %7d %6d %7.2f %8.3f %8.3f %8.3f\n",
+		       phase_names[p], count[p], late[p],
+		       100.0 * late[p] / count[p], intervals[n / 2] / 1e3,
+		       intervals[n * 99 / 100] / 1e3, intervals[n - 1] / 1e3);
+	}
+
+	/* Flips near a write would miss at the baseline rate anyway */
+	expected = count[PHASE_BASELINE] ?
+		   (double)near * late[PHASE_BASELINE] /
+		   count[PHASE_BASELINE] : 0;
+	printf("Writes: %d sent, %d dropped by a full pipe\n", nwrites,
+	       dropped);
+	printf("%d of %d flip(s) near a write were late, %.1f expected from "
+	       "the baseline: %.1f late flip(s) attributable to the writes\n",
+	       near_late, near, expected,
+	       near_late > expected ? near_late - expected : 0);
+	free(intervals);
+}
+
+/* Fill a pixmap with one color, so that consecutive flips differ. */
+static Pixmap make_pixmap(Display *dpy, Window win, int w, int h,
+			  unsigned long color)
+{
+	Pixmap pixmap;
+	GC gc;
+
+	pixmap = XCreatePixmap(dpy, win, w, h,
+			       DefaultDepth(dpy, DefaultScreen(dpy)));
+	gc = XCreateGC(dpy, pixmap, 0, NULL);
+	XSetForeground(dpy, gc, color);
+	XFillRectangle(dpy, pixmap, gc, 0, 0, w, h);
+	XFreeGC(dpy, gc);
+	return pixmap;
+}
+
+int main(int argc, char *argv[])
+{
+	XSetWindowAttributes attrs = { 0 };
+	XPresentCompleteNotifyEvent *ce;
+	Display *dpy;
+	Window root, win;
+	Pixmap pixmaps[2];
+	XEvent ev;
+	struct pollfd pfd;
+	const char *values[2] = { "1.0", "0.98" };
+	char valbuf[64], line[80], *comma;
+	uint64_t start, end, now, next_write = 0, wait_us;
+	int seconds = 5, rate = 10, burst = 1;
+	int opcode, event_base, error_base, w, h;
+	int opt, fd = -1, len, i, dropped = 0;
+	enum phase phase = PHASE_BASELINE;
+	pid_t pid = 0;
+
+	while ((opt = getopt(argc, argv, "t:r:b:v:")) != -1) {
+		if (opt == 't')
+			seconds = atoi(optarg);
+		else if (opt == 'r')
+			rate = atoi(optarg);
+		else if (opt == 'b')
+			burst = atoi(optarg);
+		else if (opt == 'v') {
+			snprintf(valbuf, sizeof(valbuf), "%s", optarg);
+			comma = strchr(valbuf, ',');
+			if (!comma)
+				break;
+			*comma = '\0';
+			values[0] = valbuf;
+			values[1] = comma + 1;
+		}
+		else
+			break;
+	}
+	if (opt != -1 || optind == argc || seconds <= 0 || rate <= 0 ||
+	    burst <= 0) {
+		printf("Usage: flipbench [-t <seconds>] [-r <rate>] "
+		       "[-b <burst>] [-v <a>,<b>] -- <writer command>\n");
+		return 1;
+	}
+
+	dpy = XOpenDisplay(NULL);
+	if (!dpy) {
+		printf("Cannot open display, check the DISPLAY environment "
+		       "variable.\n");
+		return 1;
+	}
+	if (!XPresentQueryExtension(dpy, &opcode, &event_base, &error_base)) {
+		printf("Present is not available.\n");
+		return 1;
+	}
+
+	max_frames = 2 * seconds * MAX_RATE;
+	max_writes = seconds * rate * burst;
+	frames = calloc(max_frames, sizeof(*frames));
+	writes = calloc(max_writes, sizeof(*writes));
+	if (!frames || !writes) {
+		printf("Cannot allocate %d frames.\n", max_frames);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	fd = start_writer(argv + optind, &pid);
+	if (fd < 0)
+		return 1;
+
+	/* A window covering the screen, out of reach of the window manager */
+	root = DefaultRootWindow(dpy);
+	w = DisplayWidth(dpy, DefaultScreen(dpy));
+	h = DisplayHeight(dpy, DefaultScreen(dpy));
+	attrs.override_redirect = True;
+	win = XCreateWindow(dpy, root, 0, 0, w, h, 0, CopyFromParent,
+			    InputOutput, CopyFromParent, CWOverrideRedirect,
+			    &attrs);
+	XMapWindow(dpy, win);
+	pixmaps[0] = make_pixmap(dpy, win, w, h, 0x202020);
+	pixmaps[1] = make_pixmap(dpy, win, w, h, 0x404040);
+	XPresentSelectInput(dpy, win, PresentCompleteNotifyMask);
+
+	/* One flip in flight at a time, each on the vblank after the last */
+	XPresentPixmap(dpy, win, pixmaps[0], 0, None, None, 0, 0, None, None,
+		       None, 0, 0, 0, 0, NULL, 0);
+	XFlush(dpy);
+
+	start = now_us();
+	end = start + 2ull * seconds * 1000000;
+	printf("Baseline for %d s, then %d burst(s) of %d write(s) per "
+	       "second for %d s\n", seconds, rate, burst, seconds);
+
+	while ((now = now_us()) < end && nframes < max_frames) {
+		if (phase == PHASE_BASELINE &&
+		    now >= start + seconds * 1000000ull) {
+			phase = PHASE_WRITES;
+			next_write = now;
+		}
+
+		/* Alternate between the values of the lines delivered, so
+		 * that no write is skipped as unchanged. Lines dropped by a
+		 * full pipe never reach the server, and are not counted as
+		 * writes. Lines are shorter than PIPE_BUF, so they are either
+		 * delivered whole or not at all. */
+		if (phase == PHASE_WRITES && now >= next_write) {
+			for (i = 0; i < burst && nwrites < max_writes; i++) {
+				len = snprintf(line, sizeof(line), "%s\n",
+					       values[nwrites % 2]);
+				if (write(fd, line, len) != len) {
+					dropped++;
+					continue;
+				}
+				writes[nwrites++] = now_us();
+			}
+			next_write += 1000000 / rate;
+		}
+
+		while (XPending(dpy)) {
+			XNextEvent(dpy, &ev);
+			if (ev.type != GenericEvent ||
+			    ev.xcookie.extension != opcode ||
+			    !XGetEventData(dpy, &ev.xcookie))
+				continue;
+
+			ce = ev.xcookie.data;
+			if (ev.xcookie.evtype == PresentCompleteNotify &&
+			    ce->kind == PresentCompleteKindPixmap) {
+				frames[nframes].ust = ce->ust;
+				frames[nframes].msc = ce->msc;
+				frames[nframes].phase = phase;
+				nframes++;
+
+				XPresentPixmap(dpy, win, pixmaps[nframes % 2],
+					       nframes, None, None, 0, 0, None,
+					       None, None, 0, ce->msc + 1, 0, 0,
+					       NULL, 0);
+				XFlush(dpy);
+			}
+			XFreeEventData(dpy, &ev.xcookie);
+		}
+
+		/* Sleep until the next write, or the end of the baseline */
+		now = now_us();
+		wait_us = phase == PHASE_WRITES ? next_write :
+			  start + seconds * 1000000ull;
+		wait_us = wait_us > now ? wait_us - now : 0;
+		pfd.fd = ConnectionNumber(dpy);
+		pfd.events = POLLIN;
+		poll(&pfd, 1, (wait_us + 999) / 1000);
+	}
+
+	close(fd);
+	waitpid(pid, NULL, 0);
+	report(dropped);
+
+	XFreePixmap(dpy, pixmaps[0]);
+	XFreePixmap(dpy, pixmaps[1]);
+	XDestroyWindow(dpy, win);
+	XCloseDisplay(dpy);
+	return 0;
+}
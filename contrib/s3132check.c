@@ -0,0 +1,198 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/* The conversion under test is static: build it right in. This also brings
+ * now_ns() from xsatmgr.h. */
+#include "../color.c"
+
+/*******************************************************************************
+ * S31.32 conversion check
+ *
+ * Checks double_to_s31_32() against a plain integer reference: every
+ * exponent with edge mantissas, the exact ties of the S31.32 grid and their
+ * neighbors around a few bases, and random bit patterns and values. Prints
+ * the first mismatches, and the time per conversion.
+ *
+ * Usage: s3132check [<random values>]
+ */
+
+#define MAX_REPORTS 10
+
+static const double tie_bases[] = { 0.0, 0.5, 1.0, 2.0, 1073741824.0 };
+#define NUM_TIE_BASES (sizeof(tie_bases)/sizeof(tie_bases[0]))
+
+static unsigned long nchecked, nmismatch;
+
+static uint64_t xorshift64(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+/*
+ * |v| * 2^32 == mant * 2^(exp - 1075 + 32), rounded half to even by hand,
+ * saturated to the 63-bit magnitude.
+ */
+static uint64_t reference(double v)
+{
+	uint64_t bits, mant, q, r, half, mag;
+	int exp, sh;
+
+	memcpy(&bits, &v, sizeof(bits));
+	exp = (bits >> 52) & 0x7ff;
+	mant = bits & ((1ULL << 52) - 1);
+
+	if (exp == 0x7ff) {
+		mag = INT64_MAX;
+	} else {
+		if (exp)
+			mant |= 1ULL << 52;
+		else
+			exp = 1;
+		sh = exp - 1043;
+
+		if (sh >= 0) {
+			if (sh > 10 || mant << sh > INT64_MAX)
+				mag = INT64_MAX;
+			else
+				mag = mant << sh;
+		} else if (-sh > 54) {
+			/* Less than half of the last bit */
+			mag = 0;
+		} else {
+			q = mant >> -sh;
+			r = mant - (q << -sh);
+			half = 1ULL << (-sh - 1);
+			mag = q + (r > half || (r == half && (q & 1)));
+		}
+	}
+
+	if (!mag)
+		return 0;
+	return (bits & (1ULL << 63)) | mag;
+}
+
+static void check(double v)
+{
+	uint64_t got = double_to_s31_32(v), want = reference(v);
+
+	nchecked++;
+	if (got == want)
+		return;
+	if (nmismatch++ < MAX_REPORTS)
+		printf("%a: got 0x%016llx, want 0x%016llx\n", v,
+		       (unsigned long long)got, (unsigned long long)want);
+}
+
+static void check_bits(uint64_t bits)
+{
+	double v;
+
+	memcpy(&v, &bits, sizeof(v));
+	check(v);
+}
+
+/* v and its neighbors, of both signs */
+static void check_around(double v)
+{
+	check(v);
+	check(-v);
+	check(nextafter(v, INFINITY));
+	check(-nextafter(v, INFINITY));
+	check(nextafter(v, -INFINITY));
+	check(-nextafter(v, -INFINITY));
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t exp, mant, state = 0x9e3779b97f4a7c15ULL, start;
+	unsigned long nrandom = 10000000, i;
+	volatile uint64_t result;
+	uint64_t sum = 0;
+	double *values;
+	long k;
+	int b;
+
+	if (argc > 2) {
+		printf("Usage: s3132check [<random values>]\n");
+		return 1;
+	}
+	if (argc == 2)
+		nrandom = strtoul(argv[1], NULL, 10);
+
+	/* Every exponent, with mantissas at every bit boundary */
+	for (exp = 0; exp < 0x800; exp++) {
+		for (b = 0; b < 52; b++) {
+			for (mant = (1ULL << b) - 1; mant <= (1ULL << b) + 1;
+			     mant++) {
+				check_bits(exp << 52 | mant);
+				check_bits(1ULL << 63 | exp << 52 | mant);
+			}
+		}
+		check_bits(exp << 52 | ((1ULL << 52) - 1));
+		check_bits(1ULL << 63 | exp << 52 | ((1ULL << 52) - 1));
+	}
+
+	/* Ties of the S31.32 grid, and the doubles next to them */
+	for (b = 0; b < NUM_TIE_BASES; b++)
+		for (k = -(1L << 20); k < 1L << 20; k++)
+			check_around(tie_bases[b] + (2 * k + 1) / 8589934592.0);
+
+	/* Random bit patterns, then random values where coefficients live */
+	for (i = 0; i < nrandom; i++)
+		check_bits(xorshift64(&state));
+
+	values = calloc(nrandom, sizeof(*values));
+	if (!values)
+		return 1;
+	for (i = 0; i < nrandom; i++) {
+		values[i] = (xorshift64(&state) >> 11) / 9007199254740992.0;
+		values[i] = values[i] * 8.0 - 4.0;
+		check(values[i]);
+	}
+
+	start = now_ns();
+	for (i = 0; i < nrandom; i++)
+		sum += double_to_s31_32(values[i]);
+	result = sum;
+	(void)result;
+	if (nrandom)
+		printf("%.2f ns per conversion\n",
+		       (double)(now_ns() - start) / nrandom);
+	free(values);
+
+	printf("%lu values, %lu mismatch(es)\n", nchecked, nmismatch);
+	return nmismatch != 0;
+}
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Allocation soak: replay a trace (recorded with -T) on Xvfb for hours with a
+# build from `make ALLOC_WATCH=1`, and fail if the apply path allocated after
+# the first pass. Run by `make soak`.
+#
+# Usage: soak.sh <cmdemo> <trace> [<hours>] [<speed>]
+# e.g.:  soak.sh ./cmdemo workstation.bin 4
+
+set -u
+
+if [ $# -lt 2 ]; then
+	echo "Usage: soak.sh <cmdemo> <trace> [<hours>] [<speed>]"
+	exit 1
+fi
+cmdemo=$1
+trace=$2
+hours=${3:-4}
+speed=${4:-1}
+
+# Span of the trace, from the time of its last 120-byte record after the
+# 16-byte header
+size=$(wc -c < "$trace") || exit 1
+nrecs=$(( (size - 16) / 120 ))
+if [ "$nrecs" -lt 1 ]; then
+	echo "$trace holds no records."
+	exit 1
+fi
+span_ns=$(od -An -t u8 -j $(( 16 + (nrecs - 1) * 120 )) -N 8 "$trace" |
+	  tr -d ' ')
+
+# Enough passes to fill the soak, at least two so that one is steady state
+passes=$(awk -v h="$hours" -v s="$speed" -v ns="$span_ns" \
+	 'BEGIN { p = int(h * 3600e9 * s / (ns > 0 ? ns : 1)) + 1;
+		  print p < 2 ? 2 : p }')
+
+display=:$(( $$ % 1000 + 100 ))
+Xvfb "$display" -screen 0 1920x1080x24 -nolisten tcp > /dev/null 2>&1 &
+xvfb=$!
+trap 'kill $xvfb 2> /dev/null' EXIT INT TERM
+sleep 1
+
+echo "Soaking $cmdemo for $hours h: $passes pass(es) of $trace at" \
+     "${speed}x on $display"
+"$cmdemo" -Y "$trace@${speed}x$passes" -d "$display" -X
+ret=$?
+
+case $ret in
+0) echo "Soak passed." ;;
+2) echo "Soak failed: the apply path allocated after the first pass." ;;
+*) echo "Soak failed: replay exited with $ret." ;;
+esac
+exit $ret
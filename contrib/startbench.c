@@ -0,0 +1,163 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/*******************************************************************************
+ * Startup benchmark
+ *
+ * cmdemo is launched from udev rules and hotkeys, so the time from exec to
+ * exit matters as much as the apply itself. This runs each given build of
+ * cmdemo many times with the same arguments, interleaved so that they see
+ * the same system noise, and reports the exec-to-exit time of each.
+ *
+ * Usage: startbench <runs> "<args>" <binary>...
+ * e.g.:  startbench 200 "-o DisplayPort-0 -c 1.0" ./cmdemo ./cmdemo-release
+ */
+
+#define MAX_BINARIES 8
+#define MAX_ARGS 32
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Run a binary once, with its output discarded. A run that fails is not a
+ * fast run: any non-zero exit, e.g. no display or an unknown output, fails
+ * the benchmark rather than being timed.
+ *
+ * Return: 0 on success, the exit status, or -1 if it did not exit.
+ */
+static int run_once(char *const argv[], uint64_t *elapsed_ns)
+{
+	uint64_t start;
+	pid_t pid;
+	int status, fd;
+
+	start = now_ns();
+	pid = fork();
+	if (pid < 0)
+		return -1;
+
+	if (!pid) {
+		fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		execv(argv[0], argv);
+		_exit(127);
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+		return -1;
+	*elapsed_ns = now_ns() - start;
+
+	if (!WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+	char *args[MAX_ARGS + 2];
+	char argbuf[1024];
+	char *save, *arg;
+	uint64_t *times[MAX_BINARIES];
+	int runs, nbins, nargs = 1;
+	int i, j, n;
+
+	if (argc < 4 || argc - 3 > MAX_BINARIES) {
+		printf("Usage: startbench <runs> \"<args>\" <binary>...\n");
+		return 1;
+	}
+
+	runs = atoi(argv[1]);
+	if (runs <= 0) {
+		printf("Invalid number of runs %s.\n", argv[1]);
+		return 1;
+	}
+	nbins = argc - 3;
+
+	snprintf(argbuf, sizeof(argbuf), "%s", argv[2]);
+	for (arg = strtok_r(argbuf, " ", &save); arg && nargs <= MAX_ARGS;
+	     arg = strtok_r(NULL, " ", &save))
+		args[nargs++] = arg;
+	args[nargs] = NULL;
+
+	for (i = 0; i < nbins; i++) {
+		times[i] = calloc(runs, sizeof(*times[i]));
+		if (!times[i])
+			return 1;
+	}
+
+	/* Interleave the builds, one warm-up run each first */
+	for (j = -1; j < runs; j++) {
+		for (i = 0; i < nbins; i++) {
+			uint64_t elapsed;
+
+			args[0] = argv[3 + i];
+			n = run_once(args, &elapsed);
+			if (n) {
+				printf("%s %s failed (%d), not timing it.\n",
+				       args[0], argv[2], n);
+				return 1;
+			}
+			if (j >= 0)
+				times[i][j] = elapsed;
+		}
+	}
+
+	printf("%-24s %10s %10s %10s  (ms, %d runs of '%s')\n", "binary",
+	       "min", "median", "p99", runs, argv[2]);
+	for (i = 0; i < nbins; i++) {
+		qsort(times[i], runs, sizeof(*times[i]), cmp_u64);
+		printf("%-24s %10.3f %10.3f %10.3f\n", argv[3 + i],
+		       times[i][0] / 1e6, times[i][runs / 2] / 1e6,
+		       times[i][(runs * 99) / 100] / 1e6);
+		free(times[i]);
+	}
+	return 0;
+}
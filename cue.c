@@ -0,0 +1,256 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "xsatmgr.h"
+
+/*******************************************************************************
+ * Cue lists
+ *
+ * For live events, looks are prepared ahead of time as a list of cues, and
+ * fired on cue. All parsing happens when the list is loaded: each cue is
+ * compiled into the packed CTM of its look for every output, and the weight
+ * of that look at every frame of its fade. Firing a cue blends from what
+ * each output has at that moment, so cues can be fired in any order, even
+ * in the middle of another fade, without a jump; that is a few
+ * multiplications per output and frame, with no allocation.
+ *
+ * Cue file format:
+ *
+ *   # comment
+ *   cue <name> [<fade ms>]
+ *   <outputs> <value>
+ *   ...
+ *
+ * where outputs is a comma separated list of outputs, and value a saturation,
+ * "default" or a full matrix (see parse_matrix()).
+ */
+
+/**
+ * Compile a parsed cue: pack the look of every output, and compute the
+ * weight of the look at every frame of the fade.
+ *
+ * @cue: The cue. Its outputs hold the target coefficients.
+ * @frame_ns: Frame period of the display the cue will be played on.
+ *
+ * Return: 0 on success, -ENOMEM otherwise.
+ */
+static int compile_cue(struct cue *cue, uint64_t frame_ns)
+{
+	struct cue_output *co;
+	struct _drm_color_ctm ctm;
+	int i, f;
+
+	cue->nframes = (cue->fade_ms * 1000000ull + frame_ns - 1) / frame_ns;
+	if (cue->nframes < 1)
+		cue->nframes = 1;
+
+	/* Linear fade, the last frame is the cue's look */
+	cue->weights = calloc(cue->nframes, sizeof(*cue->weights));
+	if (!cue->weights)
+		return -ENOMEM;
+	for (f = 0; f < cue->nframes; f++)
+		cue->weights[f] = (double)(f + 1) / cue->nframes;
+
+	for (i = 0; i < cue->noutputs; i++) {
+		co = &cue->outputs[i];
+		coeffs_to_ctm(co->coeffs, &ctm);
+		pack_ctm(&ctm, co->ctm);
+	}
+	return 0;
+}
+
+/* Add "<outputs> <value>" of a cue file to a cue. */
+static int parse_cue_line(struct cue *cue, char *outputs, const char *value)
+{
+	double coeffs[9];
+	char *name, *save;
+
+	if (!parse_matrix(value, coeffs))
+		return -EINVAL;
+
+	for (name = strtok_r(outputs, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		if (cue->noutputs == MAX_OUTPUTS)
+			return -ENOSPC;
+		snprintf(cue->outputs[cue->noutputs].name, OUTPUT_NAME_LEN,
+			 "%s", name);
+		memcpy(cue->outputs[cue->noutputs].coeffs, coeffs,
+		       sizeof(coeffs));
+		cue->noutputs++;
+	}
+	return 0;
+}
+
+/**
+ * Load and compile a cue list.
+ *
+ * @cl: The cue list to fill in. Release with cue_list_free().
+ * @path: Cue file path.
+ * @frame_ns: Frame period of the display the cues will be played on.
+ *
+ * Return: 0 on success, non-zero otherwise.
+ */
+int cue_list_load(struct cue_list *cl, const char *path, uint64_t frame_ns)
+{
+	char line[LINE_LEN];
+	char *tok[3], *save, *end;
+	unsigned long fade;
+	struct cue *cue = NULL, *cues;
+	int lineno = 0, n, ret = 0;
+	FILE *f;
+
+	memset(cl, 0, sizeof(*cl));
+	cl->current = -1;
+
+	f = fopen(path, "re");
+	if (!f) {
+		printf("Cannot open cue list %s. %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	while (!ret && fgets(line, sizeof(line), f)) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+
+		for (n = 0; n < 3; n++) {
+			tok[n] = strtok_r(n ? NULL : line, " \t", &save);
+			if (!tok[n])
+				break;
+		}
+		if (!n || tok[0][0] == '#')
+			continue;
+
+		if (!strcmp(tok[0], "cue") && n >= 2) {
+			if (cue)
+				ret = compile_cue(cue, frame_ns);
+			if (ret)
+				break;
+			cues = realloc(cl->cues,
+				       sizeof(*cues) * (cl->ncues + 1));
+			if (!cues) {
+				ret = -ENOMEM;
+				break;
+			}
+			cl->cues = cues;
+			cue = &cl->cues[cl->ncues++];
+			memset(cue, 0, sizeof(*cue));
+			snprintf(cue->name, sizeof(cue->name), "%s", tok[1]);
+			if (n > 2) {
+				/* Up to an hour, keeps nframes an int */
+				errno = 0;
+				fade = strtoul(tok[2], &end, 10);
+				if (*end || end == tok[2] || errno ||
+				    tok[2][0] == '-' || fade > 3600000)
+					ret = -EINVAL;
+				cue->fade_ms = fade;
+			}
+		} else if (cue && n == 2) {
+			ret = parse_cue_line(cue, tok[0], tok[1]);
+		} else {
+			ret = -EINVAL;
+		}
+	}
+
+	if (!ret && cue)
+		ret = compile_cue(cue, frame_ns);
+	fclose(f);
+
+	if (ret) {
+		printf("%s:%d: %s\n", path, lineno,
+		       ret == -EINVAL ? "syntax error" : strerror(-ret));
+		cue_list_free(cl);
+		return 1;
+	}
+
+	printf("Loaded %d cue(s) from %s\n", cl->ncues, path);
+	return 0;
+}
+
+void cue_list_free(struct cue_list *cl)
+{
+	int i;
+
+	for (i = 0; i < cl->ncues; i++)
+		free(cl->cues[i].weights);
+	free(cl->cues);
+	cl->cues = NULL;
+	cl->ncues = 0;
+}
+
+/**
+ * Find a cue by name, or the next one in the list.
+ *
+ * @cl: The cue list
+ * @name: Cue name, or NULL for the cue following the last fired one.
+ *
+ * Return: Index of the cue, or -1 if there is no such cue.
+ */
+int cue_list_find(const struct cue_list *cl, const char *name)
+{
+	int i;
+
+	if (!name)
+		return cl->current + 1 < cl->ncues ? cl->current + 1 : -1;
+
+	for (i = 0; i < cl->ncues; i++)
+		if (!strcmp(cl->cues[i].name, name))
+			return i;
+	return -1;
+}
+
+/**
+ * Compute the CTM of an output at a frame of the fade into a cue.
+ *
+ * @cue: The cue
+ * @i: Index of the output in the cue.
+ * @frame: Frame of the fade.
+ * @from: Coefficients the output had when the cue was fired.
+ * @padded_ctm: The packed CTM (see pack_ctm()) is placed here.
+ */
+void cue_blend(const struct cue *cue, int i, int frame, const double *from,
+	       long *padded_ctm)
+{
+	const struct cue_output *co = &cue->outputs[i];
+	struct _drm_color_ctm ctm;
+	double coeffs[9], w;
+	int k;
+
+	if (frame >= cue->nframes - 1) {
+		memcpy(padded_ctm, co->ctm, sizeof(co->ctm));
+		return;
+	}
+
+	w = cue->weights[frame];
+	for (k = 0; k < 9; k++)
+		coeffs[k] = from[k] + w * (co->coeffs[k] - from[k]);
+	coeffs_to_ctm(coeffs, &ctm);
+	pack_ctm(&ctm, padded_ctm);
+}
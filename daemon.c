@@ -0,0 +1,1406 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+#include "xsatmgr.h"
+
+/*******************************************************************************
+ * Long-running modes
+ *
+ * A single epoll loop waits on every event source (the X connections, stdin,
+ * ...). Each source carries its own handler, so adding a source does not
+ * touch the loop itself. Several X displays can be served at once, each with
+ * its own caches and held back writes. Writes never wait for the server,
+ * and round trips are left to the worker of each display, so nothing on the
+ * loop waits for a server: a hung display does not hold up the others.
+ */
+
+#define MAX_EVENTS 16
+#define MAX_CLIENTS 16
+
+/* How often to poll DPMS on servers that cannot send DPMS events */
+#define POWER_POLL_MS 1000
+
+/* How often to ping the servers, to find out about stalls without writes */
+#define PING_MS 250
+
+/* Bounds of the backoff between attempts to reconnect to a lost display */
+#define RECONNECT_MIN_MS 50
+#define RECONNECT_MAX_MS 2000
+
+/* How often to check for idleness, with -I */
+#define IDLE_POLL_MS 1000
+
+/* First fd passed by socket activation, see sd_listen_fds(3) */
+#define LISTEN_FDS_START 3
+
+struct daemon;
+
+/**
+ * An fd watched by the event loop.
+ *
+ * @fd: The file descriptor.
+ * @handler: Called with the epoll events when the fd is ready.
+ */
+struct source {
+	int fd;
+	void (*handler)(struct daemon *d, struct source *src,
+			uint32_t events);
+};
+
+/* Partial line read from a stream fd */
+struct line_buf {
+	char buf[LINE_LEN];
+	size_t len;
+};
+
+/* A client connected to the control socket */
+struct client {
+	struct source src;
+	struct line_buf lines;
+};
+
+struct daemon {
+	const struct daemon_config *cfg;
+	int ndisplays;
+	struct display_state displays[MAX_DISPLAYS];
+	int epfd;
+	int running;
+
+	struct source x_srcs[MAX_DISPLAYS];
+	struct source work_srcs[MAX_DISPLAYS];
+	struct source stdin_src;
+	struct source power_src;
+	struct source ping_src;
+	struct source signal_src;
+	struct source listen_src;
+	struct source frame_src;
+	struct source cue_src;
+	struct source hotkey_src;
+	struct source metrics_src;
+	struct source reconnect_src;
+	struct source idle_src;
+
+	struct line_buf stdin_lines;
+	struct client clients[MAX_CLIENTS];
+
+	/* Composing service */
+	struct compositor compositor;
+	int frame_armed;
+	uint64_t compose_target;
+	unsigned long layer_requests;
+	unsigned long commits;
+
+	/* Cue playback */
+	struct cue_list cues;
+	struct cue *playing;
+	int frame;
+	double cue_from[MAX_DISPLAYS][MAX_OUTPUTS][9];
+	uint64_t cue_start;
+	uint64_t cue_frame_ns;
+
+	/* Hotkeys */
+	struct hotkeys hotkeys;
+	int hotkey_armed;
+	uint64_t hotkey_target;
+
+	/* Lost displays */
+	int reconnect_armed;
+	unsigned int reconnect_ms;
+
+	/* Socket activation and idle exit */
+	int activated;
+	uint64_t last_request_ns;
+
+	/* Heap allocations counted once the apply path is warm */
+	int warm;
+	unsigned long warm_allocs;
+};
+
+static int daemon_add_source(struct daemon *d, struct source *src, int fd,
+			     void (*handler)(struct daemon *, struct source *,
+					     uint32_t))
+{
+	struct epoll_event ev;
+
+	src->fd = fd;
+	src->handler = handler;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = src;
+	if (epoll_ctl(d->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		printf("Cannot watch fd %d. %s\n", fd, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Find an output by name on a display. The name may be qualified with the
+ * display, as in ":1/DP-1", to pick an output on one display only.
+ *
+ * Return: The output, or NULL if the display has no such output.
+ */
+static struct output_state *daemon_find_output(struct display_state *ds,
+					       const char *name)
+{
+	const char *slash = strrchr(name, '/');
+
+	if (slash) {
+		if (strncmp(ds->name, name, slash - name) ||
+		    ds->name[slash - name])
+			return NULL;
+		name = slash + 1;
+	}
+	return display_find_output(ds, name);
+}
+
+/* Shortest frame period of all displays */
+static uint64_t daemon_frame_ns(const struct daemon *d)
+{
+	uint64_t frame_ns = 0;
+	int i;
+
+	for (i = 0; i < d->ndisplays; i++)
+		if (!frame_ns || d->displays[i].frame_ns < frame_ns)
+			frame_ns = d->displays[i].frame_ns;
+	return frame_ns ? frame_ns : DEFAULT_FRAME_NS;
+}
+
+/*
+ * Account for a write scheduled on a frame boundary. Anything later than a
+ * frame landed in the next frame, if not later.
+ */
+static void daemon_lateness(struct daemon *d, uint64_t target_ns,
+			    uint64_t frame_ns)
+{
+	uint64_t now = now_ns();
+	uint64_t late = now > target_ns ? now - target_ns : 0;
+
+	metrics_lateness(late, late >= frame_ns);
+}
+
+/**
+ * Apply a CTM to a list of outputs, and send it to the servers.
+ *
+ * This is the steady-state apply path: it only touches the caches and
+ * stack buffers, and does not allocate once the caches are warm.
+ *
+ * @d: The daemon
+ * @outputs: Comma separated output names, on any display. Modified in place.
+ * @coeffs: Coefficients of the CTM to apply.
+ *
+ * Return: Number of outputs changed, or -1 if an output was not found.
+ */
+static int daemon_apply(struct daemon *d, char *outputs, const double *coeffs)
+{
+	struct _drm_color_ctm ctm;
+	struct output_state *out;
+	int dirty[MAX_DISPLAYS] = { 0 };
+	char *name, *save;
+	int i, ret, found, changed = 0, err = 0;
+
+	coeffs_to_ctm(coeffs, &ctm);
+
+	for (name = strtok_r(outputs, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		found = 0;
+		for (i = 0; i < d->ndisplays; i++) {
+			out = daemon_find_output(&d->displays[i], name);
+			if (!out)
+				continue;
+			found = 1;
+
+			ret = display_set_ctm(&d->displays[i], out, &ctm);
+			if (ret == BadName) {
+				printf("Property key '%s' not found on output "
+				       "%s\n", PROP_CTM, name);
+				err = 1;
+			} else {
+				changed += ret;
+				dirty[i] |= ret;
+			}
+		}
+
+		if (!found) {
+			printf("Cannot find output %s.\n", name);
+			err = 1;
+		}
+	}
+
+	for (i = 0; i < d->ndisplays; i++)
+		if (dirty[i])
+			display_flush(&d->displays[i]);
+
+	/* Everything the apply path needs is now allocated */
+	if (changed && !d->warm) {
+		d->warm = 1;
+		d->warm_allocs = heap_allocations();
+	}
+
+	return err ? -1 : changed;
+}
+
+/**
+ * Handle one request line: "<value>" applies to the default outputs given
+ * with -o, "<outputs> <value>" to the listed ones. The value is a saturation
+ * or "default", as with -c.
+ */
+static void daemon_handle_line(struct daemon *d, char *line)
+{
+	double coeffs[9];
+	char outputs[LINE_LEN];
+	char *first, *second, *save;
+
+	first = strtok_r(line, " \t", &save);
+	if (!first)
+		return;
+	second = strtok_r(NULL, " \t", &save);
+
+	if (second) {
+		snprintf(outputs, sizeof(outputs), "%s", first);
+	} else if (d->cfg->outputs) {
+		snprintf(outputs, sizeof(outputs), "%s", d->cfg->outputs);
+		second = first;
+	} else {
+		printf("No output given for '%s'.\n", first);
+		return;
+	}
+
+	if (!parse_saturation(second, coeffs)) {
+		printf("%s is not a valid Saturation value. Skipping.\n",
+		       second);
+		return;
+	}
+
+	daemon_apply(d, outputs, coeffs);
+}
+
+/**
+ * Read from a stream fd, and call handler on every complete line.
+ *
+ * Return: 0 on end of file or error, 1 if the fd remains open.
+ */
+static int read_lines(struct daemon *d, int fd, struct line_buf *lb,
+		      void (*handler)(struct daemon *, int, char *))
+{
+	ssize_t n;
+	char *start, *nl;
+
+	n = read(fd, lb->buf + lb->len, sizeof(lb->buf) - 1 - lb->len);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return 1;
+	if (n <= 0)
+		return 0;
+
+	lb->len += n;
+	lb->buf[lb->len] = '\0';
+
+	start = lb->buf;
+	while ((nl = strchr(start, '\n'))) {
+		*nl = '\0';
+		handler(d, fd, start);
+		start = nl + 1;
+	}
+
+	/* Keep the partial line for the next read, drop overlong lines */
+	lb->len -= start - lb->buf;
+	if (lb->len == sizeof(lb->buf) - 1)
+		lb->len = 0;
+	memmove(lb->buf, start, lb->len);
+	return 1;
+}
+
+static int daemon_go(struct daemon *d, const char *name, uint64_t trigger_ns);
+
+static void daemon_stdin_line(struct daemon *d, int fd, char *line)
+{
+	uint64_t trigger_ns = now_ns();
+	char *cmd, *name, *save;
+
+	if (!d->cfg->cue_path) {
+		daemon_handle_line(d, line);
+		return;
+	}
+
+	/* Cue triggers: an empty line or "go" fires the next cue, "go <name>"
+	 * or "<name>" fires the named one. */
+	cmd = strtok_r(line, " \t", &save);
+	name = cmd ? strtok_r(NULL, " \t", &save) : NULL;
+	if (cmd && strcmp(cmd, "go"))
+		name = cmd;
+	daemon_go(d, name, trigger_ns);
+}
+
+static void daemon_stdin_ready(struct daemon *d, struct source *src,
+			       uint32_t events)
+{
+	if (read_lines(d, src->fd, &d->stdin_lines, daemon_stdin_line))
+		return;
+
+	/* EOF: we're done, unless there are other ways to reach us */
+	epoll_ctl(d->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+	if (!d->cfg->socket_path && !d->cfg->cue_path)
+		d->running = 0;
+}
+
+/*******************************************************************************
+ * Composing service
+ */
+
+/*
+ * Compose the layers of every managed output, and write the outputs whose
+ * quantized CTM changed. display_set_ctm() skips outputs whose CTM is
+ * unchanged, so a layer update that cancels out costs nothing.
+ */
+static int daemon_compose(struct daemon *d)
+{
+	struct display_state *ds;
+	struct _drm_color_ctm ctm;
+	struct output_state *out;
+	double coeffs[9];
+	int i, j, changed, commits = 0;
+
+	for (j = 0; j < d->ndisplays; j++) {
+		ds = &d->displays[j];
+		changed = 0;
+
+		for (i = 0; i < ds->noutputs; i++) {
+			out = &ds->outputs[i];
+			if (!out->has_ctm)
+				continue;
+			if (d->cfg->outputs &&
+			    !name_in_list(out->name, d->cfg->outputs))
+				continue;
+
+			compositor_compose(&d->compositor, out->name, coeffs);
+			coeffs_to_ctm(coeffs, &ctm);
+			changed += display_set_ctm(ds, out, &ctm) == 1;
+		}
+
+		if (changed) {
+			display_flush(ds);
+			commits = 1;
+		}
+	}
+
+	d->commits += commits;
+	return commits;
+}
+
+/*
+ * Schedule a compose at the next frame boundary. Every layer update arriving
+ * before then, from any client, is folded into the same commit.
+ */
+static void daemon_schedule_compose(struct daemon *d)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	uint64_t frame = daemon_frame_ns(d);
+	uint64_t next;
+
+	if (d->frame_armed)
+		return;
+
+	next = (now_ns() / frame + 1) * frame;
+	d->compose_target = next;
+	its.it_value.tv_sec = next / 1000000000ull;
+	its.it_value.tv_nsec = next % 1000000000ull;
+	if (timerfd_settime(d->frame_src.fd, TFD_TIMER_ABSTIME, &its, NULL))
+		daemon_compose(d);
+	else
+		d->frame_armed = 1;
+}
+
+static void daemon_frame_tick(struct daemon *d, struct source *src,
+			      uint32_t events)
+{
+	uint64_t expirations;
+
+	if (read(src->fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	d->frame_armed = 0;
+	if (daemon_compose(d))
+		daemon_lateness(d, d->compose_target, daemon_frame_ns(d));
+}
+
+/*******************************************************************************
+ * Cue playback
+ */
+
+/*
+ * Remember the look every output of the playing cue has right now, the one
+ * its fade starts from: the CTM held back while it sleeps, else the last one
+ * written, else identity.
+ */
+static void daemon_cue_capture(struct daemon *d)
+{
+	struct cue *cue = d->playing;
+	struct output_state *out;
+	struct _drm_color_ctm ctm;
+	double *from;
+	int i, j;
+
+	for (j = 0; j < d->ndisplays; j++) {
+		for (i = 0; i < cue->noutputs; i++) {
+			from = d->cue_from[j][i];
+			out = daemon_find_output(&d->displays[j],
+						 cue->outputs[i].name);
+			if (out && (out->pending || out->applied)) {
+				unpack_ctm(out->pending ? out->pending_ctm :
+					   out->applied_ctm, &ctm);
+				ctm_to_coeffs(&ctm, from);
+			} else {
+				saturation_to_coeffs(1.0, from);
+			}
+		}
+	}
+}
+
+/* Write the current frame of the playing cue to all of its outputs. */
+static void daemon_cue_frame(struct daemon *d)
+{
+	struct cue *cue = d->playing;
+	struct display_state *ds;
+	struct output_state *out;
+	long padded_ctm[18];
+	int i, j, changed;
+
+	for (j = 0; j < d->ndisplays; j++) {
+		ds = &d->displays[j];
+		changed = 0;
+
+		for (i = 0; i < cue->noutputs; i++) {
+			out = daemon_find_output(ds, cue->outputs[i].name);
+			if (!out)
+				continue;
+			cue_blend(cue, i, d->frame, d->cue_from[j][i],
+				  padded_ctm);
+			changed += display_set_packed(ds, out,
+						      padded_ctm) == 1;
+		}
+
+		if (changed)
+			display_flush(ds);
+	}
+}
+
+static void daemon_cue_stop_timer(struct daemon *d)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+	timerfd_settime(d->cue_src.fd, 0, &its, NULL);
+}
+
+/**
+ * Fire a cue: write its first frame right away, and play the rest of its
+ * fade on a frame timer. The fade starts from what the outputs show, so
+ * firing a cue while another fades picks up where that fade got to.
+ *
+ * @d: The daemon
+ * @name: Cue name, or NULL for the next cue.
+ * @trigger_ns: now_ns() when the trigger was received.
+ *
+ * Return: 0 on success, -1 if there is no such cue.
+ */
+static int daemon_go(struct daemon *d, const char *name, uint64_t trigger_ns)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	struct cue *cue;
+	int idx;
+
+	idx = cue_list_find(&d->cues, name);
+	if (idx < 0) {
+		printf("No cue %s.\n", name ? name : "after the last one");
+		return -1;
+	}
+
+	daemon_cue_stop_timer(d);
+	cue = &d->cues.cues[idx];
+	d->cues.current = idx;
+	d->playing = cue;
+	d->frame = 0;
+
+	daemon_cue_capture(d);
+	daemon_cue_frame(d);
+	printf("Cue %s: %d output(s), trigger-to-write %.3f ms\n", cue->name,
+	       cue->noutputs, (now_ns() - trigger_ns) / 1e6);
+
+	if (cue->nframes > 1) {
+		d->cue_frame_ns = daemon_frame_ns(d);
+		d->cue_start = now_ns();
+		its.it_interval.tv_sec = d->cue_frame_ns / 1000000000ull;
+		its.it_interval.tv_nsec = d->cue_frame_ns % 1000000000ull;
+		its.it_value = its.it_interval;
+		timerfd_settime(d->cue_src.fd, 0, &its, NULL);
+	} else {
+		d->playing = NULL;
+	}
+	return 0;
+}
+
+static void daemon_cue_tick(struct daemon *d, struct source *src,
+			    uint32_t events)
+{
+	uint64_t expirations;
+
+	if (read(src->fd, &expirations, sizeof(expirations)) < 0 ||
+	    !d->playing)
+		return;
+
+	/* Catch up with missed frames, rather than stretching the fade */
+	d->frame += expirations;
+	if (d->frame >= d->playing->nframes - 1)
+		d->frame = d->playing->nframes - 1;
+
+	daemon_cue_frame(d);
+	daemon_lateness(d, d->cue_start + d->frame * d->cue_frame_ns,
+			d->cue_frame_ns);
+
+	if (d->frame == d->playing->nframes - 1) {
+		daemon_cue_stop_timer(d);
+		d->playing = NULL;
+	}
+}
+
+/*******************************************************************************
+ * Hotkeys
+ */
+
+/* Write the step the hotkeys were moved to, to all managed outputs. */
+static void daemon_hotkey_write(struct daemon *d)
+{
+	struct display_state *ds;
+	struct output_state *out;
+	const long *padded_ctm;
+	int i, j, changed;
+
+	padded_ctm = hotkeys_advance(&d->hotkeys);
+	if (!padded_ctm)
+		return;
+
+	for (j = 0; j < d->ndisplays; j++) {
+		ds = &d->displays[j];
+		changed = 0;
+
+		for (i = 0; i < ds->noutputs; i++) {
+			out = &ds->outputs[i];
+			if (!out->has_ctm)
+				continue;
+			if (d->cfg->outputs &&
+			    !name_in_list(out->name, d->cfg->outputs))
+				continue;
+			changed += display_set_packed(ds, out,
+						      padded_ctm) == 1;
+		}
+
+		if (changed)
+			display_flush(ds);
+	}
+
+	hotkeys_written(&d->hotkeys);
+}
+
+/*
+ * Write the presses read so far. The first press of a frame is written
+ * right away, and any further press (e.g. auto-repeat) is folded into one
+ * write at the start of the next frame.
+ */
+static void daemon_hotkey_press(struct daemon *d)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	uint64_t frame = daemon_frame_ns(d);
+
+	if (!d->hotkeys.presses || d->hotkey_armed)
+		return;
+
+	if (now_ns() - d->hotkeys.write_ns >= frame) {
+		daemon_hotkey_write(d);
+		return;
+	}
+
+	d->hotkey_target = d->hotkeys.write_ns + frame;
+	its.it_value.tv_sec = d->hotkey_target / 1000000000ull;
+	its.it_value.tv_nsec = d->hotkey_target % 1000000000ull;
+	if (timerfd_settime(d->hotkey_src.fd, TFD_TIMER_ABSTIME, &its, NULL))
+		daemon_hotkey_write(d);
+	else
+		d->hotkey_armed = 1;
+}
+
+static void daemon_hotkey_tick(struct daemon *d, struct source *src,
+			       uint32_t events)
+{
+	uint64_t expirations;
+
+	if (read(src->fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	d->hotkey_armed = 0;
+	if (d->hotkeys.presses) {
+		daemon_hotkey_write(d);
+		daemon_lateness(d, d->hotkey_target, daemon_frame_ns(d));
+	}
+}
+
+/*
+ * Report the lateness histogram of frame-scheduled writes, cumulative as in
+ * the metrics: "lateness <le ms>:<count> ... +Inf:<count> misses <count>".
+ */
+static void daemon_status_lateness(int fd)
+{
+	const struct metrics *m = metrics_get();
+	char line[LINE_LEN];
+	unsigned long count = 0;
+	uint64_t bound;
+	size_t len;
+	int i;
+
+	len = snprintf(line, sizeof(line), "lateness");
+	for (i = 0; i < METRIC_BUCKETS && len < sizeof(line); i++) {
+		count += m->lateness_buckets[i];
+		if (metrics_bucket_bound(i, &bound))
+			len += snprintf(line + len, sizeof(line) - len,
+					" %g:%lu", bound / 1e6, count);
+		else
+			len += snprintf(line + len, sizeof(line) - len,
+					" +Inf:%lu", count);
+	}
+	dprintf(fd, "%s misses %lu\n", line, m->deadline_misses);
+}
+
+/*
+ * Handle a request on the control socket, and reply to it. Requests:
+ *
+ *   layer <name> <priority> <outputs|*> <value>
+ *   remove <name>
+ *   go [<cue>]
+ *   status
+ *
+ * where value is a saturation, "default", or 9 colon separated coefficients.
+ * Replies end with a line starting with "ok" or "error".
+ */
+static void daemon_client_line(struct daemon *d, int fd, char *line)
+{
+	uint64_t trigger_ns = now_ns();
+	const struct display_state *ds;
+	const struct layer *layer;
+	double coeffs[9];
+	char *cmd, *args[4], *save;
+	int i, nargs = 0;
+
+	d->last_request_ns = trigger_ns;
+	cmd = strtok_r(line, " \t", &save);
+	if (!cmd)
+		return;
+	while (nargs < 4 && (args[nargs] = strtok_r(NULL, " \t", &save)))
+		nargs++;
+
+	if (!strcmp(cmd, "layer") && nargs == 4) {
+		if (!parse_matrix(args[3], coeffs)) {
+			dprintf(fd, "error invalid value %s\n", args[3]);
+			return;
+		}
+		if (compositor_set_layer(&d->compositor, args[0],
+					 atoi(args[1]), args[2], coeffs)) {
+			dprintf(fd, "error too many layers\n");
+			return;
+		}
+		d->layer_requests++;
+		daemon_schedule_compose(d);
+	} else if (!strcmp(cmd, "remove") && nargs == 1) {
+		if (compositor_remove_layer(&d->compositor, args[0])) {
+			dprintf(fd, "error no layer %s\n", args[0]);
+			return;
+		}
+		d->layer_requests++;
+		daemon_schedule_compose(d);
+	} else if (!strcmp(cmd, "go") && nargs <= 1 && d->cues.ncues) {
+		if (daemon_go(d, nargs ? args[0] : NULL, trigger_ns)) {
+			dprintf(fd, "error no cue\n");
+			return;
+		}
+	} else if (!strcmp(cmd, "status") && !nargs) {
+		for (i = 0; i < d->compositor.nlayers; i++) {
+			layer = &d->compositor.layers[i];
+			dprintf(fd, "layer %s %d %s "
+				"%2.4f:%2.4f:%2.4f:%2.4f:%2.4f:%2.4f:"
+				"%2.4f:%2.4f:%2.4f\n", layer->name,
+				layer->priority, layer->outputs,
+				layer->coeffs[0], layer->coeffs[1],
+				layer->coeffs[2], layer->coeffs[3],
+				layer->coeffs[4], layer->coeffs[5],
+				layer->coeffs[6], layer->coeffs[7],
+				layer->coeffs[8]);
+		}
+		dprintf(fd, "requests %lu commits %lu\n", d->layer_requests,
+			d->commits);
+		for (i = 0; i < d->ndisplays; i++) {
+			ds = &d->displays[i];
+			dprintf(fd, "display %s applies %lu deferred %lu "
+				"stalled %d latency %.3f max %.3f\n", ds->name,
+				ds->applies, ds->deferred, display_stalled(ds),
+				ds->syncs ? ds->sync_ns / 1e6 / ds->syncs : 0,
+				ds->sync_max_ns / 1e6);
+		}
+		daemon_status_lateness(fd);
+		if (d->cues.ncues)
+			dprintf(fd, "cue %s\n", d->cues.current < 0 ? "-" :
+				d->cues.cues[d->cues.current].name);
+	} else {
+		dprintf(fd, "error unknown request %s\n", cmd);
+		return;
+	}
+
+	dprintf(fd, "ok\n");
+}
+
+static void daemon_client_ready(struct daemon *d, struct source *src,
+				uint32_t events)
+{
+	struct client *client = (struct client *)src;
+
+	if (read_lines(d, src->fd, &client->lines, daemon_client_line))
+		return;
+
+	epoll_ctl(d->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+	close(src->fd);
+	src->fd = -1;
+}
+
+static void daemon_accept(struct daemon *d, struct source *src,
+			  uint32_t events)
+{
+	struct client *client = NULL;
+	int i, fd;
+
+	fd = accept4(src->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	for (i = 0; i < MAX_CLIENTS && !client; i++)
+		if (d->clients[i].src.fd < 0)
+			client = &d->clients[i];
+
+	if (!client) {
+		dprintf(fd, "error too many clients\n");
+		close(fd);
+		return;
+	}
+
+	client->lines.len = 0;
+	d->last_request_ns = now_ns();
+	if (daemon_add_source(d, &client->src, fd, daemon_client_ready)) {
+		close(fd);
+		client->src.fd = -1;
+	}
+}
+
+/**
+ * Listen on the control socket. A stale socket left behind by a previous
+ * instance is replaced.
+ *
+ * Return: The listening fd, or -1 on failure.
+ */
+static int daemon_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, MAX_CLIENTS) < 0) {
+		printf("Cannot listen on %s. %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Take the listening socket passed by socket activation, following the
+ * sd_listen_fds(3) protocol: the first request to the socket started us.
+ *
+ * Return: The listening fd, or -1 if we were not socket activated.
+ */
+static int daemon_activated(void)
+{
+	const char *pid = getenv("LISTEN_PID");
+	const char *fds = getenv("LISTEN_FDS");
+	int flags;
+
+	if (!pid || !fds || strtol(pid, NULL, 10) != getpid() ||
+	    atoi(fds) < 1)
+		return -1;
+
+	/* Not for the children, e.g. the cue or stream producers */
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	flags = fcntl(LISTEN_FDS_START, F_GETFL);
+	if (flags < 0 ||
+	    fcntl(LISTEN_FDS_START, F_SETFL, flags | O_NONBLOCK) < 0 ||
+	    fcntl(LISTEN_FDS_START, F_SETFD, FD_CLOEXEC) < 0)
+		return -1;
+	return LISTEN_FDS_START;
+}
+
+/*******************************************************************************
+ * Event loop
+ */
+
+/* Process the pending events of a display, and act on them. */
+static void daemon_x_events(struct daemon *d, struct display_state *ds)
+{
+	display_handle_events(ds);
+	daemon_hotkey_press(d);
+}
+
+static void daemon_x_ready(struct daemon *d, struct source *src,
+			   uint32_t events)
+{
+	daemon_x_events(d, &d->displays[src - d->x_srcs]);
+}
+
+/* Try again to reconnect to the lost displays after the current backoff. */
+static void daemon_arm_reconnect(struct daemon *d)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+	if (d->reconnect_armed)
+		return;
+
+	its.it_value.tv_sec = d->reconnect_ms / 1000;
+	its.it_value.tv_nsec = (d->reconnect_ms % 1000) * 1000000;
+	if (!timerfd_settime(d->reconnect_src.fd, 0, &its, NULL))
+		d->reconnect_armed = 1;
+}
+
+/*
+ * A display connection was lost: stop watching it, and have its CTMs held
+ * back until it is back.
+ */
+static void daemon_display_lost(struct daemon *d, int i)
+{
+	struct display_state *ds = &d->displays[i];
+
+	epoll_ctl(d->epfd, EPOLL_CTL_DEL, d->x_srcs[i].fd, NULL);
+	display_lost(ds);
+
+	if (!d->reconnect_armed)
+		d->reconnect_ms = RECONNECT_MIN_MS;
+	daemon_arm_reconnect(d);
+}
+
+/* Connecting waits for the server, so the workers do it. */
+static void daemon_reconnect_tick(struct daemon *d, struct source *src,
+				  uint32_t events)
+{
+	uint64_t expirations;
+	int i;
+
+	if (read(src->fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	d->reconnect_armed = 0;
+
+	for (i = 0; i < d->ndisplays; i++)
+		if (!d->displays[i].dpy)
+			display_reconnect(&d->displays[i]);
+}
+
+/* The worker of a display is done waiting for its server. */
+static void daemon_work_ready(struct daemon *d, struct source *src,
+			      uint32_t events)
+{
+	int i = src - d->work_srcs;
+	struct display_state *ds = &d->displays[i];
+	int work;
+
+	work = display_work_done(ds);
+
+	if ((work & WORK_CONNECT) && ds->dpy &&
+	    daemon_add_source(d, &d->x_srcs[i], ConnectionNumber(ds->dpy),
+			      daemon_x_ready))
+		display_lost(ds);
+
+	/* Not back yet, try again later */
+	if ((work & WORK_CONNECT) && !ds->dpy) {
+		d->reconnect_ms *= 2;
+		if (d->reconnect_ms > RECONNECT_MAX_MS)
+			d->reconnect_ms = RECONNECT_MAX_MS;
+		daemon_arm_reconnect(d);
+	}
+
+	/* New outputs need their composed CTM too */
+	if ((work & WORK_REFRESH) && ds->dpy && d->cfg->socket_path)
+		daemon_schedule_compose(d);
+}
+
+static void daemon_signal(struct daemon *d, struct source *src,
+			  uint32_t events)
+{
+	struct signalfd_siginfo info;
+
+	if (read(src->fd, &info, sizeof(info)) != sizeof(info))
+		return;
+
+	if (info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM)
+		d->running = 0;
+	else if (info.ssi_signo == SIGUSR2 && d->cues.ncues)
+		daemon_go(d, NULL, now_ns());
+	else if (info.ssi_signo == SIGUSR1)
+		recorder_dump(d->cfg->recorder_path ? d->cfg->recorder_path :
+			      RECORDER_PATH);
+}
+
+static void daemon_metrics_tick(struct daemon *d, struct source *src,
+				uint32_t events)
+{
+	uint64_t expirations;
+
+	if (read(src->fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	metrics_publish();
+}
+
+/*
+ * Exit once no request came for the idle period given with -I. Connected
+ * clients, and cues playing, keep the service up.
+ */
+static void daemon_idle_tick(struct daemon *d, struct source *src,
+			     uint32_t events)
+{
+	uint64_t expirations;
+	int i;
+
+	if (read(src->fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (d->clients[i].src.fd >= 0)
+			d->last_request_ns = now_ns();
+	if (d->playing)
+		d->last_request_ns = now_ns();
+
+	if (now_ns() - d->last_request_ns >=
+	    d->cfg->idle_s * 1000000000ull) {
+		printf("Idle for %u s, exiting.\n", d->cfg->idle_s);
+		d->running = 0;
+	}
+}
+
+static void daemon_power_tick(struct daemon *d, struct source *src,
+			      uint32_t events)
+{
+	struct display_state *ds;
+	uint64_t expirations;
+	int i;
+
+	if (read(src->fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	/* Polling is a round trip, leave it to the workers */
+	for (i = 0; i < d->ndisplays; i++) {
+		ds = &d->displays[i];
+		if (ds->dpy && ds->dpms_opcode && !ds->dpms_events)
+			display_request(ds, WORK_POWER);
+	}
+}
+
+static void daemon_ping_tick(struct daemon *d, struct source *src,
+			     uint32_t events)
+{
+	uint64_t expirations;
+	int i;
+
+	if (read(src->fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	for (i = 0; i < d->ndisplays; i++)
+		display_ping(&d->displays[i]);
+}
+
+/**
+ * Create a periodic timer, and add it to the event loop.
+ *
+ * Return: 0 on success, non-zero otherwise.
+ */
+static int daemon_add_timer(struct daemon *d, struct source *src,
+			    unsigned int period_ms,
+			    void (*handler)(struct daemon *, struct source *,
+					    uint32_t))
+{
+	struct itimerspec its;
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		printf("Cannot create timer. %s\n", strerror(errno));
+		return 1;
+	}
+
+	its.it_interval.tv_sec = period_ms / 1000;
+	its.it_interval.tv_nsec = (period_ms % 1000) * 1000000;
+	its.it_value = its.it_interval;
+	timerfd_settime(fd, 0, &its, NULL);
+
+	if (daemon_add_source(d, src, fd, handler)) {
+		close(fd);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * The event loop. Runs on the calling thread, or on the real-time apply
+ * thread with -R.
+ *
+ * Return: NULL when the inputs are exhausted, non-NULL on failure.
+ */
+static void *daemon_loop(void *arg)
+{
+	struct daemon *d = arg;
+	struct epoll_event events[MAX_EVENTS];
+	struct source *src;
+	int i, n;
+
+	while (d->running) {
+		/* Xlib may have buffered events while waiting for replies. Any
+		 * Xlib call may also have found a connection lost. */
+		for (i = 0; i < d->ndisplays; i++) {
+			daemon_x_events(d, &d->displays[i]);
+			if (d->displays[i].lost && d->displays[i].dpy)
+				daemon_display_lost(d, i);
+		}
+
+		n = epoll_wait(d->epfd, events, MAX_EVENTS, -1);
+		if (n < 0 && errno != EINTR) {
+			printf("Event loop failed. %s\n", strerror(errno));
+			return (void *)1;
+		}
+
+		for (i = 0; i < n; i++) {
+			src = events[i].data.ptr;
+			src->handler(d, src, events[i].events);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Open every display, and add their connections to the event loop.
+ *
+ * @d: The daemon
+ * @names: Comma separated display names, or NULL for the DISPLAY
+ *         environment variable.
+ *
+ * Return: 0 on success, non-zero otherwise.
+ */
+static int daemon_open_displays(struct daemon *d, const char *names)
+{
+	char buf[LINE_LEN];
+	char *name, *save;
+	struct display_state *ds;
+
+	snprintf(buf, sizeof(buf), "%s", names ? names : "");
+	name = strtok_r(buf, ",", &save);
+	do {
+		if (d->ndisplays == MAX_DISPLAYS) {
+			printf("Too many displays, at most %d.\n",
+			       MAX_DISPLAYS);
+			return 1;
+		}
+
+		ds = &d->displays[d->ndisplays];
+		if (display_open(ds, name))
+			return 1;
+		d->ndisplays++;
+
+		if (daemon_add_source(d, &d->x_srcs[d->ndisplays - 1],
+				      ConnectionNumber(ds->dpy),
+				      daemon_x_ready) ||
+		    daemon_add_source(d, &d->work_srcs[d->ndisplays - 1],
+				      ds->worker.efd, daemon_work_ready))
+			return 1;
+	} while ((name = strtok_r(NULL, ",", &save)));
+
+	return 0;
+}
+
+/**
+ * Run the long-running mode until its inputs are exhausted.
+ *
+ * Return: 0 on success, non-zero otherwise.
+ */
+int daemon_run(const struct daemon_config *cfg)
+{
+	static struct daemon daemon;
+	struct daemon *d = &daemon;
+	struct display_state *ds;
+	struct warm warm = { 0 };
+	unsigned long allocs;
+	int i, n, fd, ret = 1;
+
+	sigset_t sigs;
+
+	d->cfg = cfg;
+	d->power_src.fd = -1;
+	d->ping_src.fd = -1;
+	d->signal_src.fd = -1;
+	d->listen_src.fd = -1;
+	d->frame_src.fd = -1;
+	d->cue_src.fd = -1;
+	d->hotkey_src.fd = -1;
+	d->metrics_src.fd = -1;
+	d->reconnect_src.fd = -1;
+	d->idle_src.fd = -1;
+	for (i = 0; i < MAX_CLIENTS; i++)
+		d->clients[i].src.fd = -1;
+
+	d->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (d->epfd < 0) {
+		printf("Cannot create event loop. %s\n", strerror(errno));
+		return 1;
+	}
+
+	/* Exit cleanly on termination, from within the loop. SIGUSR1 dumps the
+	 * flight recorder. */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGUSR2);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	if (daemon_add_source(d, &d->signal_src,
+			      signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC),
+			      daemon_signal))
+		goto out;
+
+	/* Skip discovering outputs that did not change since the last run */
+	if (cfg->warm_path && !warm_map(cfg->warm_path, &warm)) {
+		display_set_warm(&warm);
+		if (cfg->socket_path)
+			d->compositor = warm.state->compositor;
+	}
+	n = daemon_open_displays(d, cfg->display);
+	display_set_warm(NULL);
+	warm_unmap(&warm);
+	if (n)
+		goto close;
+
+	if (cfg->trace_path &&
+	    trace_start(cfg->trace_path, d->displays, d->ndisplays))
+		goto close;
+
+	/* Lost displays are reconnected to from the loop */
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0 ||
+	    daemon_add_source(d, &d->reconnect_src, fd, daemon_reconnect_tick))
+		goto close;
+
+	/* Cues are compiled for the frame rate of the display */
+	if (cfg->cue_path) {
+		if (cue_list_load(&d->cues, cfg->cue_path,
+				  daemon_frame_ns(d)))
+			goto close;
+
+		fd = timerfd_create(CLOCK_MONOTONIC,
+				    TFD_NONBLOCK | TFD_CLOEXEC);
+		if (fd < 0 ||
+		    daemon_add_source(d, &d->cue_src, fd, daemon_cue_tick))
+			goto close;
+	}
+
+	/* Every step is compiled for the keys ahead of time */
+	if (cfg->hotkeys) {
+		if (hotkeys_load(&d->hotkeys, cfg->hotkeys))
+			goto close;
+		for (i = 0; i < d->ndisplays; i++)
+			if (hotkeys_grab(&d->hotkeys, &d->displays[i]))
+				goto close;
+
+		fd = timerfd_create(CLOCK_MONOTONIC,
+				    TFD_NONBLOCK | TFD_CLOEXEC);
+		if (fd < 0 || daemon_add_source(d, &d->hotkey_src, fd,
+						daemon_hotkey_tick))
+			goto close;
+	}
+
+	/* Stdin carries either requests, or cue triggers */
+	if ((cfg->stream || cfg->cue_path) &&
+	    daemon_add_source(d, &d->stdin_src, STDIN_FILENO,
+			      daemon_stdin_ready))
+		goto close;
+
+	if (cfg->socket_path) {
+		fd = daemon_activated();
+		d->activated = fd >= 0;
+		if (!d->activated)
+			fd = daemon_listen(cfg->socket_path);
+		if (fd < 0 ||
+		    daemon_add_source(d, &d->listen_src, fd, daemon_accept))
+			goto close;
+
+		fd = timerfd_create(CLOCK_MONOTONIC,
+				    TFD_NONBLOCK | TFD_CLOEXEC);
+		if (fd < 0 ||
+		    daemon_add_source(d, &d->frame_src, fd, daemon_frame_tick))
+			goto close;
+	}
+
+	/* Without DPMS events, find out about sleeping screens by polling */
+	for (i = 0, n = 0; i < d->ndisplays; i++)
+		n |= d->displays[i].dpms_opcode && !d->displays[i].dpms_events;
+	if (n && daemon_add_timer(d, &d->power_src, POWER_POLL_MS,
+				  daemon_power_tick))
+		goto close;
+
+	/* Stalls are found out about even when nothing is written */
+	if (daemon_add_timer(d, &d->ping_src, PING_MS, daemon_ping_tick))
+		goto close;
+
+	/* Metrics are written from their own thread, at a fixed interval */
+	if (cfg->metrics_path &&
+	    (metrics_start(cfg->metrics_path) ||
+	     daemon_add_timer(d, &d->metrics_src,
+			      (cfg->metrics_interval ? cfg->metrics_interval :
+			       METRICS_INTERVAL_S) * 1000,
+			      daemon_metrics_tick)))
+		goto close;
+
+	if (cfg->idle_s &&
+	    daemon_add_timer(d, &d->idle_src, IDLE_POLL_MS, daemon_idle_tick))
+		goto close;
+
+	d->last_request_ns = now_ns();
+	d->running = 1;
+	if (cfg->rt.enabled)
+		n = rt_run(&cfg->rt, daemon_frame_ns(d), daemon_loop, d);
+	else
+		n = (intptr_t)daemon_loop(d);
+	if (n)
+		goto close;
+
+	allocs = d->warm ? heap_allocations() - d->warm_allocs : 0;
+	for (i = 0; i < d->ndisplays; i++) {
+		ds = &d->displays[i];
+		printf("Display %s: %lu apply(ies), %lu unchanged, "
+		       "%lu cache refresh(es)\n", ds->name, ds->applies,
+		       ds->skipped, ds->refreshes);
+		printf("Display %s: %lu write(s) deferred while asleep, "
+		       "stalled or lost, %lu wake-up batch(es), %lu stall(s), "
+		       "%lu connection(s) lost\n", ds->name, ds->deferred,
+		       ds->wakeups, ds->stalls, ds->losses);
+		printf("Display %s: apply latency %.3f ms average, "
+		       "%.3f ms max\n", ds->name,
+		       ds->syncs ? ds->sync_ns / 1e6 / ds->syncs : 0,
+		       ds->sync_max_ns / 1e6);
+	}
+	printf("%lu X error(s)\n", display_errors());
+	if (cfg->socket_path)
+		printf("%lu layer request(s) composed into %lu commit(s)\n",
+		       d->layer_requests, d->commits);
+	if (cfg->hotkeys)
+		printf("%lu key press(es) in %lu write(s), key-to-write "
+		       "%.3f ms average, %.3f ms max\n",
+		       d->hotkeys.total_presses, d->hotkeys.writes,
+		       d->hotkeys.writes ? d->hotkeys.latency_ns / 1e6 /
+		       d->hotkeys.writes : 0,
+		       d->hotkeys.latency_max_ns / 1e6);
+	if (cfg->warm_path)
+		warm_save(cfg->warm_path, &d->compositor, d->displays,
+			  d->ndisplays);
+#ifdef ALLOC_WATCH
+	printf("%lu heap allocation(s) after warm-up\n", allocs);
+	ret = allocs ? 2 : 0;
+#else
+	(void)allocs;
+	ret = 0;
+#endif
+
+close:
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (d->clients[i].src.fd >= 0)
+			close(d->clients[i].src.fd);
+	/* An activated socket belongs to the service manager, and must stay */
+	if (d->listen_src.fd >= 0) {
+		close(d->listen_src.fd);
+		if (!d->activated)
+			unlink(cfg->socket_path);
+	}
+	if (d->frame_src.fd >= 0)
+		close(d->frame_src.fd);
+	if (d->cue_src.fd >= 0)
+		close(d->cue_src.fd);
+	cue_list_free(&d->cues);
+	if (d->hotkey_src.fd >= 0)
+		close(d->hotkey_src.fd);
+	hotkeys_free(&d->hotkeys);
+	if (d->power_src.fd >= 0)
+		close(d->power_src.fd);
+	if (d->ping_src.fd >= 0)
+		close(d->ping_src.fd);
+	if (d->metrics_src.fd >= 0)
+		close(d->metrics_src.fd);
+	if (d->reconnect_src.fd >= 0)
+		close(d->reconnect_src.fd);
+	if (d->idle_src.fd >= 0)
+		close(d->idle_src.fd);
+	metrics_stop();
+	trace_stop();
+	for (i = 0; i < d->ndisplays; i++)
+		display_close(&d->displays[i]);
+out:
+	if (d->signal_src.fd >= 0)
+		close(d->signal_src.fd);
+	close(d->epfd);
+	return ret;
+}
@@ -0,0 +1,1144 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/extensions/Xrandr.h>
+
+#include "xsatmgr.h"
+
+/*******************************************************************************
+ * Cached display state for the long-running modes
+ *
+ * One-shot runs can afford to look everything up by name on every call.
+ * Long-running modes apply many times per second, so atoms, outputs and the
+ * presence of the CTM property are looked up once, and only refreshed when
+ * RandR tells us the configuration changed. Once warm, applying a CTM does
+ * not allocate: the blob is packed on the stack and sent with the cached
+ * handles.
+ *
+ * Nothing on the event loop waits for the server. Each write is
+ * acknowledged by the RandR property event it triggers, which is when its
+ * latency is taken, and the server is pinged the same way, through a
+ * property of our own, so that it has to prove it is responsive even when
+ * nothing is written. A server that leaves writes or a ping unanswered for
+ * too long is considered stalled: further writes to it are held back like
+ * those to sleeping screens, and nothing else is sent to it, so that the
+ * connection never fills up and blocks. Refreshes, DPMS polls and
+ * reconnects need replies, so they are left to a worker thread per display,
+ * with connections of its own: a hung server only ever holds up its worker,
+ * never the rest of the service.
+ *
+ * A lost connection (e.g. the server restarted) does not end the process
+ * either. What was written so far is held back, just the same, until the
+ * worker reconnects: the caches are then rebuilt, and everything is
+ * written again in one batch.
+ */
+
+/*
+ * Default Xlib error handler exits the process. Errors on a single output
+ * (e.g. it was unplugged between two applies) must not take the whole
+ * service down, so just log and count them.
+ */
+static unsigned long x_errors;
+static struct display_state *open_displays[MAX_DISPLAYS];
+
+/* Create the CTM property where missing, see display_set_mock() */
+static int mock_ctm;
+
+/* Caches left behind by the last instance, see display_set_warm() */
+static const struct warm *warm_caches;
+
+static struct display_state *find_display(Display *dpy)
+{
+	int i;
+
+	for (i = 0; i < MAX_DISPLAYS; i++)
+		if (open_displays[i] && open_displays[i]->dpy == dpy)
+			return open_displays[i];
+	return NULL;
+}
+
+static void register_display(struct display_state *ds)
+{
+	int i;
+
+	for (i = 0; i < MAX_DISPLAYS; i++) {
+		if (!open_displays[i]) {
+			open_displays[i] = ds;
+			break;
+		}
+	}
+}
+
+static int display_error_handler(Display *dpy, XErrorEvent *ev)
+{
+	struct display_state *ds;
+	struct output_state *out;
+	int i;
+
+	/* Also called on the workers, for their own connections */
+	__atomic_add_fetch(&x_errors, 1, __ATOMIC_RELAXED);
+	printf("X error %d on request %d.%d\n", ev->error_code,
+	       ev->request_code, ev->minor_code);
+
+	ds = find_display(dpy);
+	if (!ds)
+		return 0;
+
+	/* Charge the failure to the output whose write caused it. No event
+	 * will acknowledge that write. */
+	for (i = 0; i < ds->noutputs; i++) {
+		out = &ds->outputs[i];
+		if (out->write_serial != ev->serial)
+			continue;
+		metrics_count(out->metrics_id, METRIC_FAILURES);
+		recorder_error(out->name, ev->serial, ev->error_code);
+		if (out->unsynced) {
+			out->unsynced = 0;
+			ds->inflight--;
+		}
+	}
+	return 0;
+}
+
+unsigned long display_errors(void)
+{
+	return __atomic_load_n(&x_errors, __ATOMIC_RELAXED);
+}
+
+/* The default Xlib IO error handler is noisy, say which display it was. */
+static int display_io_error(Display *dpy)
+{
+	struct display_state *ds = find_display(dpy);
+
+	printf("%s: connection lost.\n", ds ? ds->name : DisplayString(dpy));
+	return 0;
+}
+
+/*
+ * Called by Xlib instead of exiting on an IO error. The display is unusable
+ * from now on, but Xlib calls on it just fail, so the caller can carry on
+ * until the daemon gets to display_lost().
+ */
+static void display_io_error_exit(Display *dpy, void *data)
+{
+	struct display_state *ds = data;
+
+	ds->lost = 1;
+}
+
+/* Same for the query connection of a worker, see display_query_open(). */
+static void display_query_io_error_exit(Display *dpy, void *data)
+{
+	struct display_worker *w = data;
+
+	w->qlost = 1;
+}
+
+/* Look up the CTM atom. */
+static int display_intern(struct display_state *ds)
+{
+	ds->ctm_atom = XInternAtom(ds->dpy, PROP_CTM, !mock_ctm);
+	if (!ds->ctm_atom) {
+		printf("Property key '%s' not found.\n", PROP_CTM);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Take the caches left behind by the last instance, if the server did not
+ * change since: same RandR timestamps, and the same outputs. Only the
+ * outputs are taken, not what their CTMs are.
+ *
+ * Return: 1 if the caches were taken, 0 if they have to be built.
+ */
+static int display_warm_start(struct display_state *ds,
+			      const struct warm_display *wd)
+{
+	XRRScreenResources *res;
+	struct output_state *out;
+	int i, match;
+
+	res = XRRGetScreenResourcesCurrent(ds->dpy, ds->root);
+	if (!res)
+		return 0;
+
+	match = res->timestamp == wd->rr_time &&
+		res->configTimestamp == wd->rr_config_time &&
+		res->noutput == wd->noutputs;
+	for (i = 0; match && i < wd->noutputs; i++)
+		match = res->outputs[i] == wd->outputs[i].id;
+	XRRFreeScreenResources(res);
+	if (!match)
+		return 0;
+
+	ds->noutputs = wd->noutputs;
+	memcpy(ds->outputs, wd->outputs, ds->noutputs * sizeof(ds->outputs[0]));
+	for (i = 0; i < ds->noutputs; i++) {
+		out = &ds->outputs[i];
+		out->metrics_id = metrics_output(out->name);
+
+		/* Other clients may have written the CTMs since, and property
+		 * writes leave the RandR timestamps alone: the first apply has
+		 * to write them, even if unchanged */
+		out->applied = 0;
+		out->pending = 0;
+
+		/* Whatever was in flight was acknowledged, or never will be */
+		out->write_serial = 0;
+		out->write_ns = 0;
+		out->unsynced = 0;
+	}
+	ds->frame_ns = wd->frame_ns;
+	ds->rr_time = wd->rr_time;
+	ds->rr_config_time = wd->rr_config_time;
+
+	printf("%s: %d output(s) taken from the warm state\n", ds->name,
+	       ds->noutputs);
+	return 1;
+}
+
+/*
+ * Look up the extensions and atoms, and select the events we need. Shared by
+ * display_open() and display_work_connect().
+ */
+static int display_setup(struct display_state *ds)
+{
+	XSetWindowAttributes attrs;
+	int major = 0, minor = 0;
+
+	XSetIOErrorExitHandler(ds->dpy, display_io_error_exit, ds);
+
+	if (!XRRQueryExtension(ds->dpy, &ds->rr_event_base,
+			       &ds->rr_error_base) ||
+	    !XRRQueryVersion(ds->dpy, &major, &minor)) {
+		printf("%s: RandR is not available.\n", ds->name);
+		return 1;
+	}
+
+	ds->root = DefaultRootWindow(ds->dpy);
+	if (!ds->ctm_atom && display_intern(ds))
+		return 1;
+
+	/* Be told about hotplug and mode changes, to refresh the caches, and
+	 * about property changes, to acknowledge writes */
+	XRRSelectInput(ds->dpy, ds->root, RRScreenChangeNotifyMask |
+		       RROutputChangeNotifyMask | RROutputPropertyNotifyMask);
+
+	/* A window of our own to ping the server with, see display_ping() */
+	ds->ping_atom = XInternAtom(ds->dpy, PROP_PING, False);
+	attrs.event_mask = PropertyChangeMask;
+	ds->ping_win = XCreateWindow(ds->dpy, ds->root, -1, -1, 1, 1, 0, 0,
+				     InputOnly, CopyFromParent, CWEventMask,
+				     &attrs);
+
+	/* And about the screens going to sleep, to hold back writes */
+	power_init(ds);
+	return 0;
+}
+
+/*
+ * Track the shortest frame period of all active CRTCs, so that rate limited
+ * writes never fall behind the fastest display.
+ */
+static void display_update_frame(Display *dpy, XRRScreenResources *res,
+				 RRCrtc crtc, uint64_t *frame_ns)
+{
+	XRRCrtcInfo *crtc_info;
+	XRRModeInfo *mode;
+	uint64_t ns;
+	int i;
+
+	crtc_info = XRRGetCrtcInfo(dpy, res, crtc);
+	if (!crtc_info)
+		return;
+
+	for (i = 0; i < res->nmode; i++) {
+		mode = &res->modes[i];
+		if (mode->id != crtc_info->mode || !mode->dotClock)
+			continue;
+
+		ns = 1000000000ull * mode->hTotal * mode->vTotal /
+		     mode->dotClock;
+		if (ns && (!*frame_ns || ns < *frame_ns))
+			*frame_ns = ns;
+	}
+
+	XRRFreeCrtcInfo(crtc_info);
+}
+
+/*
+ * Look up the outputs, their CRTC and CTM property. This waits for the
+ * server, so once a display is open, only its worker does it.
+ *
+ * Return: 0 on success, non-zero if the server went away meanwhile.
+ */
+static int display_scan(Display *dpy, Window root, Atom ctm_atom,
+			struct output_scan *scan)
+{
+	struct output_state *out;
+	XRRScreenResources *res;
+	XRROutputInfo *output_info;
+	XRRPropertyInfo *prop_info;
+	int i;
+
+	res = XRRGetScreenResourcesCurrent(dpy, root);
+	if (!res)
+		return 1;
+
+	scan->noutputs = 0;
+	scan->frame_ns = 0;
+	scan->rr_time = res->timestamp;
+	scan->rr_config_time = res->configTimestamp;
+
+	for (i = 0; i < res->noutput && scan->noutputs < MAX_OUTPUTS; i++) {
+		output_info = XRRGetOutputInfo(dpy, res, res->outputs[i]);
+		if (!output_info)
+			continue;
+
+		out = &scan->outputs[scan->noutputs++];
+		memset(out, 0, sizeof(*out));
+		out->id = res->outputs[i];
+		out->connected = output_info->connection == RR_Connected &&
+				 output_info->crtc;
+		out->crtc = output_info->crtc;
+		snprintf(out->name, sizeof(out->name), "%s",
+			 output_info->name);
+		XRRFreeOutputInfo(output_info);
+
+		if (out->connected)
+			display_update_frame(dpy, res, out->crtc,
+					     &scan->frame_ns);
+
+		prop_info = XRRQueryOutputProperty(dpy, out->id, ctm_atom);
+		out->has_ctm = prop_info != NULL;
+		if (prop_info)
+			XFree(prop_info);
+		else if (mock_ctm) {
+			XRRConfigureOutputProperty(dpy, out->id, ctm_atom,
+						   False, False, 0, NULL);
+			out->has_ctm = 1;
+		}
+	}
+
+	XRRFreeScreenResources(res);
+	return 0;
+}
+
+/*
+ * Rebuild the output cache from a scan. Outputs keep their last applied CTM
+ * across refreshes, as long as they still exist.
+ */
+static void display_merge(struct display_state *ds,
+			  const struct output_scan *scan)
+{
+	struct output_state old[MAX_OUTPUTS];
+	struct output_state *out;
+	int i, j, nold = ds->noutputs;
+
+	memcpy(old, ds->outputs, sizeof(old[0]) * nold);
+	ds->noutputs = scan->noutputs;
+	memcpy(ds->outputs, scan->outputs,
+	       sizeof(ds->outputs[0]) * scan->noutputs);
+
+	for (i = 0; i < ds->noutputs; i++) {
+		out = &ds->outputs[i];
+		out->metrics_id = metrics_output(out->name);
+
+		for (j = 0; j < nold; j++) {
+			if (old[j].id != out->id &&
+			    (old[j].id || strcmp(old[j].name, out->name)))
+				continue;
+			out->applied = old[j].applied;
+			memcpy(out->applied_ctm, old[j].applied_ctm,
+			       sizeof(out->applied_ctm));
+			out->pending = old[j].pending;
+			memcpy(out->pending_ctm, old[j].pending_ctm,
+			       sizeof(out->pending_ctm));
+			out->write_serial = old[j].write_serial;
+			out->write_ns = old[j].write_ns;
+			out->unsynced = old[j].unsynced;
+		}
+	}
+
+	/* Writes to outputs that went away will never be acknowledged */
+	ds->inflight = 0;
+	for (i = 0; i < ds->noutputs; i++)
+		ds->inflight += ds->outputs[i].unsynced;
+
+	ds->frame_ns = scan->frame_ns ? scan->frame_ns : DEFAULT_FRAME_NS;
+	ds->rr_time = scan->rr_time;
+	ds->rr_config_time = scan->rr_config_time;
+	ds->refreshes++;
+}
+
+/*
+ * Build the output cache, waiting for the server. Only done while opening
+ * the display, later refreshes are left to the worker.
+ */
+static void display_refresh(struct display_state *ds)
+{
+	struct output_scan scan;
+
+	/* Keep the cache as is if the server went away meanwhile */
+	if (!display_scan(ds->dpy, ds->root, ds->ctm_atom, &scan))
+		display_merge(ds, &scan);
+}
+
+/*
+ * Open the query connection of a worker, or open it again once lost. It is
+ * only used for queries, so it needs none of the setup of display_setup().
+ */
+static int display_query_open(struct display_state *ds,
+			      struct display_worker *w)
+{
+	if (w->qdpy && !w->qlost)
+		return 0;
+
+	/* Xlib skips the final XSync of a connection that was lost */
+	if (w->qdpy)
+		XCloseDisplay(w->qdpy);
+	w->qlost = 0;
+
+	w->qdpy = XOpenDisplay(ds->name);
+	if (!w->qdpy)
+		return 1;
+	XSetIOErrorExitHandler(w->qdpy, display_query_io_error_exit, w);
+
+	w->qroot = DefaultRootWindow(w->qdpy);
+	w->qatom = XInternAtom(w->qdpy, PROP_CTM, !mock_ctm);
+	if (!w->qatom) {
+		XCloseDisplay(w->qdpy);
+		w->qdpy = NULL;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Connect to a lost display again, and build everything the caches need,
+ * on the scratch state of the worker. The event loop then takes the new
+ * connection over, see display_adopt().
+ *
+ * Return: 0 on success, non-zero if the server is not back yet.
+ */
+static int display_work_connect(struct display_state *ds,
+				struct display_worker *w)
+{
+	struct display_state *c = w->conn;
+
+	memset(c, 0, sizeof(*c));
+	snprintf(c->name, sizeof(c->name), "%s", ds->name);
+
+	c->dpy = XOpenDisplay(ds->name);
+	if (!c->dpy)
+		return 1;
+	w->connect_ns = now_ns();
+
+	if (display_setup(c) ||
+	    display_scan(c->dpy, c->root, c->ctm_atom, &w->work_scan) ||
+	    c->lost) {
+		XCloseDisplay(c->dpy);
+		c->dpy = NULL;
+		return 1;
+	}
+
+	/* Grabs went away with the old server */
+	if (ds->hotkeys)
+		hotkeys_grab(ds->hotkeys, c);
+
+	/* And so did the query connection */
+	w->qlost = 1;
+	return 0;
+}
+
+static void *display_worker(void *arg)
+{
+	struct display_state *ds = arg;
+	struct display_worker *w = &ds->worker;
+	uint64_t one = 1;
+	int work, done, off = 0;
+
+	/* Not the apply path, see allocwatch.c */
+	heap_ignore_begin();
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (!w->requested && !w->stop)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (w->stop)
+			break;
+
+		work = w->requested;
+		w->requested = 0;
+		w->busy = 1;
+		pthread_mutex_unlock(&w->lock);
+
+		/* A failed attempt is a result too, the daemon backs off */
+		done = 0;
+		if (work & WORK_CONNECT) {
+			done |= WORK_CONNECT;
+			if (!display_work_connect(ds, w)) {
+				done |= WORK_REFRESH;
+				work &= ~WORK_REFRESH;
+			}
+		}
+
+		if ((work & (WORK_REFRESH | WORK_POWER)) &&
+		    !display_query_open(ds, w)) {
+			if ((work & WORK_REFRESH) &&
+			    !display_scan(w->qdpy, w->qroot, w->qatom,
+					  &w->work_scan) && !w->qlost)
+				done |= WORK_REFRESH;
+			if (work & WORK_POWER) {
+				off = power_query(w->qdpy);
+				if (off >= 0 && !w->qlost)
+					done |= WORK_POWER;
+			}
+		}
+
+		pthread_mutex_lock(&w->lock);
+		if (done & WORK_REFRESH)
+			memcpy(&w->scan, &w->work_scan, sizeof(w->scan));
+		if (done & WORK_POWER)
+			w->dpms_off = off;
+		w->finished |= done;
+		w->busy = 0;
+		if (done && write(w->efd, &one, sizeof(one)) < 0)
+			printf("%s: cannot wake the event loop. %s\n",
+			       ds->name, strerror(errno));
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/* Start the worker of a display, see display_request(). */
+static int display_start_worker(struct display_state *ds)
+{
+	struct display_worker *w = &ds->worker;
+
+	w->conn = calloc(1, sizeof(*w->conn));
+	if (!w->conn)
+		return 1;
+
+	w->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (w->efd < 0) {
+		printf("%s: cannot create the worker event. %s\n", ds->name,
+		       strerror(errno));
+		goto free;
+	}
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	if (thread_start(&w->thread, display_worker, ds)) {
+		printf("%s: cannot start the worker.\n", ds->name);
+		close(w->efd);
+		goto free;
+	}
+	return 0;
+
+free:
+	free(w->conn);
+	w->conn = NULL;
+	return 1;
+}
+
+/*
+ * Close a connection. A server that may not answer the XSync done by
+ * XCloseDisplay() gets the connection shut first, so that it fails at once.
+ */
+static void display_hang_up(Display *dpy, int hung)
+{
+	if (hung)
+		shutdown(ConnectionNumber(dpy), SHUT_RDWR);
+	XCloseDisplay(dpy);
+}
+
+/* Stop the worker of a display. One waiting for a hung server is left. */
+static void display_stop_worker(struct display_state *ds)
+{
+	struct display_worker *w = &ds->worker;
+	int busy;
+
+	if (!w->conn)
+		return;
+
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	busy = w->busy;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	if (busy) {
+		pthread_detach(w->thread);
+		return;
+	}
+
+	pthread_join(w->thread, NULL);
+	if (w->qdpy)
+		display_hang_up(w->qdpy, display_stalled(ds));
+	if (w->conn->dpy)
+		display_hang_up(w->conn->dpy, 0);
+	close(w->efd);
+	free(w->conn);
+	w->conn = NULL;
+}
+
+/**
+ * Open an X display and build the caches.
+ *
+ * @ds: Display state to initialize.
+ * @name: X display name, or NULL to use the DISPLAY environment variable.
+ *
+ * Return: 0 on success, non-zero otherwise.
+ */
+int display_open(struct display_state *ds, const char *name)
+{
+	const struct warm_display *wd;
+
+	memset(ds, 0, sizeof(*ds));
+
+	/* The workers use Xlib alongside the event loop */
+	XInitThreads();
+
+	ds->dpy = XOpenDisplay(name);
+	if (!ds->dpy) {
+		printf("Cannot open display %s, check the DISPLAY environment "
+		       "variable.\n", name ? name : "");
+		return 1;
+	}
+	snprintf(ds->name, sizeof(ds->name), "%s", DisplayString(ds->dpy));
+
+	XSetErrorHandler(display_error_handler);
+	XSetIOErrorHandler(display_io_error);
+	register_display(ds);
+
+	/* The atom from the warm state is only good on the same server */
+	wd = warm_find(warm_caches, ds->name);
+	if (wd)
+		ds->ctm_atom = wd->ctm_atom;
+
+	if (display_setup(ds))
+		goto close;
+
+	if (!wd || !display_warm_start(ds, wd)) {
+		if (wd && display_intern(ds))
+			goto close;
+		display_refresh(ds);
+	}
+
+	if (display_start_worker(ds))
+		goto close;
+	return 0;
+
+close:
+	display_close(ds);
+	return 1;
+}
+
+/**
+ * Have the displays opened from now on take their caches from a warm state
+ * file, when their server did not change since it was written.
+ *
+ * @warm: The mapped warm state, or NULL to always build the caches.
+ */
+void display_set_warm(const struct warm *warm)
+{
+	warm_caches = warm;
+}
+
+/**
+ * Have the displays opened from now on create a plain CTM property on the
+ * outputs that have none. The server keeps and acknowledges writes to it
+ * like to a real one, without any hardware behind it, so that the
+ * long-running modes and trace replays can run on e.g. Xvfb.
+ */
+void display_set_mock(int mock)
+{
+	mock_ctm = mock;
+}
+
+/* Drop the connection to the server, keeping the caches. */
+static void display_disconnect(struct display_state *ds)
+{
+	int i;
+
+	for (i = 0; i < MAX_DISPLAYS; i++)
+		if (open_displays[i] == ds)
+			open_displays[i] = NULL;
+	if (ds->dpy)
+		display_hang_up(ds->dpy, display_stalled(ds));
+	ds->dpy = NULL;
+}
+
+void display_close(struct display_state *ds)
+{
+	display_stop_worker(ds);
+	display_disconnect(ds);
+}
+
+/**
+ * Let go of a display whose connection was lost. Every output keeps the CTM
+ * it should have, held back until display_reconnect(): a new server starts
+ * from the default color.
+ */
+void display_lost(struct display_state *ds)
+{
+	struct output_state *out;
+	int i;
+
+	heap_ignore_begin();
+
+	for (i = 0; i < ds->noutputs; i++) {
+		out = &ds->outputs[i];
+		if (out->applied && !out->pending) {
+			memcpy(out->pending_ctm, out->applied_ctm,
+			       sizeof(out->pending_ctm));
+			out->pending = 1;
+		}
+		out->applied = 0;
+		out->unsynced = 0;
+		out->connected = 0;
+
+		/* X-ids do not survive the server, match by name instead */
+		out->id = None;
+	}
+	ds->inflight = 0;
+	ds->ping_sent = 0;
+	ds->restore_ns = 0;
+	ds->losses++;
+
+	display_disconnect(ds);
+	heap_ignore_end();
+}
+
+/**
+ * Have the worker of a display do round trips for the event loop.
+ *
+ * @ds: The display
+ * @work: WORK_REFRESH to scan the outputs again, WORK_POWER to poll DPMS,
+ *        or WORK_CONNECT to connect again to a lost display.
+ *
+ * The results are taken by display_work_done(), once the fd of the worker
+ * is readable.
+ */
+void display_request(struct display_state *ds, int work)
+{
+	struct display_worker *w = &ds->worker;
+
+	pthread_mutex_lock(&w->lock);
+	w->requested |= work;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * Try to reconnect to a lost display, from its worker. Once connected, the
+ * caches are built again, and the CTMs held back are written in one batch,
+ * see display_work_done().
+ */
+void display_reconnect(struct display_state *ds)
+{
+	if (ds->dpy || ds->connecting)
+		return;
+
+	ds->connecting = 1;
+	display_request(ds, WORK_CONNECT);
+}
+
+/* Take over a connection made by the worker, see display_work_connect(). */
+static void display_adopt(struct display_state *ds, struct display_state *c)
+{
+	ds->dpy = c->dpy;
+	ds->root = c->root;
+	ds->ctm_atom = c->ctm_atom;
+	ds->rr_event_base = c->rr_event_base;
+	ds->rr_error_base = c->rr_error_base;
+	ds->dpms_opcode = c->dpms_opcode;
+	ds->dpms_events = c->dpms_events;
+	ds->dpms_off = c->dpms_off;
+	ds->saver_event_base = c->saver_event_base;
+	ds->saver_events = c->saver_events;
+	ds->saver_on = c->saver_on;
+	ds->ping_win = c->ping_win;
+	ds->ping_atom = c->ping_atom;
+	ds->ping_sent = 0;
+	ds->lost = c->lost;
+	c->dpy = NULL;
+
+	XSetIOErrorExitHandler(ds->dpy, display_io_error_exit, ds);
+	register_display(ds);
+}
+
+static int display_take_work(struct display_state *ds)
+{
+	struct display_worker *w = &ds->worker;
+	uint64_t count, ready = 0;
+	int work, n;
+
+	if (read(w->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return 0;
+
+	pthread_mutex_lock(&w->lock);
+	work = w->finished;
+	w->finished = 0;
+
+	if (work & WORK_CONNECT) {
+		ds->connecting = 0;
+		ready = w->connect_ns;
+		if (w->conn->dpy)
+			display_adopt(ds, w->conn);
+	}
+
+	/* Results from a connection that was lost since are stale */
+	if (ds->dpy && (work & WORK_REFRESH))
+		display_merge(ds, &w->scan);
+	if (ds->dpy && (work & WORK_POWER))
+		ds->dpms_off = w->dpms_off;
+	pthread_mutex_unlock(&w->lock);
+
+	if (!ds->dpy)
+		return work & WORK_CONNECT;
+
+	n = display_apply_pending(ds);
+	if (!(work & WORK_CONNECT))
+		return work;
+
+	printf("%s: reconnected, caches rebuilt and %d output(s) written in "
+	       "%.3f ms\n", ds->name, n, (now_ns() - ready) / 1e6);
+
+	/* Color is right once the server acknowledged every write */
+	if (ds->inflight)
+		ds->restore_ns = ready;
+	else
+		printf("%s: color restored %.3f ms after the server came "
+		       "back\n", ds->name, (now_ns() - ready) / 1e6);
+	return work;
+}
+
+/**
+ * Take the results of the round trips done by the worker of a display: a
+ * new connection, the outputs scanned, or the DPMS state. The CTMs that can
+ * be written then are, in one batch. Never blocks.
+ *
+ * Return: The WORK_* bits done. WORK_CONNECT is also set when connecting
+ *         failed, in which case ds->dpy is still NULL.
+ */
+int display_work_done(struct display_state *ds)
+{
+	int work;
+
+	/* Refreshes and reconnects are not the apply path */
+	heap_ignore_begin();
+	work = display_take_work(ds);
+	heap_ignore_end();
+	return work;
+}
+
+/**
+ * Find a cached output by name.
+ *
+ * Return: The output, or NULL if there is no such output.
+ */
+struct output_state *display_find_output(struct display_state *ds,
+					 const char *name)
+{
+	int i;
+
+	for (i = 0; i < ds->noutputs; i++)
+		if (!strcmp(ds->outputs[i].name, name))
+			return &ds->outputs[i];
+	return NULL;
+}
+
+/* Send a packed CTM to an output. */
+static void display_write_ctm(struct display_state *ds,
+			      struct output_state *out, const long *padded_ctm)
+{
+	uint64_t start = now_ns();
+
+	/* Remember the request, to match errors against it */
+	out->write_serial = NextRequest(ds->dpy);
+	XRRChangeOutputProperty(ds->dpy, out->id, ds->ctm_atom,
+				XA_INTEGER, FORMAT_32_BIT, PropModeReplace,
+				(unsigned char *)padded_ctm, 18);
+	recorder_apply(out->name, out->write_serial,
+		       out->applied ? out->applied_ctm : NULL, padded_ctm,
+		       Success);
+
+	memcpy(out->applied_ctm, padded_ctm, sizeof(out->applied_ctm));
+	out->applied = 1;
+	out->write_ns = start;
+	if (!out->unsynced) {
+		out->unsynced = 1;
+		if (!ds->inflight++)
+			ds->inflight_since = start;
+	}
+	ds->applies++;
+
+	metrics_observe(out->metrics_id, PHASE_WRITE, now_ns() - start);
+	metrics_count(out->metrics_id, METRIC_APPLIES);
+}
+
+/**
+ * Queue a CTM change on a cached output. Nothing is sent if the output
+ * already has this exact CTM. Call display_flush() to have the server apply
+ * the queued changes.
+ *
+ * While the screens sleep, the output is not driven by a CRTC, or the server
+ * is stalled, the CTM is held back instead. Only the latest one is kept, and
+ * it is written by display_apply_pending() once the output wakes up.
+ *
+ * @ds: The display
+ * @out: The output, from display_find_output().
+ * @padded_ctm: The CTM, already packed for RandR with pack_ctm().
+ *
+ * Return: 1 if a change was queued, 0 if it was skipped or deferred, or
+ *         BadName if the output has no CTM property.
+ */
+int display_set_packed(struct display_state *ds, struct output_state *out,
+		       const long *padded_ctm)
+{
+	trace_apply(ds, out->name, padded_ctm);
+
+	if (!out->has_ctm) {
+		metrics_count(out->metrics_id, METRIC_FAILURES);
+		recorder_apply(out->name, 0, out->applied ? out->applied_ctm :
+			       NULL, padded_ctm, BadName);
+		return BadName;
+	}
+
+	if (out->applied &&
+	    !memcmp(out->applied_ctm, padded_ctm, sizeof(out->applied_ctm))) {
+		/* Back to what the hardware has, drop anything held back */
+		out->pending = 0;
+		ds->skipped++;
+		return 0;
+	}
+
+	if (display_asleep(ds) || !out->connected || display_stalled(ds) ||
+	    !ds->dpy) {
+		memcpy(out->pending_ctm, padded_ctm, sizeof(out->pending_ctm));
+		out->pending = 1;
+		ds->deferred++;
+		return 0;
+	}
+
+	out->pending = 0;
+	display_write_ctm(ds, out, padded_ctm);
+	return 1;
+}
+
+/**
+ * Queue a CTM change on a cached output, see display_set_packed().
+ *
+ * @ds: The display
+ * @out: The output, from display_find_output().
+ * @ctm: The DRM CTM, as produced by coeffs_to_ctm().
+ */
+int display_set_ctm(struct display_state *ds, struct output_state *out,
+		    const struct _drm_color_ctm *ctm)
+{
+	long padded_ctm[18];
+
+	/* See set_ctm() for why the CTM needs padding */
+	pack_ctm(ctm, padded_ctm);
+	return display_set_packed(ds, out, padded_ctm);
+}
+
+/**
+ * Write the CTMs held back while the outputs slept or the server stalled, in
+ * one batch.
+ *
+ * Return: Number of outputs written.
+ */
+int display_apply_pending(struct display_state *ds)
+{
+	struct output_state *out;
+	int i, n = 0;
+
+	if (!ds->dpy || display_asleep(ds) || display_stalled(ds))
+		return 0;
+
+	for (i = 0; i < ds->noutputs; i++) {
+		out = &ds->outputs[i];
+		if (!out->pending || !out->connected)
+			continue;
+		out->pending = 0;
+		display_write_ctm(ds, out, out->pending_ctm);
+		metrics_count(out->metrics_id, METRIC_REASSERTS);
+		n++;
+	}
+
+	if (n) {
+		display_flush(ds);
+		ds->wakeups++;
+	}
+	return n;
+}
+
+/* Send all queued changes to the server, without waiting for it. */
+void display_flush(struct display_state *ds)
+{
+	XFlush(ds->dpy);
+}
+
+/**
+ * Check if the server left writes or a ping unanswered for longer than
+ * STALL_NS. Nothing that would wait for a stalled server should be sent to
+ * it.
+ */
+int display_stalled(const struct display_state *ds)
+{
+	uint64_t now;
+
+	if (!ds->inflight && !ds->ping_sent)
+		return 0;
+
+	now = now_ns();
+	return (ds->inflight && now - ds->inflight_since > STALL_NS) ||
+	       (ds->ping_sent && now - ds->ping_sent > STALL_NS);
+}
+
+/**
+ * Have the server prove it is responsive, by writing to the property of a
+ * window of our own: its event comes back once the server got through
+ * everything sent before. At most one ping is outstanding, see
+ * display_stalled().
+ */
+void display_ping(struct display_state *ds)
+{
+	static const long zero;
+
+	if (!ds->dpy || ds->ping_sent)
+		return;
+
+	XChangeProperty(ds->dpy, ds->ping_win, ds->ping_atom, XA_CARDINAL, 32,
+			PropModeReplace, (const unsigned char *)&zero, 1);
+	XFlush(ds->dpy);
+	ds->ping_sent = now_ns();
+}
+
+/* A write was acknowledged by its property event. */
+static void display_write_done(struct display_state *ds, RROutput id)
+{
+	struct output_state *out;
+	uint64_t now, elapsed;
+	int i;
+
+	for (i = 0; i < ds->noutputs; i++) {
+		out = &ds->outputs[i];
+		if (out->id != id || !out->unsynced)
+			continue;
+
+		now = now_ns();
+		elapsed = now - out->write_ns;
+		out->unsynced = 0;
+		ds->inflight--;
+
+		/* Still making progress, so not stalled */
+		ds->inflight_since = now;
+
+		ds->syncs++;
+		ds->sync_ns += elapsed;
+		if (elapsed > ds->sync_max_ns)
+			ds->sync_max_ns = elapsed;
+		metrics_observe(out->metrics_id, PHASE_SYNC, elapsed);
+	}
+
+	if (ds->restore_ns && !ds->inflight) {
+		printf("%s: color restored %.3f ms after the server came "
+		       "back\n", ds->name, (now_ns() - ds->restore_ns) / 1e6);
+		ds->restore_ns = 0;
+	}
+}
+
+/**
+ * Process pending X events, having the worker refresh the caches on
+ * configuration changes, and writing held back CTMs when outputs wake up.
+ * Never blocks.
+ */
+void display_handle_events(struct display_state *ds)
+{
+	XRROutputPropertyNotifyEvent *prop_ev;
+	XEvent ev;
+	int refresh = 0, power = 0, done = 0, stalled;
+
+	if (!ds->dpy)
+		return;
+	stalled = display_stalled(ds);
+
+	while (XPending(ds->dpy)) {
+		XNextEvent(ds->dpy, &ev);
+
+		prop_ev = (XRROutputPropertyNotifyEvent *)&ev;
+		if (ev.type == PropertyNotify &&
+		    ev.xproperty.window == ds->ping_win) {
+			ds->ping_sent = 0;
+			done = 1;
+		} else if (ev.type == ds->rr_event_base + RRNotify &&
+		    prop_ev->subtype == RRNotify_OutputProperty) {
+			if (prop_ev->property == ds->ctm_atom) {
+				display_write_done(ds, prop_ev->output);
+				done = 1;
+			}
+		} else if (ev.type == ds->rr_event_base + RRScreenChangeNotify ||
+			   ev.type == ds->rr_event_base + RRNotify) {
+			heap_ignore_begin();
+			XRRUpdateConfiguration(&ev);
+			heap_ignore_end();
+			refresh = 1;
+		} else if (power_handle_event(ds, &ev)) {
+			power = 1;
+		} else if (ds->hotkeys) {
+			hotkeys_handle_event(ds->hotkeys, &ev);
+		}
+	}
+
+	/* The scan waits for the server, leave it to the worker */
+	if (refresh)
+		display_request(ds, WORK_REFRESH);
+
+	if (stalled && done) {
+		printf("%s: caught up after stalling.\n", ds->name);
+		ds->stalls++;
+	}
+
+	/* Outputs may have woken up, or the server may have caught up */
+	if (power || done)
+		display_apply_pending(ds);
+}
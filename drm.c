@@ -0,0 +1,1001 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "xsatmgr.h"
+
+/*******************************************************************************
+ * Direct DRM (KMS) path
+ *
+ * Instead of going through the X server, program the CRTC color properties
+ * through the DRM atomic API. This requires DRM master, i.e. no display
+ * server can be running on the device.
+ */
+
+#define MAX_DRM_DEVICES 8
+
+/* Enough for every color property of every output in a single commit */
+#define BLOB_CACHE_SIZE 128
+
+/**
+ * A property blob, see blob_cache_get().
+ *
+ * @hash: FNV-1a hash of the data.
+ * @len: Length of the data.
+ * @blob_id: DRM blob object id.
+ * @data: The data, owned by the caller until the commit, to tell hash
+ *        collisions.
+ */
+struct blob_entry {
+	uint64_t hash;
+	uint32_t len;
+	uint32_t blob_id;
+	const void *data;
+};
+
+/* Property blobs of a commit to a DRM device, looked up by content */
+struct blob_cache {
+	int fd;
+	int nentries;
+	struct blob_entry entries[BLOB_CACHE_SIZE];
+	unsigned long created;
+	unsigned long hits;
+};
+
+/**
+ * A CRTC to program, found through its connector.
+ *
+ * @connector_id: DRM connector object id.
+ * @crtc_id: DRM CRTC object id currently driving the connector.
+ * @ctm_prop: Property id of the CRTC's CTM property.
+ * @edid_hash: edid_hash() of the connector's EDID, for the journal.
+ * @tile_group: Tile group id of a tiled monitor, 0 if not tiled.
+ * @plane_id: Overlay (video) plane on the CRTC, 0 if none is programmed.
+ * @plane_ctm_prop: Property id of the plane's CTM property.
+ * @plane_ctm_3x4: The plane CTM takes a 3x4 matrix, with an offset column.
+ * @named: Connector was named by the user.
+ * @sibling: Connector is another tile of a named connector.
+ * @name: Connector name, e.g. "DP-1".
+ */
+struct drm_target {
+	uint32_t connector_id;
+	uint32_t crtc_id;
+	uint32_t ctm_prop;
+	uint64_t edid_hash;
+	uint32_t tile_group;
+	uint32_t plane_id;
+	uint32_t plane_ctm_prop;
+	int plane_ctm_3x4;
+	/* Index of the request naming the target, plus one; 0 if none */
+	int named;
+	int sibling;
+	char name[OUTPUT_NAME_LEN];
+};
+
+/**
+ * A connector named on the command line, e.g. DP-1, or card1:DP-1 to pick
+ * it on one device.
+ *
+ * @card: Device node name the connector was qualified with, or empty.
+ * @name: Connector name.
+ * @matches: Number of devices with such a connector.
+ * @ready: Number of devices where it can be committed.
+ * @first: Device where it was first found, for error messages.
+ */
+struct drm_request {
+	char card[16];
+	char name[OUTPUT_NAME_LEN];
+	int matches;
+	int ready;
+	char first[32];
+};
+
+/**
+ * A DRM device (GPU) with the targets it drives. Each device is committed
+ * from its own thread, on its own fd.
+ */
+struct drm_gpu {
+	int fd;
+	char path[32];
+	char driver[OUTPUT_NAME_LEN];
+	int ntargets;
+	struct drm_target targets[MAX_OUTPUTS];
+
+	/* Commit state. Either may be NULL, to leave it untouched. */
+	struct blob_cache blobs;
+	const struct _drm_color_ctm *ctm;
+	const struct _drm_color_ctm *plane_ctm;
+	pthread_t thread;
+	int threaded;
+	int ret;
+	uint64_t elapsed_ns;
+};
+
+/**
+ * Find several properties on a DRM object by name, in a single pass over the
+ * object's properties.
+ *
+ * @fd: DRM device fd
+ * @obj_id: DRM object id
+ * @obj_type: DRM_MODE_OBJECT_* type of the object.
+ * @names: Property names to search for.
+ * @ids: The property ids are placed here, 0 for properties not found.
+ * @values: If not NULL, the current property values are placed here.
+ * @n: Number of properties to search for.
+ *
+ * Return: Number of properties found.
+ */
+static int drm_find_props(int fd, uint32_t obj_id, uint32_t obj_type,
+			  const char *const *names, uint32_t *ids,
+			  uint64_t *values, int n)
+{
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyPtr prop;
+	uint32_t i;
+	int j, found = 0;
+
+	memset(ids, 0, sizeof(*ids) * n);
+
+	props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if (!props)
+		return 0;
+
+	for (i = 0; i < props->count_props && found < n; i++) {
+		prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+		for (j = 0; j < n; j++) {
+			if (ids[j] || strcmp(prop->name, names[j]))
+				continue;
+			ids[j] = prop->prop_id;
+			if (values)
+				values[j] = props->prop_values[i];
+			found++;
+			break;
+		}
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+	return found;
+}
+
+/**
+ * Find a property on a DRM object by name.
+ *
+ * @fd: DRM device fd
+ * @obj_id: DRM object id
+ * @obj_type: DRM_MODE_OBJECT_* type of the object.
+ * @name: Property name to search for.
+ * @value: If not NULL, the current value of the property is placed here.
+ *
+ * Return: The property id, or 0 if the object has no such property.
+ */
+static uint32_t drm_find_prop(int fd, uint32_t obj_id, uint32_t obj_type,
+			      const char *name, uint64_t *value)
+{
+	uint32_t id;
+
+	drm_find_props(fd, obj_id, obj_type, &name, &id, value, 1);
+	return id;
+}
+
+/**
+ * Look up the CRTC currently driving a connector, hash its EDID and find the
+ * tile group it belongs to.
+ *
+ * @fd: DRM device fd
+ * @connector_id: DRM connector id
+ * @edid: The edid_hash() of the connector is placed here, 0 if none.
+ * @tile_group: If not NULL, the tile group id is placed here, 0 if the
+ *              monitor is not tiled.
+ *
+ * Return: The CRTC id, or 0 if the connector is not active.
+ */
+static uint32_t drm_connector_state(int fd, uint32_t connector_id,
+				    uint64_t *edid, uint32_t *tile_group)
+{
+	static const char *const names[] = { "CRTC_ID", "EDID", "TILE" };
+	drmModePropertyBlobPtr blob;
+	uint64_t values[3] = { 0, 0, 0 };
+	uint32_t ids[3];
+
+	drm_find_props(fd, connector_id, DRM_MODE_OBJECT_CONNECTOR, names,
+		       ids, values, tile_group ? 3 : 2);
+
+	*edid = 0;
+	if (values[1]) {
+		blob = drmModeGetPropertyBlob(fd, values[1]);
+		if (blob) {
+			*edid = edid_hash(blob->data, blob->length);
+			drmModeFreePropertyBlob(blob);
+		}
+	}
+
+	/* The TILE blob is a string: "group:flags:num_h:num_v:loc_h:..." */
+	if (tile_group) {
+		*tile_group = 0;
+		blob = values[2] ? drmModeGetPropertyBlob(fd, values[2]) : NULL;
+		if (blob) {
+			char tile[64];
+
+			snprintf(tile, sizeof(tile), "%.*s",
+				 (int)blob->length, (char *)blob->data);
+			*tile_group = strtoul(tile, NULL, 10);
+			drmModeFreePropertyBlob(blob);
+		}
+	}
+
+	return values[0];
+}
+
+/*
+ * Plane color properties. There is no generic one for planes yet, so each
+ * kind has a list of names, generic first and then driver-private ones. The
+ * AMD plane CTM is a 3x4 matrix.
+ */
+enum plane_color_prop {
+	PLANE_TYPE,
+	PLANE_DEGAMMA,
+	PLANE_AMD_DEGAMMA,
+	PLANE_CTM,
+	PLANE_AMD_CTM,
+	PLANE_LUT,
+	PLANE_AMD_LUT,
+	NUM_PLANE_PROPS,
+};
+
+static const char *const plane_props[NUM_PLANE_PROPS] = {
+	[PLANE_TYPE] = "type",
+	[PLANE_DEGAMMA] = "DEGAMMA_LUT",
+	[PLANE_AMD_DEGAMMA] = "AMD_PLANE_DEGAMMA_LUT",
+	[PLANE_CTM] = "CTM",
+	[PLANE_AMD_CTM] = "AMD_PLANE_CTM",
+	[PLANE_LUT] = "GAMMA_LUT",
+	[PLANE_AMD_LUT] = "AMD_PLANE_BLEND_LUT",
+};
+
+/* Name of the first property of a kind the plane has, or "-" */
+static const char *plane_prop_name(const uint32_t *ids, int generic,
+				   int amd)
+{
+	if (ids[generic])
+		return plane_props[generic];
+	return ids[amd] ? plane_props[amd] : "-";
+}
+
+/**
+ * Find the overlay plane scanning out on a target's CRTC, and the color
+ * properties it offers. Every overlay plane found is reported; the first
+ * one with a CTM is the one programmed.
+ *
+ * @fd: DRM device fd
+ * @t: The target. plane_id and plane_ctm_prop are filled in.
+ *
+ * Return: 1 if a plane with a CTM was found, 0 otherwise.
+ */
+static int drm_find_video_plane(int fd, struct drm_target *t)
+{
+	drmModePlaneResPtr planes;
+	drmModePlanePtr plane;
+	uint32_t ids[NUM_PLANE_PROPS];
+	uint64_t values[NUM_PLANE_PROPS];
+	uint32_t i, crtc_id;
+
+	planes = drmModeGetPlaneResources(fd);
+	if (!planes)
+		return 0;
+
+	for (i = 0; i < planes->count_planes && !t->plane_id; i++) {
+		plane = drmModeGetPlane(fd, planes->planes[i]);
+		if (!plane)
+			continue;
+		crtc_id = plane->crtc_id;
+		drmModeFreePlane(plane);
+		if (crtc_id != t->crtc_id)
+			continue;
+
+		memset(values, 0, sizeof(values));
+		drm_find_props(fd, planes->planes[i], DRM_MODE_OBJECT_PLANE,
+			       plane_props, ids, values, NUM_PLANE_PROPS);
+		if (!ids[PLANE_TYPE] ||
+		    values[PLANE_TYPE] != DRM_PLANE_TYPE_OVERLAY)
+			continue;
+
+		printf("Plane %u: overlay on %s, degamma %s, CTM %s, LUT %s\n",
+		       planes->planes[i], t->name,
+		       plane_prop_name(ids, PLANE_DEGAMMA, PLANE_AMD_DEGAMMA),
+		       plane_prop_name(ids, PLANE_CTM, PLANE_AMD_CTM),
+		       plane_prop_name(ids, PLANE_LUT, PLANE_AMD_LUT));
+
+		if (ids[PLANE_CTM] || ids[PLANE_AMD_CTM]) {
+			t->plane_id = planes->planes[i];
+			t->plane_ctm_prop = ids[PLANE_CTM] ? ids[PLANE_CTM] :
+					    ids[PLANE_AMD_CTM];
+			t->plane_ctm_3x4 = !ids[PLANE_CTM];
+		}
+	}
+
+	drmModeFreePlaneResources(planes);
+	return t->plane_id != 0;
+}
+
+/* Name a connector the same way the kernel does, e.g. "DP-1" */
+static void drm_connector_name(drmModeConnectorPtr conn, char *buf,
+			       size_t len)
+{
+	const char *type = drmModeGetConnectorTypeName(conn->connector_type);
+
+	snprintf(buf, len, "%s-%u", type ? type : "Unknown",
+		 conn->connector_type_id);
+}
+
+/*
+ * Find the request naming a connector of a device, and count the match.
+ *
+ * Return: Index of the request plus one, or 0 if none names it.
+ */
+static int drm_match_request(struct drm_request *reqs, int nreqs,
+			     const char *path, const char *name)
+{
+	const char *card = strrchr(path, '/') + 1;
+	int i;
+
+	for (i = 0; i < nreqs; i++) {
+		if (strcmp(reqs[i].name, name) ||
+		    (reqs[i].card[0] && strcmp(reqs[i].card, card)))
+			continue;
+		if (!reqs[i].matches++)
+			snprintf(reqs[i].first, sizeof(reqs[i].first), "%s",
+				 path);
+		return i + 1;
+	}
+	return 0;
+}
+
+/**
+ * Open a DRM device, and collect the CRTCs driving the requested connectors.
+ *
+ * @path: Device node path, e.g. /dev/dri/card0
+ * @reqs: The requested connectors. Their matches and ready counts are
+ *        updated.
+ * @nreqs: Number of requested connectors.
+ * @crtc: The CRTC CTM is programmed, the CRTCs must have one.
+ * @plane: The video plane CTM is programmed, the CRTCs must have an overlay
+ *         plane with one.
+ * @gpu: Filled in on success.
+ *
+ * Return: Number of named connectors found. 0 if the device does not exist
+ *         or cannot be used. The fd is left open only if named connectors
+ *         were found. gpu->ntargets also counts the other tiles of tiled
+ *         monitors.
+ */
+static int drm_open_gpu(const char *path, struct drm_request *reqs,
+			int nreqs, int crtc, int plane, struct drm_gpu *gpu)
+{
+	drmModeResPtr res;
+	drmModeConnectorPtr conn;
+	drmVersionPtr ver;
+	struct drm_target *t;
+	int i, j, n = 0, nnamed = 0;
+
+	memset(gpu, 0, sizeof(*gpu));
+	snprintf(gpu->path, sizeof(gpu->path), "%s", path);
+
+	gpu->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (gpu->fd < 0)
+		return 0;
+
+	if (drmSetClientCap(gpu->fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+		printf("%s: atomic modesetting not supported.\n", path);
+		goto fail;
+	}
+
+	ver = drmGetVersion(gpu->fd);
+	if (ver) {
+		snprintf(gpu->driver, sizeof(gpu->driver), "%s", ver->name);
+		drmFreeVersion(ver);
+	}
+
+	res = drmModeGetResources(gpu->fd);
+	if (!res)
+		goto fail;
+
+	/* Collect every connector first, tiles are matched up below */
+	for (i = 0; i < res->count_connectors && n < MAX_OUTPUTS; i++) {
+		conn = drmModeGetConnectorCurrent(gpu->fd, res->connectors[i]);
+		if (!conn)
+			continue;
+
+		t = &gpu->targets[n++];
+		memset(t, 0, sizeof(*t));
+		drm_connector_name(conn, t->name, sizeof(t->name));
+		t->connector_id = conn->connector_id;
+		drmModeFreeConnector(conn);
+
+		t->crtc_id = drm_connector_state(gpu->fd, t->connector_id,
+						 &t->edid_hash, &t->tile_group);
+		t->named = drm_match_request(reqs, nreqs, path, t->name);
+	}
+
+	drmModeFreeResources(res);
+
+	/*
+	 * A tiled monitor is driven by several connectors sharing a tile
+	 * group. Pull in all tiles of a named connector, so that they are
+	 * committed together and no seam shows up between them.
+	 */
+	for (i = 0; i < n; i++) {
+		t = &gpu->targets[i];
+		if (t->named || !t->tile_group)
+			continue;
+		for (j = 0; j < n; j++) {
+			if (!gpu->targets[j].named ||
+			    gpu->targets[j].tile_group != t->tile_group)
+				continue;
+			printf("Including tile %s of %s\n", t->name,
+			       gpu->targets[j].name);
+			t->sibling = 1;
+			break;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		t = &gpu->targets[i];
+		if (!t->named && !t->sibling)
+			continue;
+
+		if (!t->crtc_id) {
+			printf("%s: output %s is not active.\n", path, t->name);
+			continue;
+		}
+
+		t->ctm_prop = drm_find_prop(gpu->fd, t->crtc_id,
+					    DRM_MODE_OBJECT_CRTC, PROP_CTM,
+					    NULL);
+		if (crtc && !t->ctm_prop) {
+			printf("Property key '%s' not found on output %s\n",
+			       PROP_CTM, t->name);
+			continue;
+		}
+
+		if (plane && !drm_find_video_plane(gpu->fd, t)) {
+			printf("No overlay plane with a CTM on output %s\n",
+			       t->name);
+			continue;
+		}
+
+		gpu->targets[gpu->ntargets++] = *t;
+		if (t->named) {
+			reqs[t->named - 1].ready++;
+			nnamed++;
+		}
+	}
+
+	/* Siblings alone are not worth a commit */
+	if (nnamed)
+		return nnamed;
+fail:
+	close(gpu->fd);
+	gpu->fd = -1;
+	return 0;
+}
+
+/* Widen a CTM to the 3x4 layout, with a zero offset column. */
+static void drm_ctm_3x4(const struct _drm_color_ctm *ctm, uint64_t *matrix)
+{
+	int i, j;
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++)
+			matrix[i * 4 + j] = ctm->matrix[i * 3 + j];
+		matrix[i * 4 + 3] = 0;
+	}
+}
+
+/*******************************************************************************
+ * Property blob cache
+ *
+ * Color properties are set through blobs, and every blob costs a create and
+ * a destroy ioctl, and a copy of its data into the kernel. CRTCs are often
+ * given the very same CTM or LUT in one commit, e.g. every monitor of a
+ * desk restored to one calibration, or the CRTC and video plane set to the
+ * same matrix, so blobs are looked up by content and created once per
+ * commit. The commit then only refers to blob ids.
+ *
+ * The cache only lives as long as a commit: runs are short-lived, and blobs
+ * are per device fd, so there is nothing to reuse across commits. The CRTC
+ * and plane states hold their own references, so the blobs are destroyed
+ * right after the commit. Precreating blobs for fades, and keeping them
+ * under a budget, are left out: fades only run through RandR, there is no
+ * per-frame DRM path to use them.
+ */
+
+static void blob_cache_init(struct blob_cache *c, int fd)
+{
+	memset(c, 0, sizeof(*c));
+	c->fd = fd;
+}
+
+/**
+ * Get a blob holding some data, creating it if none of this commit holds
+ * the same data yet.
+ *
+ * @c: Cache of the device
+ * @data: Blob data, which must stay valid until blob_cache_flush().
+ * @len: Length of the data, in bytes.
+ * @blob_id: The blob id is placed here.
+ *
+ * Return: 0 on success, -errno otherwise.
+ */
+static int blob_cache_get(struct blob_cache *c, const void *data,
+			  uint32_t len, uint32_t *blob_id)
+{
+	struct blob_entry *e;
+	uint64_t hash = edid_hash(data, len);
+	int i, ret;
+
+	for (i = 0; i < c->nentries; i++) {
+		e = &c->entries[i];
+		if (e->hash == hash && e->len == len &&
+		    !memcmp(e->data, data, len)) {
+			c->hits++;
+			*blob_id = e->blob_id;
+			return 0;
+		}
+	}
+
+	if (c->nentries == BLOB_CACHE_SIZE)
+		return -ENOSPC;
+
+	e = &c->entries[c->nentries];
+	ret = drmModeCreatePropertyBlob(c->fd, data, len, &e->blob_id);
+	if (ret)
+		return ret;
+
+	e->data = data;
+	e->hash = hash;
+	e->len = len;
+	c->nentries++;
+	c->created++;
+	*blob_id = e->blob_id;
+	return 0;
+}
+
+/* Destroy the blobs, once the commit is done or given up. */
+static void blob_cache_flush(struct blob_cache *c)
+{
+	while (c->nentries)
+		drmModeDestroyPropertyBlob(c->fd,
+					   c->entries[--c->nentries].blob_id);
+}
+
+/**
+ * Commit the CTMs to every target of a GPU in one atomic commit: the CRTC
+ * CTM, and the video plane CTM, as requested. Runs on its own thread so that
+ * GPUs are committed in parallel.
+ */
+static void *drm_commit_gpu(void *arg)
+{
+	struct drm_gpu *gpu = arg;
+	drmModeAtomicReqPtr req;
+	uint64_t start = now_ns();
+	uint64_t plane_3x4[12];
+	uint32_t blob_id = 0, plane_blob = 0, plane_blob_3x4 = 0;
+	int i;
+
+	if (gpu->ctm) {
+		gpu->ret = blob_cache_get(&gpu->blobs, gpu->ctm,
+					  sizeof(*gpu->ctm), &blob_id);
+		if (gpu->ret)
+			goto out;
+	}
+
+	/* Blobs of both layouts; each plane takes the one it expects */
+	if (gpu->plane_ctm) {
+		drm_ctm_3x4(gpu->plane_ctm, plane_3x4);
+		gpu->ret = blob_cache_get(&gpu->blobs, gpu->plane_ctm,
+					  sizeof(*gpu->plane_ctm),
+					  &plane_blob);
+		if (!gpu->ret)
+			gpu->ret = blob_cache_get(&gpu->blobs, plane_3x4,
+						  sizeof(plane_3x4),
+						  &plane_blob_3x4);
+		if (gpu->ret)
+			goto out;
+	}
+
+	req = drmModeAtomicAlloc();
+	if (!req) {
+		gpu->ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < gpu->ntargets; i++) {
+		if (blob_id)
+			drmModeAtomicAddProperty(req, gpu->targets[i].crtc_id,
+						 gpu->targets[i].ctm_prop,
+						 blob_id);
+		if (plane_blob && gpu->targets[i].plane_id)
+			drmModeAtomicAddProperty(req,
+				gpu->targets[i].plane_id,
+				gpu->targets[i].plane_ctm_prop,
+				gpu->targets[i].plane_ctm_3x4 ?
+				plane_blob_3x4 : plane_blob);
+	}
+
+	gpu->ret = drmModeAtomicCommit(gpu->fd, req, 0, NULL);
+	drmModeAtomicFree(req);
+
+out:
+	blob_cache_flush(&gpu->blobs);
+	gpu->elapsed_ns = now_ns() - start;
+	return NULL;
+}
+
+/* Store the CTM just committed to every target in the journal. */
+static void drm_journal_ctm(struct drm_gpu *gpus, int ngpus,
+			    const struct _drm_color_ctm *ctm,
+			    const char *journal_path)
+{
+	struct journal_record recs[MAX_OUTPUTS];
+	const void *data[MAX_OUTPUTS];
+	struct drm_target *t;
+	int i, j, n = 0;
+
+	for (i = 0; i < ngpus; i++) {
+		for (j = 0; j < gpus[i].ntargets && n < MAX_OUTPUTS; j++) {
+			t = &gpus[i].targets[j];
+			memset(&recs[n], 0, sizeof(recs[n]));
+			recs[n].edid_hash = t->edid_hash;
+			snprintf(recs[n].connector, sizeof(recs[n].connector),
+				 "%s", t->name);
+			snprintf(recs[n].prop, sizeof(recs[n].prop), "%s",
+				 PROP_CTM);
+			recs[n].len = sizeof(*ctm);
+			data[n++] = ctm;
+		}
+	}
+
+	journal_store(journal_path, recs, data, n);
+}
+
+/* Record the commit of a GPU against each of its outputs. */
+static void drm_gpu_metrics(const struct drm_gpu *gpu)
+{
+	int i, id;
+
+	for (i = 0; i < gpu->ntargets; i++) {
+		id = metrics_output(gpu->targets[i].name);
+		if (gpu->ret) {
+			metrics_count(id, METRIC_FAILURES);
+			continue;
+		}
+		metrics_observe(id, PHASE_COMMIT, gpu->elapsed_ns);
+		metrics_count(id, METRIC_APPLIES);
+	}
+}
+
+/*
+ * Split a comma separated list of connector names, each optionally
+ * qualified with its device, e.g. card1:DP-1.
+ *
+ * Return: Number of requests, or -1 if there are too many.
+ */
+static int drm_parse_requests(const char *names, struct drm_request *reqs)
+{
+	char buf[LINE_LEN];
+	char *name, *save, *colon;
+	int n = 0;
+
+	snprintf(buf, sizeof(buf), "%s", names);
+	for (name = strtok_r(buf, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		if (n == MAX_OUTPUTS) {
+			printf("Too many outputs, at most %d.\n", MAX_OUTPUTS);
+			return -1;
+		}
+
+		memset(&reqs[n], 0, sizeof(reqs[n]));
+		colon = strchr(name, ':');
+		if (colon) {
+			*colon = 0;
+			snprintf(reqs[n].card, sizeof(reqs[n].card), "%s",
+				 name);
+			name = colon + 1;
+		}
+		snprintf(reqs[n].name, sizeof(reqs[n].name), "%s", name);
+		n++;
+	}
+	return n;
+}
+
+/**
+ * Apply a CTM to the named connectors through the DRM atomic API.
+ *
+ * All DRM devices are scanned for the connectors. A name found on several
+ * devices is refused, it has to be qualified with the device instead. Each device is then
+ * committed on its own thread, and the time taken by each is reported so
+ * that a slow GPU stands out.
+ *
+ * The video plane CTM goes to the overlay plane scanning out on each CRTC,
+ * in the same commit as the CRTC CTM. The primary plane, and with it the
+ * desktop, is left untouched.
+ *
+ * @names: Comma separated list of DRM connector names, e.g. DP-1, or
+ *         card1:DP-1 for the one on /dev/dri/card1.
+ * @coeffs: Coefficients of the CRTC CTM, or NULL to leave it untouched.
+ * @plane_coeffs: Coefficients of the video plane CTM, or NULL to leave it
+ *                untouched.
+ * @journal_path: If not NULL, the applied CRTC CTM is stored in this
+ *                journal.
+ *
+ * Return: 0 on success, non-zero otherwise.
+ */
+int drm_apply_ctm(char *names, double *coeffs, double *plane_coeffs,
+		  const char *journal_path)
+{
+	static struct drm_gpu gpus[MAX_DRM_DEVICES];
+	struct drm_request reqs[MAX_OUTPUTS];
+	struct drm_request *r;
+	struct _drm_color_ctm ctm, plane_ctm;
+	char path[32];
+	int i, nreqs, ngpus = 0;
+	int ret = 0;
+
+	nreqs = drm_parse_requests(names, reqs);
+	if (nreqs < 0)
+		return 1;
+
+	for (i = 0; i < MAX_DRM_DEVICES; i++) {
+		snprintf(path, sizeof(path), "%s/card%d", DRM_DIR_NAME, i);
+		if (drm_open_gpu(path, reqs, nreqs, coeffs != NULL,
+				 plane_coeffs != NULL, &gpus[ngpus]) > 0)
+			ngpus++;
+	}
+
+	/* Each name has to pick exactly one connector */
+	for (i = 0; i < nreqs; i++) {
+		r = &reqs[i];
+		if (r->matches > 1) {
+			printf("Output %s is on %d devices, qualify it with "
+			       "its device, e.g. %s:%s.\n", r->name,
+			       r->matches, strrchr(r->first, '/') + 1,
+			       r->name);
+			ret = 1;
+		} else if (!r->ready) {
+			printf("Cannot find output %s%s%s.\n", r->card,
+			       r->card[0] ? ":" : "", r->name);
+			ret = 1;
+		}
+	}
+	if (!nreqs) {
+		printf("No outputs given.\n");
+		ret = 1;
+	}
+	if (ret)
+		goto done;
+
+	if (coeffs)
+		coeffs_to_ctm(coeffs, &ctm);
+	if (plane_coeffs)
+		coeffs_to_ctm(plane_coeffs, &plane_ctm);
+
+	for (i = 0; i < ngpus; i++) {
+		blob_cache_init(&gpus[i].blobs, gpus[i].fd);
+		gpus[i].ctm = coeffs ? &ctm : NULL;
+		gpus[i].plane_ctm = plane_coeffs ? &plane_ctm : NULL;
+		gpus[i].threaded = !thread_start(&gpus[i].thread,
+						 drm_commit_gpu, &gpus[i]);
+		if (!gpus[i].threaded)
+			drm_commit_gpu(&gpus[i]);
+	}
+
+	for (i = 0; i < ngpus; i++) {
+		if (gpus[i].threaded)
+			pthread_join(gpus[i].thread, NULL);
+
+		printf("GPU %s (%s): %d output(s) in %.3f ms, %lu blob(s) "
+		       "created, %lu shared\n", gpus[i].path,
+		       gpus[i].driver, gpus[i].ntargets,
+		       gpus[i].elapsed_ns / 1e6, gpus[i].blobs.created,
+		       gpus[i].blobs.hits);
+		drm_gpu_metrics(&gpus[i]);
+		if (gpus[i].ret) {
+			printf("Failed to set CTM on %s. %s\n", gpus[i].path,
+			       strerror(-gpus[i].ret));
+			ret = 1;
+		}
+	}
+
+	if (!ret && coeffs && journal_path)
+		drm_journal_ctm(gpus, ngpus, &ctm, journal_path);
+
+done:
+	for (i = 0; i < ngpus; i++)
+		close(gpus[i].fd);
+	return ret;
+}
+
+/*******************************************************************************
+ * Early boot restore
+ */
+
+/* Properties restored from the journal, in commit order. */
+static const char *const restore_props[] = {
+	PROP_DEGAMMA, PROP_CTM, PROP_GAMMA,
+};
+#define NUM_RESTORE_PROPS (sizeof(restore_props) / sizeof(restore_props[0]))
+
+/**
+ * Replay the journal on one DRM device, in a single atomic commit. Monitors
+ * restored to the same CTM or LUT share its blob.
+ *
+ * @path: DRM device path
+ * @journal: The journal
+ * @saved: Blob creates saved by sharing are added here.
+ *
+ * Return: Number of properties committed, or -errno on failure.
+ */
+static int drm_restore_gpu(const char *path, const struct journal *journal,
+			   unsigned long *saved)
+{
+	static struct blob_cache blobs;
+	const struct journal_record *rec;
+	drmModeAtomicReqPtr req = NULL;
+	drmModeConnectorPtr conn;
+	drmModeResPtr res = NULL;
+	uint32_t prop_ids[NUM_RESTORE_PROPS];
+	uint32_t crtc_id, blob_id;
+	uint64_t hash;
+	char name[OUTPUT_NAME_LEN];
+	int fd, i, nprops = 0, ret = 0;
+	unsigned int j;
+
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	blob_cache_init(&blobs, fd);
+
+	if (drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1))
+		goto out;
+
+	res = drmModeGetResources(fd);
+	req = drmModeAtomicAlloc();
+	if (!res || !req) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < res->count_connectors; i++) {
+		conn = drmModeGetConnectorCurrent(fd, res->connectors[i]);
+		if (!conn)
+			continue;
+		drm_connector_name(conn, name, sizeof(name));
+		drmModeFreeConnector(conn);
+
+		crtc_id = drm_connector_state(fd, res->connectors[i], &hash,
+					      NULL);
+		if (!crtc_id)
+			continue;
+
+		drm_find_props(fd, crtc_id, DRM_MODE_OBJECT_CRTC,
+			       restore_props, prop_ids, NULL,
+			       NUM_RESTORE_PROPS);
+
+		for (j = 0; j < NUM_RESTORE_PROPS; j++) {
+			rec = journal_find(journal, hash, name,
+					   restore_props[j]);
+			if (!rec || !prop_ids[j])
+				continue;
+
+			/* An empty blob is no blob, e.g. the default SRGB
+			 * gamma */
+			if (!rec->len) {
+				drmModeAtomicAddProperty(req, crtc_id,
+							 prop_ids[j], 0);
+				nprops++;
+				continue;
+			}
+
+			/* The blob is stored exactly as DRM wants it */
+			if (blob_cache_get(&blobs, rec + 1, rec->len,
+					   &blob_id))
+				continue;
+			drmModeAtomicAddProperty(req, crtc_id, prop_ids[j],
+						 blob_id);
+			nprops++;
+		}
+	}
+
+	if (nprops)
+		ret = drmModeAtomicCommit(fd, req, 0, NULL);
+
+	*saved += blobs.hits;
+	blob_cache_flush(&blobs);
+out:
+	if (req)
+		drmModeAtomicFree(req);
+	if (res)
+		drmModeFreeResources(res);
+	close(fd);
+	return ret ? ret : nprops;
+}
+
+/**
+ * Restore the journaled color state of every connected monitor, straight
+ * through the DRM atomic API. Meant to run early during boot, before the
+ * display server starts, so there is no parsing or color math involved: the
+ * journal already holds the blobs in the format DRM expects.
+ *
+ * @path: Journal file path.
+ * @start_ns: now_ns() on entering main(), to check the cold-start budget.
+ *
+ * Return: 0 on success, non-zero otherwise.
+ */
+int drm_restore_journal(const char *path, uint64_t start_ns)
+{
+	struct journal journal = { 0 };
+	char dev[32];
+	uint64_t elapsed;
+	unsigned long saved = 0;
+	int i, n, total = 0, ret;
+
+	ret = journal_map(path, &journal);
+	if (ret) {
+		printf("Cannot read journal %s. %s\n", path, strerror(-ret));
+		return 1;
+	}
+
+	for (i = 0; i < MAX_DRM_DEVICES; i++) {
+		snprintf(dev, sizeof(dev), "%s/card%d", DRM_DIR_NAME, i);
+		n = drm_restore_gpu(dev, &journal, &saved);
+		if (n < 0) {
+			printf("Failed to restore %s. %s\n", dev, strerror(-n));
+			ret = 1;
+			continue;
+		}
+		total += n;
+	}
+
+	journal_unmap(&journal);
+
+	elapsed = now_ns() - start_ns;
+	printf("Restored %d property(ies) in %.3f ms from main()%s, %lu blob "
+	       "create(s) saved\n", total, elapsed / 1e6,
+	       elapsed > BOOT_BUDGET_NS ? ", over budget" : "", saved);
+	return ret;
+}
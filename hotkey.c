@@ -0,0 +1,255 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include <X11/Xlib.h>
+
+#include "xsatmgr.h"
+
+/*******************************************************************************
+ * Global hotkeys
+ *
+ * Binding keys to one-shot runs costs a process launch, a connection and an
+ * output lookup per press, and only sets absolute values. Instead, the
+ * long-running modes can grab a pair of keys that step the saturation down
+ * and up. Every step is compiled into its packed CTM when the keys are set
+ * up, so a press is nothing but a table lookup and a batch of property
+ * writes.
+ *
+ * The key setting is <down>,<up>[:<step>], where keys are X keysym names
+ * with optional Ctrl+, Shift+, Alt+ or Super+ modifiers, e.g.
+ * Super+F9,Super+F10:0.05. Steps go from grayscale to HOTKEY_MAX_SAT,
+ * starting from identity.
+ */
+
+static const struct {
+	const char *name;
+	unsigned int mask;
+} modifiers[] = {
+	{ "Ctrl", ControlMask },
+	{ "Shift", ShiftMask },
+	{ "Alt", Mod1Mask },
+	{ "Super", Mod4Mask },
+};
+
+#define NUM_MODIFIERS (sizeof(modifiers) / sizeof(modifiers[0]))
+
+/* Lock modifiers that must not keep the keys from triggering */
+static const unsigned int lock_masks[] = {
+	0, LockMask, Mod2Mask, LockMask | Mod2Mask,
+};
+
+#define NUM_LOCK_MASKS (sizeof(lock_masks) / sizeof(lock_masks[0]))
+
+/* Parse "[<modifier>+]...<keysym>" into a key. */
+static int parse_key(char *spec, struct hotkey *key)
+{
+	char *plus;
+	size_t i;
+
+	key->mods = 0;
+	while ((plus = strchr(spec, '+')) && plus[1]) {
+		*plus = '\0';
+		for (i = 0; i < NUM_MODIFIERS; i++)
+			if (!strcasecmp(spec, modifiers[i].name))
+				break;
+		if (i == NUM_MODIFIERS)
+			return -EINVAL;
+		key->mods |= modifiers[i].mask;
+		spec = plus + 1;
+	}
+
+	key->sym = XStringToKeysym(spec);
+	return key->sym == NoSymbol ? -EINVAL : 0;
+}
+
+/**
+ * Parse the key setting, and compile the packed CTM of every step.
+ *
+ * @hk: Hotkeys to fill in. Release with hotkeys_free().
+ * @spec: Key setting, see above.
+ *
+ * Return: 0 on success, non-zero otherwise.
+ */
+int hotkeys_load(struct hotkeys *hk, const char *spec)
+{
+	struct _drm_color_ctm ctm;
+	double coeffs[9];
+	char buf[LINE_LEN];
+	char *keys, *step, *up;
+	int i;
+
+	memset(hk, 0, sizeof(*hk));
+	snprintf(buf, sizeof(buf), "%s", spec);
+
+	hk->step_size = HOTKEY_STEP;
+	keys = buf;
+	step = strrchr(buf, ':');
+	if (step) {
+		*step++ = '\0';
+		hk->step_size = strtod(step, &step);
+	}
+
+	up = strchr(keys, ',');
+	if (up)
+		*up++ = '\0';
+	if (!up || (step && *step) || hk->step_size <= 0 || hk->step_size > 1 ||
+	    parse_key(keys, &hk->keys[0]) || parse_key(up, &hk->keys[1])) {
+		printf("%s is not a valid hotkey setting.\n", spec);
+		return 1;
+	}
+	hk->keys[0].delta = -1;
+	hk->keys[1].delta = 1;
+
+	hk->nsteps = lround(HOTKEY_MAX_SAT / hk->step_size) + 1;
+	if (hk->nsteps > HOTKEY_MAX_STEPS)
+		hk->nsteps = HOTKEY_MAX_STEPS;
+	hk->table = calloc(hk->nsteps, sizeof(*hk->table));
+	if (!hk->table) {
+		printf("Cannot compile hotkey steps. %s\n", strerror(ENOMEM));
+		return 1;
+	}
+
+	for (i = 0; i < hk->nsteps; i++) {
+		saturation_to_coeffs(i * hk->step_size, coeffs);
+		coeffs_to_ctm(coeffs, &ctm);
+		pack_ctm(&ctm, hk->table[i]);
+	}
+	hk->step = lround(1.0 / hk->step_size);
+	return 0;
+}
+
+void hotkeys_free(struct hotkeys *hk)
+{
+	free(hk->table);
+	hk->table = NULL;
+}
+
+/**
+ * Grab the keys on a display, and have its events handed to the hotkeys.
+ *
+ * @hk: The hotkeys
+ * @ds: The display
+ *
+ * Return: 0 on success, non-zero if a key is not on the keyboard.
+ */
+int hotkeys_grab(struct hotkeys *hk, struct display_state *ds)
+{
+	KeyCode code;
+	size_t i, j;
+
+	for (i = 0; i < HOTKEYS; i++) {
+		code = XKeysymToKeycode(ds->dpy, hk->keys[i].sym);
+		if (!code) {
+			printf("%s: no key for %s.\n", ds->name,
+			       XKeysymToString(hk->keys[i].sym));
+			return 1;
+		}
+
+		for (j = 0; j < NUM_LOCK_MASKS; j++)
+			XGrabKey(ds->dpy, code, hk->keys[i].mods | lock_masks[j],
+				 ds->root, False, GrabModeAsync, GrabModeAsync);
+	}
+
+	ds->hotkeys = hk;
+	XFlush(ds->dpy);
+	return 0;
+}
+
+/**
+ * Account for a key press. Presses are only accumulated here, the daemon
+ * decides when to write them, see hotkeys_advance().
+ *
+ * Return: 1 if the event was a press of one of the keys, 0 otherwise.
+ */
+int hotkeys_handle_event(struct hotkeys *hk, XEvent *ev)
+{
+	unsigned int state = ev->xkey.state & ~(LockMask | Mod2Mask);
+	KeySym sym;
+	size_t i;
+
+	if (ev->type != KeyPress)
+		return 0;
+
+	sym = XLookupKeysym(&ev->xkey, 0);
+	for (i = 0; i < HOTKEYS; i++) {
+		if (hk->keys[i].sym != sym || hk->keys[i].mods != state)
+			continue;
+
+		if (!hk->presses++)
+			hk->press_ns = now_ns();
+		hk->delta += hk->keys[i].delta;
+		hk->total_presses++;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Fold the presses received so far into one step.
+ *
+ * Return: The packed CTM of the new step, or NULL if the presses cancel out
+ *         or the end of the table was already reached.
+ */
+const long *hotkeys_advance(struct hotkeys *hk)
+{
+	int step = hk->step + hk->delta;
+
+	step = step < 0 ? 0 : step;
+	step = step >= hk->nsteps ? hk->nsteps - 1 : step;
+
+	hk->delta = 0;
+	if (step == hk->step) {
+		hk->presses = 0;
+		return NULL;
+	}
+
+	hk->step = step;
+	return hk->table[step];
+}
+
+/* The step from hotkeys_advance() was written, take its latency. */
+void hotkeys_written(struct hotkeys *hk)
+{
+	uint64_t now = now_ns();
+	uint64_t elapsed = now - hk->press_ns;
+
+	printf("Saturation %.2f: %d key press(es), key-to-write %.3f ms\n",
+	       hk->step * hk->step_size, hk->presses, elapsed / 1e6);
+
+	hk->presses = 0;
+	hk->write_ns = now;
+	hk->writes++;
+	hk->latency_ns += elapsed;
+	if (elapsed > hk->latency_max_ns)
+		hk->latency_max_ns = elapsed;
+}
@@ -0,0 +1,374 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "xsatmgr.h"
+
+/*******************************************************************************
+ * Color journal
+ *
+ * The journal remembers the last property blobs applied to each connector,
+ * keyed by a hash of the connector's EDID, so that the same monitor gets the
+ * same color regardless of which port it is plugged in, or whether the blob
+ * was applied through X or DRM (which name connectors differently).
+ *
+ * The blobs are stored exactly as DRM expects them (i.e. not padded for
+ * RandR), so the early boot restore can hand them straight to the kernel.
+ *
+ * On-disk layout, host endian:
+ *
+ *   struct journal_header
+ *   struct journal_record, followed by record.len bytes of blob data, padded
+ *   to 8 bytes
+ *   ... repeated header.nrecords times
+ */
+
+#define JOURNAL_MAGIC 0x4a4d5358 /* "XSMJ" */
+#define JOURNAL_VERSION 1
+
+/* Largest journal we are willing to deal with. */
+#define JOURNAL_MAX_BYTES (1 << 20)
+
+struct journal_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nrecords;
+	uint32_t bytes;
+};
+
+#define JOURNAL_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+/**
+ * Hash an EDID blob, using 64-bit FNV-1a.
+ *
+ * Return: The hash. 0 is reserved for connectors without EDID.
+ */
+uint64_t edid_hash(const void *edid, size_t len)
+{
+	const uint8_t *p = edid;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	size_t i;
+
+	if (!edid || !len)
+		return 0;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash ? hash : 1;
+}
+
+/**
+ * Map the journal read-only.
+ *
+ * @path: Journal file path.
+ * @journal: Filled in on success. Release with journal_unmap().
+ *
+ * Return: 0 on success, -errno otherwise.
+ */
+int journal_map(const char *path, struct journal *journal)
+{
+	const struct journal_header *hdr;
+	struct stat st;
+	void *map;
+	int fd, ret = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	if (st.st_size < (off_t)sizeof(*hdr) ||
+	    st.st_size > JOURNAL_MAX_BYTES) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -errno;
+		goto out;
+	}
+
+	hdr = map;
+	if (hdr->magic != JOURNAL_MAGIC || hdr->version != JOURNAL_VERSION ||
+	    hdr->bytes != st.st_size) {
+		munmap(map, st.st_size);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	journal->data = map;
+	journal->bytes = st.st_size;
+	journal->nrecords = hdr->nrecords;
+out:
+	close(fd);
+	return ret;
+}
+
+void journal_unmap(struct journal *journal)
+{
+	if (journal->data)
+		munmap((void *)journal->data, journal->bytes);
+	journal->data = NULL;
+}
+
+/**
+ * Iterate over the journal records.
+ *
+ * @journal: A mapped journal.
+ * @rec: The previous record, or NULL to get the first one.
+ *
+ * Return: The next record, or NULL when there are no more (or the journal is
+ *         truncated).
+ */
+const struct journal_record *journal_next(const struct journal *journal,
+					  const struct journal_record *rec)
+{
+	const uint8_t *end = journal->data + journal->bytes;
+	const uint8_t *p;
+
+	if (!rec)
+		p = journal->data + sizeof(struct journal_header);
+	else
+		p = (const uint8_t *)(rec + 1) + JOURNAL_ALIGN(rec->len);
+
+	if (p + sizeof(*rec) > end)
+		return NULL;
+
+	rec = (const struct journal_record *)p;
+	if ((const uint8_t *)(rec + 1) + rec->len > end)
+		return NULL;
+	return rec;
+}
+
+/**
+ * Find the journaled blob of a property for a connector. Connectors are
+ * matched by EDID, or by name if they have no EDID.
+ *
+ * Return: The record, or NULL if there is none.
+ */
+const struct journal_record *journal_find(const struct journal *journal,
+					  uint64_t edid_hash,
+					  const char *connector,
+					  const char *prop)
+{
+	const struct journal_record *rec = NULL;
+
+	while ((rec = journal_next(journal, rec))) {
+		if (strcmp(rec->prop, prop))
+			continue;
+		if (edid_hash && rec->edid_hash == edid_hash)
+			return rec;
+		if (!edid_hash && !rec->edid_hash &&
+		    !strcmp(rec->connector, connector))
+			return rec;
+	}
+	return NULL;
+}
+
+/* Check if an existing record is superseded by one of the updates. */
+static int journal_superseded(const struct journal_record *rec,
+			      const struct journal_record *updates,
+			      int nupdates)
+{
+	int i;
+
+	for (i = 0; i < nupdates; i++) {
+		if (strcmp(rec->prop, updates[i].prop))
+			continue;
+		if (rec->edid_hash != updates[i].edid_hash)
+			continue;
+		if (rec->edid_hash ||
+		    !strcmp(rec->connector, updates[i].connector))
+			return 1;
+	}
+	return 0;
+}
+
+/* write() that deals with short writes. */
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Make a rename in the directory of path durable. */
+static int journal_sync_dir(const char *path)
+{
+	char dir[PATH_LEN];
+	char *slash;
+	int fd, ret = 0;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	slash = strrchr(dir, '/');
+	if (slash == dir)
+		slash[1] = 0;
+	else if (slash)
+		*slash = 0;
+	else
+		snprintf(dir, sizeof(dir), ".");
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (fsync(fd) < 0)
+		ret = -errno;
+	close(fd);
+	return ret;
+}
+
+/**
+ * Store blobs in the journal, replacing the previous blobs of the same
+ * connector and property.
+ *
+ * The journal is rewritten to a temporary file which is then renamed over
+ * the old one, so a crash (or power loss during boot) never leaves a torn
+ * journal behind. Runs storing at the same time are serialized by a lock
+ * file next to the journal, held from reading the old records to the
+ * rename, so that none of them loses the records of another.
+ *
+ * @path: Journal file path.
+ * @updates: Record headers of the blobs to store. Their len field gives the
+ *           size of the matching entry in data.
+ * @data: Blob data for each update.
+ * @nupdates: Number of updates.
+ *
+ * Return: 0 on success, -errno otherwise.
+ */
+int journal_store(const char *path, const struct journal_record *updates,
+		  const void *const *data, int nupdates)
+{
+	static const uint8_t zeros[8];
+	struct journal old = { 0 };
+	struct journal_header hdr;
+	const struct journal_record *rec = NULL;
+	char lock_path[PATH_LEN];
+	char tmp_path[PATH_LEN];
+	int lock_fd, fd, i, ret;
+
+	/* The journal itself is replaced on every store, so lock a file that
+	 * stays put instead */
+	snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+	lock_fd = open(lock_path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+		       0644);
+	if (lock_fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+	while ((ret = flock(lock_fd, LOCK_EX)) < 0 && errno == EINTR)
+		;
+	if (ret < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	/* A missing or corrupt journal is simply replaced. */
+	journal_map(path, &old);
+
+	/* In the same directory, for the rename to be atomic */
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+	fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+	fchmod(fd, 0644);
+
+	hdr.magic = JOURNAL_MAGIC;
+	hdr.version = JOURNAL_VERSION;
+	hdr.nrecords = 0;
+	hdr.bytes = sizeof(hdr);
+
+	/* Header is rewritten once the final size is known. */
+	ret = write_all(fd, &hdr, sizeof(hdr));
+
+	while (!ret && old.data && (rec = journal_next(&old, rec))) {
+		if (journal_superseded(rec, updates, nupdates))
+			continue;
+		ret = write_all(fd, rec, sizeof(*rec) + JOURNAL_ALIGN(rec->len));
+		hdr.nrecords++;
+		hdr.bytes += sizeof(*rec) + JOURNAL_ALIGN(rec->len);
+	}
+
+	for (i = 0; !ret && i < nupdates; i++) {
+		ret = write_all(fd, &updates[i], sizeof(updates[i]));
+		if (!ret)
+			ret = write_all(fd, data[i], updates[i].len);
+		if (!ret)
+			ret = write_all(fd, zeros, JOURNAL_ALIGN(updates[i].len) -
+					updates[i].len);
+		hdr.nrecords++;
+		hdr.bytes += sizeof(updates[i]) + JOURNAL_ALIGN(updates[i].len);
+	}
+
+	if (!ret && pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		ret = -errno;
+	if (!ret && fsync(fd) < 0)
+		ret = -errno;
+	close(fd);
+
+	if (!ret && rename(tmp_path, path) < 0)
+		ret = -errno;
+	if (ret)
+		unlink(tmp_path);
+
+	/* The rename itself has to survive a power loss too */
+	if (!ret)
+		ret = journal_sync_dir(path);
+out:
+	journal_unmap(&old);
+	if (lock_fd >= 0)
+		close(lock_fd);
+	if (ret)
+		printf("Failed to write journal %s. %s\n", path, strerror(-ret));
+	return ret;
+}
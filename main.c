@@ -34,299 +34,255 @@
 #include <X11/Xatom.h>
 #include <X11/extensions/Xrandr.h>
 
-#define VERSION_STRING "alpha-v3"
-
-#define LUT_SIZE 4096
-
-#define PROP_CTM "CTM"
-
-/**
- * The below data structures are identical to the ones used by DRM. They are
- * here to help us structure the data being passed to the kernel.
- */
-struct _drm_color_ctm {
-	/* Transformation matrix in S31.32 format. */
-	int64_t matrix[9];
-};
+#include "xsatmgr.h"
 
 /*******************************************************************************
- * Helper functions
+ * main function, and functions to assist in parsing input.
  */
 
-/**
- * Translate coefficients to a color CTM format that DRM accepts.
- *
- * DRM requres the CTM to be in signed-magnitude, not 2's complement.
- * It is also in 31.32 fixed-point format.
- *
- * @coeffs: Input coefficients
- * @ctm: DRM CTM struct, used to create the blob. The translated values will be
- *       placed here.
- */
-static void coeffs_to_ctm(double *coeffs,
-			  struct _drm_color_ctm *ctm)
-{
-	int i;
-	for (i = 0; i < 9; i++) {
-		if (coeffs[i] < 0) {
-			ctm->matrix[i] =
-				(int64_t) (-coeffs[i] * ((int64_t) 1L << 32));
-			ctm->matrix[i] |= 1ULL << 63;
-		} else
-			ctm->matrix[i] =
-				(int64_t) (coeffs[i] * ((int64_t) 1L << 32));
-	}
-}
+static char HELP_STR[] = { 
+	#include "help.xxd"
+};
 
-/**
- * Find the output on the RandR screen resource by name.
- *
- * dpy: The X display
- * res: The RandR screen resource
- * name: The output name to search for.
- *
- * Return: The RROutput X-id if found, 0 (None) otherwise.
- */
-static RROutput find_output_by_name(Display *dpy, XRRScreenResources *res,
-				    const char *name)
+static void print_short_help()
 {
+	/* Just get first line, up to the first new line.*/
+	uint32_t len = strlen(HELP_STR);
+	char *short_help;
+
 	int i;
-	RROutput ret;
-	XRROutputInfo *output_info;
+	for (i = 0; i < len; i++) {
+		if (HELP_STR[i] == '\n')
+			break;
+	}
 
-	for (i = 0; i < res->noutput; i++) {
-		ret = res->outputs[i];
-		output_info = XRRGetOutputInfo (dpy, res, ret);
+	short_help = malloc(sizeof(char) * i);
+	strncpy(short_help, HELP_STR, i);
 
-		if (!strcmp(name, output_info->name)) {
-			XRRFreeOutputInfo(output_info);
-			return ret;
-		}
+	printf("%s\n", short_help);
+	free(short_help);
+}
 
-		XRRFreeOutputInfo(output_info);
-	}
-	return 0;
+static void print_version()
+{
+	printf("%s\n", VERSION_STRING);
 }
 
-enum randr_format {
-    FORMAT_16_BIT = 16,
-    FORMAT_32_BIT = 32,
+/**
+ * A gamma LUT given on the command line, see parse_user_gamma().
+ *
+ * @set: The LUT was given.
+ * @is_srgb: The predefined SRGB LUT was given, coeffs is unused.
+ * @coeffs: The LUT.
+ */
+struct gamma_lut {
+	int set;
+	int is_srgb;
+	struct color3d coeffs[LUT_SIZE];
 };
 
 /**
- * Set a DRM blob property on the given output. It calls XSync at the end to
- * flush the change request so that it applies.
- *
- * @dpy: The X Display
- * @output: RandR output to set the property on
- * @prop_name: String name of the property.
- * @blob_data: The data of the property blob.
- * @blob_bytes: Size of the data, in bytes.
- * @format: Format of each element within blob_data.
- *
- * Return: X-defined return codes:
- *     - BadAtom if the given name string doesn't exist.
- *     - BadName if the property referenced by the name string does not exist on
- *       the given connector
- *     - Success otherwise.
+ * Store a blob applied to the outputs in the journal, so that it can be
+ * restored early during the next boot.
  */
-static int set_output_blob(Display *dpy, RROutput output,
-			   const char *prop_name, void *blob_data,
-			   size_t blob_bytes, enum randr_format format)
+static void journal_outputs(Display *dpy, struct output_target *targets,
+			    int ntargets, const char *prop, const void *blob,
+			    size_t len, const char *journal_path)
 {
-	Atom prop_atom;
-	XRRPropertyInfo *prop_info;
-
-	/* Find the X Atom associated with the property name */
-	prop_atom = XInternAtom (dpy, prop_name, 1);
-	if (!prop_atom) {
-		printf("Property key '%s' not found.\n", prop_name);
-		return BadAtom;
-	}
+	struct journal_record recs[MAX_OUTPUTS];
+	const void *data[MAX_OUTPUTS];
+	int i;
 
-	/* Make sure the property exists */
-	prop_info = XRRQueryOutputProperty(dpy, output, prop_atom);
-	if (!prop_info) {
-		printf("Property key '%s' not found on output\n", prop_name);
-		return BadName;  /* Property not found */
+	for (i = 0; i < ntargets; i++) {
+		memset(&recs[i], 0, sizeof(recs[i]));
+		recs[i].edid_hash = output_edid_hash(dpy, targets[i].id);
+		snprintf(recs[i].connector, sizeof(recs[i].connector), "%s",
+			 targets[i].name);
+		snprintf(recs[i].prop, sizeof(recs[i].prop), "%s", prop);
+		recs[i].len = len;
+		data[i] = blob;
 	}
 
-	/* Change the property 
-	 *
-	 * Due to some restrictions in RandR, array properties of 32-bit format
-	 * must be of type 'long'. See set_ctm() for details.
-	 *
-	 * To get the number of elements within blob_data, we take its size in
-	 * bytes, divided by the size of one of it's elements in bytes:
-	 *
-	 * blob_length = blob_bytes / (element_bytes)
-	 *             = blob_bytes / (format / 8)
-	 *             = blob_bytes / (format >> 3)
-	 */
-	XRRChangeOutputProperty(dpy, output, prop_atom,
-				XA_INTEGER, format, PropModeReplace,
-				blob_data, blob_bytes / (format >> 3));
-	/* Call XSync to apply it. */
-	XSync(dpy, 0);
-
-	return Success;
+	journal_store(journal_path, recs, data, ntargets);
 }
 
 /**
- * Set the de/regamma LUT. Since setting degamma and regamma follows similar
- * procedures, a flag is used to determine which one is set. Also note the
- * special case of setting SRGB gamma, explained further below.
+ * Set a gamma LUT on every target, and journal it as uploaded.
  *
- * @dpy: The X display
- * @output: The output on which to set de/regamma on.
- * @coeffs: Coefficients used to create the DRM color LUT blob.
- * @is_srgb: True if SRGB gamma is being programmed. This is a special case,
- *           since amdgpu DC defaults to SRGB when no DRM blob (i.e. NULL) is
- *           set. In other words, there is no need to create a blob (just set
- *           the blob id to 0)
- * @is_degamma: True if degamma is being set. Set regamma otherwise.
- */
-
-/**
- * Create a DRM color transform matrix using the given coefficients, and set
- * the output's CRTC to use it.
+ * Return: 0 on success, non-zero otherwise.
  */
-static int set_ctm(Display *dpy, RROutput output, double *coeffs)
+static int apply_gamma(Display *dpy, struct output_target *targets,
+		       int ntargets, struct gamma_lut *gamma, int is_degamma,
+		       unsigned int max_error, const char *journal_path)
 {
-	size_t blob_size = sizeof(struct _drm_color_ctm);
-	struct _drm_color_ctm ctm;
-	long padded_ctm[18];
-
-	int i, ret;
-
-	coeffs_to_ctm(coeffs, &ctm);
-
-	/* Workaround:
-	 *
-	 * RandR currently uses long types for 32-bit integer format. However,
-	 * 64-bit systems will use 64-bits for long, causing data corruption
-	 * once RandR parses the data. Therefore, pad the blob_data to be long-
-	 * sized. This will work regardless of how long is defined (as long as
-	 * it's at least 32-bits).
-	 *
-	 * Note that we have a 32-bit format restriction; we have to interpret
-	 * each S31.32 fixed point number within the CTM in two parts: The
-	 * whole part (S31), and the fractional part (.32). They're then stored
-	 * (as separate parts) into a long-typed array. Of course, This problem
-	 * wouldn't exist if xserver accepted 64-bit formats.
-	 *
-	 * A gotcha here is the endianness of the S31.32 values. The whole part
-	 * will either come before or after the fractional part. (before in
-	 * big-endian format, and after in small-endian format). We could avoid
-	 * dealing with this by doing a straight memory copy, but we have to
-	 * ensure that each 32-bit element is padded to long-size in the
-	 * process.
-	 */
-	for (i = 0; i < 18; i++)
-		/* Think of this as a padded 'memcpy()'. */
-		padded_ctm[i] = ((uint32_t*)ctm.matrix)[i];
-
-	ret = set_output_blob(dpy, output, PROP_CTM, &padded_ctm,
-			      blob_size, FORMAT_32_BIT);
-
-	if (ret)
-		printf("Failed to set CTM. %d\n", ret);
+	struct _drm_color_lut lut[LUT_SIZE];
+	unsigned int error;
+	int i, size = 0, ret = 0;
+
+	for (i = 0; i < ntargets; i++)
+		ret |= set_gamma(dpy, targets[i].id, gamma->coeffs,
+				 gamma->is_srgb, is_degamma, max_error);
+
+	/* SRGB is stored as an empty blob, which restores as no blob */
+	if (!ret && journal_path) {
+		if (!gamma->is_srgb)
+			size = coeffs_to_lut(gamma->coeffs, lut, is_degamma ?
+					     0 : max_error, &error);
+		journal_outputs(dpy, targets, ntargets, is_degamma ?
+				PROP_DEGAMMA : PROP_GAMMA, lut,
+				size * sizeof(lut[0]), journal_path);
+	}
 	return ret;
 }
 
-/*******************************************************************************
- * main function, and functions to assist in parsing input.
- */
-
 /**
- * Parse user input, and fill the coefficients array with the requested CTM.
+ * Apply a CTM and gamma LUTs to outputs, or to all outputs of a monitor,
+ * through RandR.
  *
- * @ctm_opt: user input
- * @coeffs: Array of 9 doubles. The requested CTM will be filled in here.
+ * @dpy: The display
+ * @outputs: Comma separated output names, or NULL if monitor is given.
+ * @monitor: Monitor name, or NULL.
+ * @coeffs: Coefficients of the CTM to apply, or NULL.
+ * @gamma: Regamma and degamma LUTs, indexed by is_degamma, or NULL.
+ * @max_error: See set_gamma().
+ * @journal_path: Store what was applied in this journal, or NULL.
+ * @recorder_path: Dump the flight recorder there on failure, or NULL.
  *
- * Return: True if user has requested CTM change. False otherwise.
+ * Return: 0 on success, non-zero otherwise.
  */
-int parse_user_ctm(char *ctm_opt, double *coeffs)
+static int apply_outputs(Display *dpy, char *outputs, char *monitor,
+			 double *coeffs, struct gamma_lut *gamma,
+			 unsigned int max_error, const char *journal_path,
+			 const char *recorder_path)
 {
-	if (!ctm_opt)
-        return 0;
-
-    if (!strcmp(ctm_opt, "default")) {
-        printf("Using identity CTM\n");
-        double temp[9] = {
-            1, 0, 0,
-            0, 1, 0,
-            0, 0, 1
-        };
-        memcpy(coeffs, temp, sizeof(double) * 9);
-        return 1;
-    }
-
-    double value = strtod(ctm_opt, NULL);
-    if(!value) {
-        printf("%s is not a valid Saturation value. Skipping.\n",
-               ctm_opt);
-        return 0;
-    }
-
-
-    double s = (1.0 - value) / 3.0;
-    double temp[9] = {
-        s + value, s, s,
-        s, s + value, s,
-        s, s, s + value
-    };
-
-
-    printf("Using custom CTM:\n");
-    printf("    %2.4f:%2.4f:%2.4f\n", temp[0], temp[1], temp[2]);
-    printf("    %2.4f:%2.4f:%2.4f\n", temp[3], temp[4], temp[5]);
-    printf("    %2.4f:%2.4f:%2.4f\n", temp[6], temp[7], temp[8]);
+	struct output_target targets[MAX_OUTPUTS];
+	struct provider_group groups[MAX_PROVIDERS];
+	struct _drm_color_ctm ctm;
+	XRRScreenResources *res;
+	int i, ntargets, ngroups = 0, ret = 1;
+
+	res = XRRGetScreenResourcesCurrent(dpy, DefaultRootWindow(dpy));
+
+	/* RandR needs to know which outputs we're setting the property on.
+	 * Since we only have names to work with, find the RROutputs using the
+	 * names, then sort them by the GPU driving them. A monitor is resolved
+	 * to all of its outputs (tiles) at once. */
+	if (monitor)
+		ntargets = resolve_monitor(dpy, res, monitor, targets,
+					   MAX_OUTPUTS);
+	else
+		ntargets = resolve_outputs(dpy, res, outputs, targets,
+					   MAX_OUTPUTS);
+	if (ntargets <= 0)
+		goto done;
+	if (!monitor)
+		ngroups = group_by_provider(dpy, res, targets, ntargets,
+					    groups, MAX_PROVIDERS);
+
+	/* The LUTs come first, so that the CTM is the last to change. A
+	 * monitor has all of its tiles changed at once only for the CTM. */
+	ret = 0;
+	for (i = 1; gamma && i >= 0; i--)
+		if (gamma[i].set)
+			ret |= apply_gamma(dpy, targets, ntargets, &gamma[i], i,
+					   max_error, journal_path);
+	if (ret || !coeffs)
+		goto done;
 
+	/* Set the properties as parsed. The apply functions will also
+	 * translate the coefficients. */
+	if (monitor)
+		ret = apply_ctm_tiled(dpy, targets, ntargets, coeffs);
+	else
+		ret = apply_ctm_groups(dpy, groups, ngroups, coeffs);
+	if (ret) {
+		if (recorder_path)
+			recorder_dump(recorder_path);
+		goto done;
+	}
 
+	if (journal_path) {
+		coeffs_to_ctm(coeffs, &ctm);
+		journal_outputs(dpy, targets, ntargets, PROP_CTM, &ctm,
+				sizeof(ctm), journal_path);
+	}
 
-    memcpy(coeffs, temp, sizeof(double) * 9);
-    return 1;
+done:
+	XRRFreeScreenResources(res);
+	return ret;
 }
 
 /**
- * Parse user input, and fill the coefficients array with the requested LUT.
- * If predefined SRGB LUT is requested, the coefficients array is not touched,
- * and is_srgb is set to true. See set_gamma() for why.
+ * Split the request of this run into one request per output, to be handed
+ * over to the run in flight.
  *
- * @gamma_opt: User input
- * @coeffs: Array of color3d structs. The requested LUT will be filled in here.
- * @is_srgb: Will be set to true if user requested SRGB LUT.
- *
- * Return: True if user has requested gamma change. False otherwise.
+ * Return: Number of requests.
  */
-
-static char HELP_STR[] = { 
-	#include "help.xxd"
-};
-
-static void print_short_help()
+static int pending_requests(char *outputs, char *monitor, const char *value,
+			    const char *journal_path,
+			    struct pending_request *reqs)
 {
-	/* Just get first line, up to the first new line.*/
-	uint32_t len = strlen(HELP_STR);
-	char *short_help;
-
-	int i;
-	for (i = 0; i < len; i++) {
-		if (HELP_STR[i] == '\n')
-			break;
+	char buf[LINE_LEN];
+	char *name, *save;
+	int n = 0;
+
+	snprintf(buf, sizeof(buf), "%s", monitor ? monitor : outputs);
+	name = monitor ? buf : strtok_r(buf, ",", &save);
+	while (name && n < MAX_OUTPUTS) {
+		memset(&reqs[n], 0, sizeof(reqs[n]));
+		reqs[n].monitor = monitor != NULL;
+		snprintf(reqs[n].name, sizeof(reqs[n].name), "%s", name);
+		snprintf(reqs[n].value, sizeof(reqs[n].value), "%s", value);
+		snprintf(reqs[n].journal, sizeof(reqs[n].journal), "%s",
+			 journal_path ? journal_path : "");
+		n++;
+
+		name = monitor ? NULL : strtok_r(NULL, ",", &save);
 	}
-
-	short_help = malloc(sizeof(char) * i);
-	strncpy(short_help, HELP_STR, i);
-
-	printf("%s\n", short_help);
-	free(short_help);
+	return n;
 }
 
-static void print_version()
+/**
+ * Apply the requests handed over by other runs. Outputs sharing a value are
+ * applied together, so that they are still grouped by provider.
+ *
+ * Return: 0 on success, non-zero otherwise.
+ */
+static int apply_pending(Display *dpy, struct pending_request *reqs, int n,
+			 const char *recorder_path)
 {
-	printf("%s\n", VERSION_STRING);
+	char outputs[MAX_OUTPUTS * OUTPUT_NAME_LEN];
+	double coeffs[9];
+	int done[MAX_OUTPUTS] = { 0 };
+	int i, j, ret = 0;
+
+	for (i = 0; i < n; i++) {
+		if (done[i])
+			continue;
+		if (!parse_user_ctm(reqs[i].value, coeffs)) {
+			ret = 1;
+			continue;
+		}
+
+		snprintf(outputs, sizeof(outputs), "%s", reqs[i].name);
+		for (j = i + 1; j < n && !reqs[i].monitor; j++) {
+			if (done[j] || reqs[j].monitor ||
+			    strcmp(reqs[j].value, reqs[i].value) ||
+			    strcmp(reqs[j].journal, reqs[i].journal))
+				continue;
+			done[j] = 1;
+			strncat(outputs, ",", sizeof(outputs) -
+				strlen(outputs) - 1);
+			strncat(outputs, reqs[j].name, sizeof(outputs) -
+				strlen(outputs) - 1);
+		}
+
+		ret |= apply_outputs(dpy, reqs[i].monitor ? NULL : outputs,
+				     reqs[i].monitor ? reqs[i].name : NULL,
+				     coeffs, NULL, 0, reqs[i].journal[0] ?
+				     reqs[i].journal : NULL, recorder_path);
+	}
+	return ret;
 }
 
 
@@ -338,14 +294,19 @@ int main(int argc, char *const argv[])
 	 * driver expects when the request is sent to XRandR.
 	 */
 	double ctm_coeffs[9];
+	double video_coeffs[9];
+	static struct gamma_lut gamma[2];
 
+	uint64_t start_ns = now_ns();
 	int ret = 0;
 
 	/* Things needed by xrandr to change output properties */
 	Display *dpy;
-	Window root;
-	XRRScreenResources *res;
-	RROutput output;
+
+	/* Concurrent runs coalescing into the one in flight */
+	struct pending_request reqs[MAX_OUTPUTS];
+	struct coalesce coalesce;
+	int coalescing = 0, nreqs;
 
 
 	/*
@@ -353,19 +314,85 @@ int main(int argc, char *const argv[])
 	 */
 	int opt = -1;
 	char *ctm_opt = NULL;
+	char *video_opt = NULL;
+	char *gamma_opt[2] = { NULL, NULL };
+	unsigned int max_error = LUT_MAX_ERROR;
 	char *output_name = NULL;
+	char *monitor_name = NULL;
+	char *journal_path = NULL;
+	char *layer_name = NULL;
+	char *replay_spec = NULL;
+	int use_drm = 0;
+	int boot_restore = 0;
+	struct daemon_config daemon_cfg = { 0 };
+
+	int ctm_changed, video_changed = 0, gamma_changed = 0;
+	int i;
 
-	int ctm_changed;
-
-    while ((opt = getopt(argc, argv, "vho:c:")) != -1) {
+    while ((opt = getopt(argc, argv, "vho:m:c:V:g:G:E:DCj:BsS:L:Q:K:M:i:d:F:P:R:T:Y:XW:I:")) != -1) {
 		if (opt == 'v') {
 			print_version();
 			return 0;
 		}
 		else if (opt == 'c')
 			ctm_opt = optarg;
+		else if (opt == 'V')
+			video_opt = optarg;
+		else if (opt == 'g')
+			gamma_opt[0] = optarg;
+		else if (opt == 'G')
+			gamma_opt[1] = optarg;
+		else if (opt == 'E')
+			max_error = strtoul(optarg, NULL, 0);
 		else if (opt == 'o')
 			output_name = optarg;
+		else if (opt == 'm')
+			monitor_name = optarg;
+		else if (opt == 'D')
+			use_drm = 1;
+		else if (opt == 'C')
+			coalescing = 1;
+		else if (opt == 'j')
+			journal_path = optarg;
+		else if (opt == 'B')
+			boot_restore = 1;
+		else if (opt == 's')
+			daemon_cfg.stream = 1;
+		else if (opt == 'S')
+			daemon_cfg.socket_path = optarg;
+		else if (opt == 'L')
+			layer_name = optarg;
+		else if (opt == 'Q')
+			daemon_cfg.cue_path = optarg;
+		else if (opt == 'K')
+			daemon_cfg.hotkeys = optarg;
+		else if (opt == 'F')
+			daemon_cfg.recorder_path = optarg;
+		else if (opt == 'P')
+			return recorder_decode(optarg);
+		else if (opt == 'T')
+			daemon_cfg.trace_path = optarg;
+		else if (opt == 'Y')
+			replay_spec = optarg;
+		else if (opt == 'X')
+			display_set_mock(1);
+		else if (opt == 'W')
+			daemon_cfg.warm_path = optarg;
+		else if (opt == 'I')
+			daemon_cfg.idle_s = atoi(optarg);
+		else if (opt == 'R') {
+			if (!rt_parse(optarg, &daemon_cfg.rt)) {
+				printf("%s is not a valid real-time setting.\n",
+				       optarg);
+				return 1;
+			}
+		}
+		else if (opt == 'd')
+			daemon_cfg.display = optarg;
+		else if (opt == 'M')
+			daemon_cfg.metrics_path = optarg;
+		else if (opt == 'i')
+			daemon_cfg.metrics_interval = atoi(optarg);
 		else if (opt == 'h') {
 			printf("%s", HELP_STR);
 			return 0;
@@ -376,24 +403,85 @@ int main(int argc, char *const argv[])
 		}
 	}
 
-	/* Check that output is given */
-	if (!output_name) {
+	/* Dump the flight recorder there on error */
+	recorder_set_path(daemon_cfg.recorder_path);
+
+	/* Early boot restore replays the journal as-is, nothing to parse */
+	if (boot_restore)
+		return drm_restore_journal(journal_path ? journal_path :
+					   JOURNAL_PATH, start_ns);
+
+	/* Hand a layer over to the composing service */
+	if (layer_name) {
+		if (!daemon_cfg.socket_path || !ctm_opt) {
+			print_short_help();
+			return 1;
+		}
+		return send_layer_request(daemon_cfg.socket_path, layer_name,
+					  output_name, ctm_opt);
+	}
+
+	/* Replays drive their own displays */
+	if (replay_spec)
+		return trace_replay(replay_spec, daemon_cfg.display);
+
+	/* Long-running modes take their requests from their inputs */
+	if (daemon_cfg.stream || daemon_cfg.socket_path ||
+	    daemon_cfg.cue_path || daemon_cfg.hotkeys) {
+		daemon_cfg.outputs = output_name;
+		return daemon_run(&daemon_cfg);
+	}
+
+	/* Check that either outputs or a monitor is given. Planes can only be
+	 * programmed through DRM. */
+	if (!output_name == !monitor_name || (use_drm && monitor_name) ||
+	    (video_opt && !use_drm) || (coalescing && use_drm) ||
+	    ((gamma_opt[0] || gamma_opt[1]) && (use_drm || coalescing))) {
 		print_short_help();
 		return 1;
 	}
 
 	/* Parse the input, and generate the intermediate coefficient arrays */
 	ctm_changed = parse_user_ctm(ctm_opt, ctm_coeffs);
+	if (video_opt) {
+		printf("Video plane:\n");
+		video_changed = parse_user_ctm(video_opt, video_coeffs);
+	}
+	for (i = 0; i < 2; i++) {
+		gamma[i].set = parse_user_gamma(gamma_opt[i], gamma[i].coeffs,
+						&gamma[i].is_srgb);
+		gamma_changed |= gamma[i].set;
+	}
 
 
 	/* Print help if input is not as expected */
-    if (!ctm_changed) {
+    if ((!ctm_changed && !video_changed && !gamma_changed) ||
+	(ctm_opt && !ctm_changed) || (video_opt && !video_changed) ||
+	(gamma_opt[0] && !gamma[0].set) || (gamma_opt[1] && !gamma[1].set)) {
 		print_short_help();
 		return 1;
 	}
 
-	/* Open the default X display and window, then obtain the RandR screen
-	 * resource. Note that the DISPLAY environment variable must exist. */
+	/* Bypass the X server entirely, and program the CRTCs through DRM */
+	if (use_drm) {
+		ret = drm_apply_ctm(output_name,
+				    ctm_changed ? ctm_coeffs : NULL,
+				    video_changed ? video_coeffs : NULL,
+				    journal_path);
+		goto metrics;
+	}
+
+	/* With -C, leave the request to a run already in flight, if any */
+	coalesce.lock_fd = coalesce.slot_fd = -1;
+	if (coalescing) {
+		nreqs = pending_requests(output_name, monitor_name, ctm_opt,
+					 journal_path, reqs);
+		if (coalesce_begin(&coalesce, NULL, reqs, nreqs) == 1)
+			return 0;
+	}
+
+	/* Open the default X display. Note that the DISPLAY environment
+	 * variable must exist. */
 	dpy = XOpenDisplay(NULL);
 	if (!dpy) {
 		printf("No display specified, check the DISPLAY environment "
@@ -401,31 +489,22 @@ int main(int argc, char *const argv[])
 		return 1;
 	}
 
-	root = DefaultRootWindow(dpy);
-	res = XRRGetScreenResourcesCurrent(dpy, root);
-
-	/* RandR needs to know which output we're setting the property on.
-	 * Since we only have a name to work with, find the RROutput using the
-	 * name. */
-	output = find_output_by_name(dpy, res, output_name);
-	if (!output) {
-		printf("Cannot find output %s.\n", output_name);
-		ret = 1;
-		goto done;
-	}
+	ret = apply_outputs(dpy, output_name, monitor_name,
+			    ctm_changed ? ctm_coeffs : NULL, gamma, max_error,
+			    journal_path, daemon_cfg.recorder_path);
 
-	/* Set the properties as parsed. The set_* functions will also
-	 * translate the coefficients. */
-	if (ctm_changed) {
-        ret = set_ctm(dpy, output, ctm_coeffs);
-		if (ret)
-			goto done;
-	}
+	/* Then the newest requests handed over in the meantime. The outputs
+	 * are looked up again, as they may have been plugged since. */
+	while ((nreqs = coalesce_next(&coalesce, reqs)))
+		ret |= apply_pending(dpy, reqs, nreqs,
+				     daemon_cfg.recorder_path);
 
-done:
 	/* Ensure proper cleanup */
-	XRRFreeScreenResources(res);
 	XCloseDisplay(dpy);
 
+metrics:
+	/* One-shot runs keep a local log of their metrics */
+	if (daemon_cfg.metrics_path)
+		metrics_append(daemon_cfg.metrics_path);
 	return ret;
 }
@@ -0,0 +1,438 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xsatmgr.h"
+
+/*******************************************************************************
+ * Apply metrics, in the Prometheus text format
+ *
+ * The apply path only bumps counters in memory. Long-running modes hand a
+ * copy to a writer thread at a fixed interval, which renders it and replaces
+ * the textfile (for the node_exporter textfile collector) atomically. The
+ * hand-off never waits: if the writer is still busy with the previous copy,
+ * this interval is skipped. One-shot runs append their samples to a local
+ * file instead, with timestamps.
+ */
+
+/* Upper bounds of the latency buckets; the last one is +Inf */
+static const uint64_t bucket_ns[METRIC_BUCKETS - 1] = {
+	50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+	25000000, 50000000, 100000000,
+};
+
+static const char *const phase_names[NUM_PHASES] = {
+	[PHASE_WRITE] = "write",
+	[PHASE_SYNC] = "sync",
+	[PHASE_COMMIT] = "commit",
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} counter_info[NUM_COUNTERS] = {
+	[METRIC_APPLIES] = { "xsatmgr_applies_total",
+			     "CTM writes sent to the output." },
+	[METRIC_FAILURES] = { "xsatmgr_apply_failures_total",
+			      "CTM writes that failed, e.g. with BadName." },
+	[METRIC_REASSERTS] = { "xsatmgr_reasserts_total",
+			       "Held back CTMs written when the output woke "
+			       "up." },
+};
+
+/* Updated by the apply path only */
+static struct metrics live;
+
+/* Handed to the writer thread */
+static struct metrics snapshot;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshot_cond = PTHREAD_COND_INITIALIZER;
+static int snapshot_dirty, stopping, started;
+static pthread_t writer;
+static const char *textfile_path;
+
+/**
+ * Get the metrics slot of an output, adding it if needed.
+ *
+ * Return: Slot to pass to metrics_count() and metrics_observe(), or -1 if
+ *         all slots are taken.
+ */
+int metrics_output(const char *name)
+{
+	int i;
+
+	for (i = 0; i < live.noutputs; i++)
+		if (!strcmp(live.outputs[i].name, name))
+			return i;
+
+	if (live.noutputs == MAX_OUTPUTS)
+		return -1;
+
+	snprintf(live.outputs[i].name, sizeof(live.outputs[i].name), "%s",
+		 name);
+	return live.noutputs++;
+}
+
+void metrics_count(int id, enum metric_counter counter)
+{
+	if (id >= 0)
+		live.outputs[id].counters[counter]++;
+}
+
+static int metrics_bucket(uint64_t ns)
+{
+	int i;
+
+	for (i = 0; i < METRIC_BUCKETS - 1 && ns > bucket_ns[i]; i++)
+		;
+	return i;
+}
+
+void metrics_observe(int id, enum metric_phase phase, uint64_t ns)
+{
+	if (id < 0)
+		return;
+
+	live.outputs[id].buckets[phase][metrics_bucket(ns)]++;
+	live.outputs[id].sum_ns[phase] += ns;
+}
+
+/**
+ * Record how late a frame-scheduled write was sent.
+ *
+ * @ns: Time from the target frame to the write.
+ * @missed: True if the write slipped past its frame.
+ */
+void metrics_lateness(uint64_t ns, int missed)
+{
+	live.lateness_buckets[metrics_bucket(ns)]++;
+	live.lateness_sum_ns += ns;
+	live.deadline_misses += !!missed;
+}
+
+/* The live metrics, for the status request. */
+const struct metrics *metrics_get(void)
+{
+	return &live;
+}
+
+/**
+ * Get the upper bound of a latency bucket.
+ *
+ * Return: 1 if the bucket is bounded, 0 for the last (+Inf) one.
+ */
+int metrics_bucket_bound(int bucket, uint64_t *ns)
+{
+	if (bucket >= METRIC_BUCKETS - 1)
+		return 0;
+	*ns = bucket_ns[bucket];
+	return 1;
+}
+
+/*
+ * Text rendering, into a static buffer so that the writer does not allocate
+ * either.
+ */
+struct text {
+	char buf[256 * 1024];
+	size_t len;
+};
+
+static void emit(struct text *t, const char *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	if (t->len >= sizeof(t->buf) - 1)
+		return;
+
+	va_start(args, fmt);
+	n = vsnprintf(t->buf + t->len, sizeof(t->buf) - t->len, fmt, args);
+	va_end(args);
+
+	if (n > 0)
+		t->len += n;
+	if (t->len >= sizeof(t->buf))
+		t->len = sizeof(t->buf) - 1;
+}
+
+/**
+ * Render metrics as Prometheus text.
+ *
+ * @t: Buffer to render into.
+ * @m: The metrics
+ * @ts: Timestamp to append to every sample, or "" for none. Comments are
+ *      only rendered without timestamps.
+ */
+static void metrics_render(struct text *t, const struct metrics *m,
+			   const char *ts)
+{
+	const struct output_metrics *om;
+	unsigned long count;
+	int c, p, i, j;
+
+	t->len = 0;
+
+	for (c = 0; c < NUM_COUNTERS; c++) {
+		if (!*ts)
+			emit(t, "# HELP %s %s\n# TYPE %s counter\n",
+			     counter_info[c].name, counter_info[c].help,
+			     counter_info[c].name);
+		for (i = 0; i < m->noutputs; i++)
+			emit(t, "%s{output=\"%s\"} %lu%s\n",
+			     counter_info[c].name, m->outputs[i].name,
+			     m->outputs[i].counters[c], ts);
+	}
+
+	if (!*ts)
+		emit(t, "# HELP xsatmgr_apply_duration_seconds Time taken by "
+		     "each phase of an apply.\n"
+		     "# TYPE xsatmgr_apply_duration_seconds histogram\n");
+	for (i = 0; i < m->noutputs; i++) {
+		om = &m->outputs[i];
+		for (p = 0; p < NUM_PHASES; p++) {
+			/* Only the phases this output went through */
+			for (j = 0, count = 0; j < METRIC_BUCKETS; j++)
+				count += om->buckets[p][j];
+			if (!count)
+				continue;
+
+			for (j = 0, count = 0; j < METRIC_BUCKETS; j++) {
+				count += om->buckets[p][j];
+				if (j < METRIC_BUCKETS - 1)
+					emit(t, "xsatmgr_apply_duration_seconds"
+					     "_bucket{output=\"%s\",phase=\"%s\""
+					     ",le=\"%g\"} %lu%s\n", om->name,
+					     phase_names[p], bucket_ns[j] / 1e9,
+					     count, ts);
+				else
+					emit(t, "xsatmgr_apply_duration_seconds"
+					     "_bucket{output=\"%s\",phase=\"%s\""
+					     ",le=\"+Inf\"} %lu%s\n", om->name,
+					     phase_names[p], count, ts);
+			}
+			emit(t, "xsatmgr_apply_duration_seconds_sum{output="
+			     "\"%s\",phase=\"%s\"} %.9f%s\n", om->name,
+			     phase_names[p], om->sum_ns[p] / 1e9, ts);
+			emit(t, "xsatmgr_apply_duration_seconds_count{output="
+			     "\"%s\",phase=\"%s\"} %lu%s\n", om->name,
+			     phase_names[p], count, ts);
+		}
+	}
+
+	for (j = 0, count = 0; j < METRIC_BUCKETS; j++)
+		count += m->lateness_buckets[j];
+	if (count) {
+		if (!*ts)
+			emit(t, "# HELP xsatmgr_write_lateness_seconds Time "
+			     "from the target frame of a scheduled write to "
+			     "the write.\n"
+			     "# TYPE xsatmgr_write_lateness_seconds "
+			     "histogram\n");
+		for (j = 0, count = 0; j < METRIC_BUCKETS; j++) {
+			count += m->lateness_buckets[j];
+			if (j < METRIC_BUCKETS - 1)
+				emit(t, "xsatmgr_write_lateness_seconds_bucket"
+				     "{le=\"%g\"} %lu%s\n", bucket_ns[j] / 1e9,
+				     count, ts);
+			else
+				emit(t, "xsatmgr_write_lateness_seconds_bucket"
+				     "{le=\"+Inf\"} %lu%s\n", count, ts);
+		}
+		emit(t, "xsatmgr_write_lateness_seconds_sum %.9f%s\n",
+		     m->lateness_sum_ns / 1e9, ts);
+		emit(t, "xsatmgr_write_lateness_seconds_count %lu%s\n", count,
+		     ts);
+
+		if (!*ts)
+			emit(t, "# HELP xsatmgr_deadline_misses_total "
+			     "Scheduled writes that slipped past their "
+			     "frame.\n"
+			     "# TYPE xsatmgr_deadline_misses_total counter\n");
+		emit(t, "xsatmgr_deadline_misses_total %lu%s\n",
+		     m->deadline_misses, ts);
+	}
+
+	if (!*ts)
+		emit(t, "# HELP xsatmgr_x_errors_total X errors received.\n"
+		     "# TYPE xsatmgr_x_errors_total counter\n");
+	emit(t, "xsatmgr_x_errors_total %lu%s\n", m->x_errors, ts);
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Replace the textfile, so that the collector never sees a partial one. */
+static void metrics_write_textfile(const struct text *t)
+{
+	char tmp_path[PATH_LEN];
+	int fd;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", textfile_path);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+
+	if (write_all(fd, t->buf, t->len) || fsync(fd)) {
+		close(fd);
+		unlink(tmp_path);
+		return;
+	}
+	close(fd);
+
+	if (rename(tmp_path, textfile_path))
+		unlink(tmp_path);
+}
+
+static void *metrics_writer(void *arg)
+{
+	static struct metrics m;
+	static struct text t;
+
+	pthread_mutex_lock(&snapshot_lock);
+	while (snapshot_dirty || !stopping) {
+		if (!snapshot_dirty) {
+			pthread_cond_wait(&snapshot_cond, &snapshot_lock);
+			continue;
+		}
+
+		memcpy(&m, &snapshot, sizeof(m));
+		snapshot_dirty = 0;
+		pthread_mutex_unlock(&snapshot_lock);
+
+		metrics_render(&t, &m, "");
+		metrics_write_textfile(&t);
+
+		pthread_mutex_lock(&snapshot_lock);
+	}
+	pthread_mutex_unlock(&snapshot_lock);
+	return NULL;
+}
+
+/**
+ * Start the textfile writer of the long-running modes. The textfile is
+ * written on every metrics_publish().
+ *
+ * @path: Textfile to write, e.g.
+ *        /var/lib/node_exporter/textfile_collector/xsatmgr.prom
+ *
+ * Return: 0 on success, non-zero otherwise.
+ */
+int metrics_start(const char *path)
+{
+	int ret;
+
+	textfile_path = path;
+	ret = thread_start(&writer, metrics_writer, NULL);
+	if (ret) {
+		printf("Cannot start metrics writer. %s\n", strerror(ret));
+		return 1;
+	}
+	started = 1;
+	return 0;
+}
+
+/* Hand the current metrics to the writer, unless it is still busy. */
+void metrics_publish(void)
+{
+	if (!started || pthread_mutex_trylock(&snapshot_lock))
+		return;
+
+	memcpy(&snapshot, &live, sizeof(snapshot));
+	snapshot.x_errors = display_errors();
+	snapshot_dirty = 1;
+	pthread_cond_signal(&snapshot_cond);
+	pthread_mutex_unlock(&snapshot_lock);
+}
+
+/* Write the final metrics, and stop the writer. */
+void metrics_stop(void)
+{
+	if (!started)
+		return;
+
+	pthread_mutex_lock(&snapshot_lock);
+	memcpy(&snapshot, &live, sizeof(snapshot));
+	snapshot.x_errors = display_errors();
+	snapshot_dirty = 1;
+	stopping = 1;
+	pthread_cond_signal(&snapshot_cond);
+	pthread_mutex_unlock(&snapshot_lock);
+
+	pthread_join(writer, NULL);
+	started = 0;
+}
+
+/**
+ * Append the metrics of a one-shot run to a local file, timestamped.
+ *
+ * Return: 0 on success, non-zero otherwise.
+ */
+int metrics_append(const char *path)
+{
+	static struct text t;
+	struct timespec now;
+	char ts[32];
+	int fd, ret;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	snprintf(ts, sizeof(ts), " %lld",
+		 (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+
+	live.x_errors = display_errors();
+	metrics_render(&t, &live, ts);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		printf("Cannot open %s. %s\n", path, strerror(errno));
+		return 1;
+	}
+	ret = write_all(fd, t.buf, t.len);
+	close(fd);
+	return ret ? 1 : 0;
+}
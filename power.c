@@ -0,0 +1,205 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <X11/Xlibint.h>
+#include <X11/extensions/dpms.h>
+#include <X11/extensions/dpmsproto.h>
+#include <X11/extensions/scrnsaver.h>
+
+#include "xsatmgr.h"
+
+/*******************************************************************************
+ * Power state tracking
+ *
+ * Writing the CTM of a powered down output still costs a DDX and kernel
+ * commit, and may even wake the link. The long-running modes track DPMS and
+ * the screensaver, so that color writes can be held back while the screens
+ * sleep, and applied in one batch when they wake up.
+ */
+
+/*
+ * DPMSSelectInput() only exists in recent libXext, so send the DPMS 1.2
+ * SelectInput request ourselves. The InfoNotify events come back as generic
+ * events, which Xlib cannot decode by itself, see dpms_wire_to_cookie().
+ */
+static void dpms_select_input(Display *dpy, int opcode, CARD32 mask)
+{
+	xDPMSSelectInputReq *req;
+
+	LockDisplay(dpy);
+	GetReq(DPMSSelectInput, req);
+	req->reqType = opcode;
+	req->dpmsReqType = X_DPMSSelectInput;
+	req->eventMask = mask;
+	UnlockDisplay(dpy);
+	SyncHandle();
+}
+
+/* What an InfoNotify event says, kept as the data of its cookie */
+struct dpms_info {
+	CARD16 power_level;
+	BOOL enabled;
+};
+
+/*
+ * Decode DPMS InfoNotify events, which carry the new power level. This way
+ * a wake-up is acted on straight from the event, without asking the server
+ * for the level again.
+ */
+static Bool dpms_wire_to_cookie(Display *dpy, XGenericEventCookie *cookie,
+				xEvent *wire)
+{
+	const xDPMSInfoNotifyEvent *ev = (const xDPMSInfoNotifyEvent *)wire;
+	struct dpms_info *info;
+
+	cookie->type = ev->type & 0x7f;
+	cookie->serial = _XSetLastRequestRead(dpy, (xGenericReply *)wire);
+	cookie->send_event = (ev->type & 0x80) != 0;
+	cookie->display = dpy;
+	cookie->extension = ev->extension;
+	cookie->evtype = ev->evtype;
+	cookie->data = NULL;
+
+	if (ev->evtype != DPMSInfoNotify)
+		return True;
+
+	/* Power events are not the apply path, see allocwatch.c */
+	heap_ignore_begin();
+	info = malloc(sizeof(*info));
+	heap_ignore_end();
+	if (info) {
+		info->power_level = ev->power_level;
+		info->enabled = ev->state;
+	}
+	cookie->data = info;
+	return True;
+}
+
+/* Query the current DPMS power level. */
+static void dpms_update(struct display_state *ds)
+{
+	CARD16 level = DPMSModeOn;
+	BOOL enabled = 0;
+
+	if (ds->dpms_opcode && DPMSInfo(ds->dpy, &level, &enabled))
+		ds->dpms_off = enabled && level != DPMSModeOn;
+}
+
+/**
+ * Set up DPMS and screensaver tracking, and read the initial state.
+ * Missing extensions are not an error: the screens are then assumed to be
+ * always on.
+ */
+void power_init(struct display_state *ds)
+{
+	XScreenSaverInfo *info;
+	int event, error, major = 0, minor = 0;
+
+	if (XQueryExtension(ds->dpy, DPMSExtensionName, &ds->dpms_opcode,
+			    &event, &error) &&
+	    DPMSGetVersion(ds->dpy, &major, &minor)) {
+		/* InfoNotify events are new in DPMS 1.2 */
+		if (major > 1 || (major == 1 && minor >= 2)) {
+			XESetWireToEventCookie(ds->dpy, ds->dpms_opcode,
+					       dpms_wire_to_cookie);
+			dpms_select_input(ds->dpy, ds->dpms_opcode,
+					  DPMSInfoNotifyMask);
+			ds->dpms_events = 1;
+		}
+		dpms_update(ds);
+	} else {
+		ds->dpms_opcode = 0;
+	}
+
+	if (XScreenSaverQueryExtension(ds->dpy, &ds->saver_event_base,
+				       &error)) {
+		XScreenSaverSelectInput(ds->dpy, ds->root,
+					ScreenSaverNotifyMask);
+		info = XScreenSaverAllocInfo();
+		if (info && XScreenSaverQueryInfo(ds->dpy, ds->root, info))
+			ds->saver_on = info->state == ScreenSaverOn;
+		if (info)
+			XFree(info);
+		ds->saver_events = 1;
+	}
+}
+
+/**
+ * Update the power state from an X event.
+ *
+ * Return: True if the event was a power state event.
+ */
+int power_handle_event(struct display_state *ds, XEvent *ev)
+{
+	XScreenSaverNotifyEvent *sev;
+	const struct dpms_info *info;
+
+	if (ds->dpms_events && ev->type == GenericEvent &&
+	    ev->xcookie.extension == ds->dpms_opcode) {
+		if (ev->xcookie.evtype == DPMSInfoNotify &&
+		    XGetEventData(ds->dpy, &ev->xcookie)) {
+			info = ev->xcookie.data;
+			if (info)
+				ds->dpms_off = info->enabled &&
+					       info->power_level != DPMSModeOn;
+			XFreeEventData(ds->dpy, &ev->xcookie);
+		}
+		return 1;
+	}
+
+	if (ds->saver_events &&
+	    ev->type == ds->saver_event_base + ScreenSaverNotify) {
+		sev = (XScreenSaverNotifyEvent *)ev;
+		ds->saver_on = sev->state == ScreenSaverOn;
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Query the DPMS state, for servers that cannot send DPMS events. This waits
+ * for the server, so it runs on the worker of the display, on its query
+ * connection, see display_request().
+ *
+ * Return: 1 if the screens are powered down, 0 if they are on, or -1 if the
+ *         state cannot be read.
+ */
+int power_query(Display *dpy)
+{
+	CARD16 level = DPMSModeOn;
+	BOOL enabled = 0;
+	int event, error;
+
+	if (!DPMSQueryExtension(dpy, &event, &error) ||
+	    !DPMSInfo(dpy, &level, &enabled))
+		return -1;
+	return enabled && level != DPMSModeOn;
+}
@@ -0,0 +1,270 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xsatmgr.h"
+
+/*******************************************************************************
+ * Flight recorder
+ *
+ * The last RECORDER_SIZE applies are kept in memory as fixed-size binary
+ * records, so that a color glitch can be looked into after the fact without
+ * running with verbose logging. Recording is a slot claim and a copy into a
+ * static ring: no locks, no allocations, no syscalls. The ring is dumped to
+ * a file on request (SIGUSR1 in the long-running modes) or on error, and
+ * decoded with -P.
+ */
+
+#define RECORDER_MAGIC 0x52465358	/* "XSFR" */
+#define RECORDER_VERSION 1
+
+/* Dump on error at most this often, errors tend to come in bursts */
+#define RECORDER_ERROR_DUMP_NS 1000000000ull
+
+struct recorder_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t nrecords;
+};
+
+static struct flight_record ring[RECORDER_SIZE];
+static uint64_t head;
+static const char *dump_path;
+static uint64_t last_error_dump;
+
+/*
+ * Claim the next slot. Its sequence number stays 0 while it is written, so
+ * that a concurrent dump can tell a torn record.
+ */
+static struct flight_record *recorder_claim(uint64_t *seq)
+{
+	struct flight_record *rec;
+
+	*seq = __atomic_add_fetch(&head, 1, __ATOMIC_RELAXED);
+	rec = &ring[(*seq - 1) & (RECORDER_SIZE - 1)];
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return rec;
+}
+
+static void recorder_commit(struct flight_record *rec, uint64_t seq)
+{
+	__atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+}
+
+/**
+ * Record a CTM write.
+ *
+ * @output: Output name
+ * @serial: X request serial of the write, or 0.
+ * @old_ctm: Packed CTM the output had, or NULL if unknown.
+ * @new_ctm: Packed CTM written.
+ * @result: Success, or the error the write failed with.
+ */
+void recorder_apply(const char *output, unsigned long serial,
+		    const long *old_ctm, const long *new_ctm, int result)
+{
+	struct flight_record *rec;
+	struct _drm_color_ctm ctm;
+	uint64_t seq;
+
+	rec = recorder_claim(&seq);
+	rec->time_ns = now_ns();
+	rec->serial = serial;
+	rec->result = result;
+	rec->flags = old_ctm ? FLIGHT_OLD_VALID : 0;
+	strncpy(rec->output, output, sizeof(rec->output) - 1);
+	rec->output[sizeof(rec->output) - 1] = '\0';
+	if (old_ctm) {
+		unpack_ctm(old_ctm, &ctm);
+		memcpy(rec->old_ctm, ctm.matrix, sizeof(rec->old_ctm));
+	}
+	unpack_ctm(new_ctm, &ctm);
+	memcpy(rec->new_ctm, ctm.matrix, sizeof(rec->new_ctm));
+	recorder_commit(rec, seq);
+}
+
+/**
+ * Record an X error reported for an earlier write, and dump the ring if a
+ * dump path is set.
+ *
+ * @output: Output name
+ * @serial: X request serial of the failed write.
+ * @error: X error code
+ */
+void recorder_error(const char *output, unsigned long serial, int error)
+{
+	struct flight_record *rec;
+	uint64_t seq, now = now_ns();
+
+	rec = recorder_claim(&seq);
+	rec->time_ns = now;
+	rec->serial = serial;
+	rec->result = error;
+	rec->flags = FLIGHT_ERROR;
+	strncpy(rec->output, output, sizeof(rec->output) - 1);
+	rec->output[sizeof(rec->output) - 1] = '\0';
+	recorder_commit(rec, seq);
+
+	if (dump_path && (!last_error_dump ||
+			  now - last_error_dump > RECORDER_ERROR_DUMP_NS)) {
+		last_error_dump = now;
+		recorder_dump(dump_path);
+	}
+}
+
+/* Where recorder_error() dumps the ring, NULL to not dump on error. */
+void recorder_set_path(const char *path)
+{
+	dump_path = path;
+}
+
+/**
+ * Dump the ring to a file, oldest record first. Records being written while
+ * dumping are left out.
+ *
+ * Return: Number of records dumped, or -1 on failure.
+ */
+int recorder_dump(const char *path)
+{
+	static struct flight_record copy[RECORDER_SIZE];
+	struct recorder_header hdr;
+	uint64_t end, seq, i;
+	int fd, n = 0;
+
+	end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	for (i = end > RECORDER_SIZE ? end - RECORDER_SIZE : 0; i < end; i++) {
+		const struct flight_record *rec =
+			&ring[i & (RECORDER_SIZE - 1)];
+
+		seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		memcpy(&copy[n], rec, sizeof(copy[n]));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (seq != i + 1 ||
+		    __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		n++;
+	}
+
+	hdr.magic = RECORDER_MAGIC;
+	hdr.version = RECORDER_VERSION;
+	hdr.record_size = sizeof(struct flight_record);
+	hdr.nrecords = n;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		printf("Cannot open %s. %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, copy, n * sizeof(copy[0])) !=
+	    (ssize_t)(n * sizeof(copy[0]))) {
+		printf("Cannot write %s. %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	printf("Dumped %d apply record(s) to %s\n", n, path);
+	return n;
+}
+
+static void print_matrix(const char *label, const uint64_t *matrix)
+{
+	struct _drm_color_ctm ctm;
+	double coeffs[9];
+
+	memcpy(ctm.matrix, matrix, sizeof(ctm.matrix));
+	ctm_to_coeffs(&ctm, coeffs);
+
+	printf("  %s %2.4f:%2.4f:%2.4f\n", label,
+	       coeffs[0], coeffs[1], coeffs[2]);
+	printf("      %2.4f:%2.4f:%2.4f\n", coeffs[3], coeffs[4], coeffs[5]);
+	printf("      %2.4f:%2.4f:%2.4f\n", coeffs[6], coeffs[7], coeffs[8]);
+}
+
+/**
+ * Print a dump made by recorder_dump(). Times are relative to the first
+ * record.
+ *
+ * Return: 0 on success, non-zero otherwise.
+ */
+int recorder_decode(const char *path)
+{
+	struct recorder_header hdr;
+	struct flight_record rec;
+	uint64_t start = 0;
+	uint32_t i;
+	FILE *f;
+
+	f = fopen(path, "re");
+	if (!f) {
+		printf("Cannot open %s. %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    hdr.magic != RECORDER_MAGIC || hdr.version != RECORDER_VERSION ||
+	    hdr.record_size != sizeof(rec)) {
+		printf("%s is not a flight recorder dump.\n", path);
+		fclose(f);
+		return 1;
+	}
+
+	for (i = 0; i < hdr.nrecords && fread(&rec, sizeof(rec), 1, f); i++) {
+		if (!i)
+			start = rec.time_ns;
+
+		if (rec.flags & FLIGHT_ERROR) {
+			printf("%12.3f ms %s serial %llu: X error %d\n",
+			       (rec.time_ns - start) / 1e6, rec.output,
+			       (unsigned long long)rec.serial, rec.result);
+			continue;
+		}
+
+		if (rec.result)
+			printf("%12.3f ms %s serial %llu: failed, %d\n",
+			       (rec.time_ns - start) / 1e6, rec.output,
+			       (unsigned long long)rec.serial, rec.result);
+		else
+			printf("%12.3f ms %s serial %llu: applied\n",
+			       (rec.time_ns - start) / 1e6, rec.output,
+			       (unsigned long long)rec.serial);
+		if (rec.flags & FLIGHT_OLD_VALID)
+			print_matrix("old", rec.old_ctm);
+		print_matrix("new", rec.new_ctm);
+	}
+
+	fclose(f);
+	return 0;
+}
@@ -0,0 +1,243 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "xsatmgr.h"
+
+/*******************************************************************************
+ * Real-time apply thread
+ *
+ * Fades and cues are written on frame boundaries. A page fault or a wake-up
+ * delay at the wrong moment pushes a write into the next frame, so the
+ * long-running modes can run their event loop on a dedicated thread with
+ * all memory locked and its stack pre-faulted, optionally with a real-time
+ * scheduling policy and pinned to a CPU.
+ */
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+/* Stack of the apply thread, faulted in before the loop starts */
+#define RT_STACK_SIZE (512 * 1024)
+#define RT_PREFAULT_SIZE (256 * 1024)
+
+/* Not in all C libraries yet, see sched_setattr(2) */
+struct rt_sched_attr {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+};
+
+struct rt_thread {
+	const struct rt_config *rt;
+	uint64_t period_ns;
+	void *(*fn)(void *);
+	void *arg;
+	int ret;
+};
+
+/**
+ * Parse a real-time spec: <policy>[:<priority>][@<cpu>], where policy is
+ * one of other, fifo or deadline. E.g. "fifo:50@3". Only fifo takes a
+ * priority. deadline cannot be pinned: the kernel refuses SCHED_DEADLINE
+ * to threads whose affinity is narrower than their root domain, so a
+ * deadline thread is confined to CPUs with an exclusive cpuset instead.
+ *
+ * Return: True if the spec is valid. False otherwise.
+ */
+int rt_parse(const char *spec, struct rt_config *rt)
+{
+	char buf[64];
+	char *prio, *cpu, *end;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	memset(rt, 0, sizeof(*rt));
+	rt->enabled = 1;
+	rt->cpu = -1;
+
+	cpu = strchr(buf, '@');
+	if (cpu) {
+		*cpu++ = '\0';
+		rt->cpu = strtol(cpu, &end, 10);
+		if (*end || end == cpu || rt->cpu < 0)
+			return 0;
+	}
+
+	prio = strchr(buf, ':');
+	if (prio) {
+		*prio++ = '\0';
+		rt->priority = strtol(prio, &end, 10);
+		if (*end || end == prio)
+			return 0;
+	}
+
+	if (!strcmp(buf, "other")) {
+		rt->policy = SCHED_OTHER;
+	} else if (!strcmp(buf, "fifo")) {
+		rt->policy = SCHED_FIFO;
+		if (!prio)
+			rt->priority = 50;
+	} else if (!strcmp(buf, "deadline")) {
+		rt->policy = SCHED_DEADLINE;
+		if (cpu)
+			return 0;
+	} else {
+		return 0;
+	}
+
+	if (prio && rt->policy != SCHED_FIFO)
+		return 0;
+
+	return rt->policy != SCHED_FIFO ||
+	       (rt->priority >= sched_get_priority_min(SCHED_FIFO) &&
+		rt->priority <= sched_get_priority_max(SCHED_FIFO));
+}
+
+/* Apply the affinity and scheduling policy to the calling thread. */
+static int rt_setup(const struct rt_config *rt, uint64_t period_ns)
+{
+	struct rt_sched_attr attr;
+	struct sched_param param;
+	cpu_set_t cpus;
+	int ret;
+
+	if (rt->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(rt->cpu, &cpus);
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus),
+					     &cpus);
+		if (ret) {
+			printf("Cannot pin the apply thread to CPU %d. %s\n",
+			       rt->cpu, strerror(ret));
+			return 1;
+		}
+	}
+
+	if (rt->policy == SCHED_FIFO) {
+		param.sched_priority = rt->priority;
+		ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (ret) {
+			printf("Cannot use SCHED_FIFO. %s\n", strerror(ret));
+			return 1;
+		}
+	} else if (rt->policy == SCHED_DEADLINE) {
+		/* Every frame, a quarter of it to process events and write */
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.sched_policy = SCHED_DEADLINE;
+		attr.sched_period = period_ns;
+		attr.sched_deadline = period_ns;
+		attr.sched_runtime = period_ns / 4;
+		if (syscall(SYS_sched_setattr, 0, &attr, 0)) {
+			printf("Cannot use SCHED_DEADLINE. %s\n",
+			       strerror(errno));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Fault the stack in now, rather than on the first deep call. This returns
+ * before the loop runs, so that the loop gets the faulted in pages.
+ */
+static __attribute__((noinline)) void rt_prefault_stack(void)
+{
+	volatile char prefault[RT_PREFAULT_SIZE];
+
+	memset((char *)prefault, 0, sizeof(prefault));
+}
+
+static void *rt_thread_main(void *arg)
+{
+	struct rt_thread *t = arg;
+
+	rt_prefault_stack();
+
+	t->ret = rt_setup(t->rt, t->period_ns);
+	if (!t->ret)
+		t->ret = (intptr_t)t->fn(t->arg);
+	return NULL;
+}
+
+/**
+ * Run a function on a dedicated real-time thread, and wait for it.
+ *
+ * All current and future memory of the process is locked first, so that
+ * the thread never waits on a page fault. The other threads are started
+ * with small stacks (THREAD_STACK_SIZE), so that locking them costs little
+ * of RLIMIT_MEMLOCK.
+ *
+ * @rt: Real-time settings, from rt_parse().
+ * @period_ns: Frame period, used as the SCHED_DEADLINE period.
+ * @fn: Function to run. Its return value, cast to an int, is returned.
+ * @arg: Argument to fn.
+ *
+ * Return: The return value of fn, or non-zero if the thread could not be
+ *         set up.
+ */
+int rt_run(const struct rt_config *rt, uint64_t period_ns,
+	   void *(*fn)(void *), void *arg)
+{
+	struct rt_thread t = { rt, period_ns, fn, arg, 1 };
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		printf("Cannot lock memory. %s\n", strerror(errno));
+		return 1;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, RT_STACK_SIZE);
+	ret = pthread_create(&thread, &attr, rt_thread_main, &t);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		printf("Cannot start the apply thread. %s\n", strerror(ret));
+		return 1;
+	}
+
+	pthread_join(thread, NULL);
+	return t.ret;
+}
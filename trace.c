@@ -0,0 +1,476 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <X11/Xlib.h>
+
+#include "xsatmgr.h"
+
+/*******************************************************************************
+ * Workload traces
+ *
+ * Every apply request the long-running modes get (the CTM wanted on an
+ * output, before the caches decide whether it needs writing) can be traced
+ * to a file as fixed-size binary records, so that a production workload can
+ * be replayed later with its original timing, or sped up, and compared
+ * between builds. Records are copied into a static buffer on the apply path,
+ * and only written out when the buffer fills up, or on exit.
+ *
+ * The replay opens its own displays, issues every record once its time has
+ * come, sends what came due in one batch, and reports how late the batches
+ * went out, how many writes they turned into, and how long the server took
+ * to acknowledge them. Output names of the trace missing on the replay
+ * displays are mapped onto the outputs that have a CTM property, so that a
+ * trace taken on a workstation can be replayed on e.g. Xvfb with -X. The
+ * trace can be replayed several times over, e.g. to soak a build from
+ * `make ALLOC_WATCH=1`: the first pass is the warm-up, and any heap
+ * allocation after it fails the replay (see contrib/soak.sh).
+ */
+
+#define TRACE_MAGIC 0x54525358	/* "XSRT" */
+#define TRACE_VERSION 1
+#define TRACE_BUF 256		/* Records written out at once */
+#define TRACE_DRAIN_NS 1000000000ull
+
+struct trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t ndisplays;
+};
+
+/**
+ * A traced apply request.
+ *
+ * @time_ns: Time since the trace started.
+ * @display: Index of the display, in the order they were given with -d.
+ * @output: Output name
+ * @ctm: S31.32 CTM requested.
+ */
+struct trace_record {
+	uint64_t time_ns;
+	uint32_t display;
+	char output[OUTPUT_NAME_LEN];
+	uint32_t reserved;
+	int64_t ctm[9];
+};
+
+/* A trace output replayed on another output */
+struct trace_map {
+	uint32_t display;
+	char from[OUTPUT_NAME_LEN];
+	char to[OUTPUT_NAME_LEN];
+};
+
+static int trace_fd = -1;
+static const struct display_state *trace_displays;
+static uint64_t trace_start_ns;
+static struct trace_record trace_buf[TRACE_BUF];
+static int trace_len;
+static unsigned long trace_records;
+
+static int trace_write_out(void)
+{
+	ssize_t len = trace_len * sizeof(trace_buf[0]);
+
+	trace_len = 0;
+	if (write(trace_fd, trace_buf, len) != len) {
+		printf("Cannot write the trace. %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Start tracing apply requests.
+ *
+ * @path: Trace file, truncated.
+ * @displays: The displays requests are traced for, indexed by position.
+ * @ndisplays: Number of displays.
+ *
+ * Return: 0 on success, non-zero otherwise.
+ */
+int trace_start(const char *path, const struct display_state *displays,
+		int ndisplays)
+{
+	struct trace_header hdr;
+
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (trace_fd < 0) {
+		printf("Cannot open %s. %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	hdr.magic = TRACE_MAGIC;
+	hdr.version = TRACE_VERSION;
+	hdr.record_size = sizeof(struct trace_record);
+	hdr.ndisplays = ndisplays;
+	if (write(trace_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		printf("Cannot write %s. %s\n", path, strerror(errno));
+		close(trace_fd);
+		trace_fd = -1;
+		return 1;
+	}
+
+	trace_displays = displays;
+	trace_start_ns = now_ns();
+	return 0;
+}
+
+/**
+ * Trace an apply request. Does nothing unless trace_start() was called.
+ *
+ * @ds: The display, one of those given to trace_start().
+ * @output: Output name
+ * @padded_ctm: Packed CTM requested.
+ */
+void trace_apply(const struct display_state *ds, const char *output,
+		 const long *padded_ctm)
+{
+	struct trace_record *rec;
+	struct _drm_color_ctm ctm;
+
+	if (trace_fd < 0)
+		return;
+
+	rec = &trace_buf[trace_len++];
+	rec->time_ns = now_ns() - trace_start_ns;
+	rec->display = ds - trace_displays;
+	snprintf(rec->output, sizeof(rec->output), "%s", output);
+	rec->reserved = 0;
+	unpack_ctm(padded_ctm, &ctm);
+	memcpy(rec->ctm, ctm.matrix, sizeof(rec->ctm));
+	trace_records++;
+
+	/* Stop tracing rather than failing applies */
+	if (trace_len == TRACE_BUF && trace_write_out())
+		trace_stop();
+}
+
+/* Write out the buffered records, and close the trace. */
+void trace_stop(void)
+{
+	if (trace_fd < 0)
+		return;
+
+	if (trace_len)
+		trace_write_out();
+	close(trace_fd);
+	trace_fd = -1;
+	printf("Traced %lu apply request(s)\n", trace_records);
+}
+
+/* Read a whole trace. The records are to be freed by the caller. */
+static struct trace_record *trace_load(const char *path, size_t *nrecords)
+{
+	struct trace_header hdr;
+	struct trace_record *recs;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		printf("Cannot open %s. %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) ||
+	    read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    hdr.magic != TRACE_MAGIC || hdr.version != TRACE_VERSION ||
+	    hdr.record_size != sizeof(*recs)) {
+		printf("%s is not a trace.\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	/* A trace cut short by a crash is still good up to its last record */
+	*nrecords = (st.st_size - sizeof(hdr)) / sizeof(*recs);
+	if (!*nrecords) {
+		printf("%s has no records.\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	recs = malloc(*nrecords * sizeof(*recs));
+	if (!recs ||
+	    read(fd, recs, *nrecords * sizeof(*recs)) !=
+	    (ssize_t)(*nrecords * sizeof(*recs))) {
+		printf("Cannot read %s. %s\n", path, strerror(errno));
+		free(recs);
+		close(fd);
+		return NULL;
+	}
+
+	close(fd);
+	return recs;
+}
+
+/*
+ * Find the output a trace record is replayed on: the output with the same
+ * name, or else the one it was mapped on at its first appearance, the next
+ * output of the display with a CTM property.
+ */
+static struct output_state *trace_output(struct display_state *ds,
+					 const struct trace_record *rec,
+					 struct trace_map *maps, int *nmaps)
+{
+	struct output_state *out;
+	int i, used;
+
+	out = display_find_output(ds, rec->output);
+	if (out && out->has_ctm)
+		return out;
+
+	for (i = 0; i < *nmaps; i++)
+		if (maps[i].display == rec->display &&
+		    !strcmp(maps[i].from, rec->output))
+			return display_find_output(ds, maps[i].to);
+
+	if (*nmaps == MAX_DISPLAYS * MAX_OUTPUTS)
+		return NULL;
+
+	/* Spread the outputs of the trace over those of the display */
+	for (i = 0, used = 0; i < *nmaps; i++)
+		used += maps[i].display == rec->display;
+	out = NULL;
+	for (i = 0; i < ds->noutputs; i++)
+		if (ds->outputs[i].has_ctm && !used--) {
+			out = &ds->outputs[i];
+			break;
+		}
+	if (!out)
+		for (i = 0; i < ds->noutputs && !out; i++)
+			if (ds->outputs[i].has_ctm)
+				out = &ds->outputs[i];
+	if (!out)
+		return NULL;
+
+	maps[*nmaps].display = rec->display;
+	snprintf(maps[*nmaps].from, sizeof(maps[*nmaps].from), "%s",
+		 rec->output);
+	snprintf(maps[*nmaps].to, sizeof(maps[*nmaps].to), "%s", out->name);
+	(*nmaps)++;
+	printf("Replaying %s on %s/%s\n", rec->output, ds->name, out->name);
+	return out;
+}
+
+/*
+ * Handle the events of all displays, and the results of their workers,
+ * waiting for up to timeout_ns.
+ */
+static int trace_wait(struct display_state *displays, int ndisplays,
+		      uint64_t timeout_ns)
+{
+	struct pollfd fds[2 * MAX_DISPLAYS];
+	struct timespec ts;
+	int i;
+
+	for (i = 0; i < ndisplays; i++) {
+		display_handle_events(&displays[i]);
+		if (displays[i].lost) {
+			printf("%s: connection lost, giving up.\n",
+			       displays[i].name);
+			return -1;
+		}
+		fds[2 * i].fd = ConnectionNumber(displays[i].dpy);
+		fds[2 * i].events = POLLIN;
+		fds[2 * i + 1].fd = displays[i].worker.efd;
+		fds[2 * i + 1].events = POLLIN;
+	}
+
+	ts.tv_sec = timeout_ns / 1000000000ull;
+	ts.tv_nsec = timeout_ns % 1000000000ull;
+	if (ppoll(fds, 2 * ndisplays, &ts, NULL) <= 0)
+		return 0;
+
+	for (i = 0; i < ndisplays; i++)
+		if (fds[2 * i + 1].revents & POLLIN)
+			display_work_done(&displays[i]);
+	return 0;
+}
+
+/**
+ * Replay a trace.
+ *
+ * @spec: <trace>[@<speed>[x<passes>]], e.g. trace.bin@10 to replay ten
+ *        times faster, or trace.bin@1x100 to replay it a hundred times.
+ * @names: Comma separated displays to replay on, or NULL for the DISPLAY
+ *         environment variable. Records of displays past the last one are
+ *         replayed on the displays in turn.
+ *
+ * Return: 0 on success, 2 if the apply path allocated after the first pass
+ *         of an ALLOC_WATCH build, 1 otherwise.
+ */
+int trace_replay(const char *spec, const char *names)
+{
+	static struct display_state displays[MAX_DISPLAYS];
+	static struct trace_map maps[MAX_DISPLAYS * MAX_OUTPUTS];
+	char path[PATH_LEN], buf[LINE_LEN];
+	struct trace_record *recs;
+	struct _drm_color_ctm ctm;
+	struct display_state *ds;
+	struct output_state *out;
+	long padded_ctm[18];
+	char *name, *save, *at;
+	double speed = 1.0;
+	size_t nrecs, i;
+	uint64_t begin, start, target, now, late, late_sum = 0, late_max = 0;
+	unsigned long commits = 0, dropped = 0, passes = 1, pass, allocs = 0;
+	int j, ndisplays = 0, nmaps = 0, ret = 1;
+
+	snprintf(path, sizeof(path), "%s", spec);
+	at = strrchr(path, '@');
+	if (at) {
+		*at = '\0';
+		speed = strtod(at + 1, &name);
+		if (*name == 'x')
+			passes = strtoul(name + 1, &name, 10);
+		if (*name || !(speed > 0) || !passes) {
+			printf("Invalid replay speed %s\n", at + 1);
+			return 1;
+		}
+	}
+
+	recs = trace_load(path, &nrecs);
+	if (!recs)
+		return 1;
+
+	snprintf(buf, sizeof(buf), "%s", names ? names : "");
+	name = strtok_r(buf, ",", &save);
+	do {
+		if (ndisplays == MAX_DISPLAYS) {
+			printf("Too many displays, at most %d.\n",
+			       MAX_DISPLAYS);
+			goto close;
+		}
+		if (display_open(&displays[ndisplays], name))
+			goto close;
+		ndisplays++;
+	} while ((name = strtok_r(NULL, ",", &save)));
+
+	begin = now_ns();
+	for (pass = 0; pass < passes; pass++) {
+		/* The first pass fills the caches, see allocwatch.c */
+		if (pass == 1)
+			allocs = heap_allocations();
+		start = now_ns();
+		i = 0;
+		while (i < nrecs) {
+			target = start + recs[i].time_ns / speed;
+			now = now_ns();
+			if (now < target) {
+				if (trace_wait(displays, ndisplays,
+					       target - now))
+					goto close;
+				continue;
+			}
+
+			late = now - target;
+			late_sum += late;
+			if (late > late_max)
+				late_max = late;
+
+			/* Everything that came due while waiting goes in one
+			 * batch */
+			for (; i < nrecs &&
+			     start + recs[i].time_ns / speed <= now; i++) {
+				ds = &displays[recs[i].display % ndisplays];
+				out = trace_output(ds, &recs[i], maps, &nmaps);
+				if (!out) {
+					dropped++;
+					continue;
+				}
+				memcpy(ctm.matrix, recs[i].ctm,
+				       sizeof(ctm.matrix));
+				pack_ctm(&ctm, padded_ctm);
+				display_set_packed(ds, out, padded_ctm);
+			}
+
+			for (j = 0; j < ndisplays; j++)
+				display_flush(&displays[j]);
+			commits++;
+		}
+	}
+	allocs = passes > 1 ? heap_allocations() - allocs : 0;
+
+	/* Wait for the last writes to be acknowledged */
+	target = now_ns() + TRACE_DRAIN_NS;
+	for (;;) {
+		for (j = 0, late = 0; j < ndisplays; j++)
+			late += displays[j].inflight;
+		now = now_ns();
+		if (!late || now >= target)
+			break;
+		if (trace_wait(displays, ndisplays, target - now))
+			goto close;
+	}
+
+	printf("Replayed %zu request(s) spanning %.3f s at %gx speed %lu "
+	       "time(s) in %.3f s, %lu batch(es)\n", nrecs,
+	       recs[nrecs - 1].time_ns / 1e9, speed, passes,
+	       (now_ns() - begin) / 1e9, commits);
+	printf("Batch lateness %.3f ms average, %.3f ms max\n",
+	       late_sum / 1e6 / commits, late_max / 1e6);
+	if (dropped)
+		printf("%lu request(s) had no output with a CTM property to "
+		       "replay on\n", dropped);
+	for (j = 0; j < ndisplays; j++) {
+		ds = &displays[j];
+		printf("Display %s: %lu write(s), %lu unchanged, %lu "
+		       "deferred, %d unacknowledged\n", ds->name, ds->applies,
+		       ds->skipped, ds->deferred, ds->inflight);
+		printf("Display %s: apply latency %.3f ms average, "
+		       "%.3f ms max\n", ds->name,
+		       ds->syncs ? ds->sync_ns / 1e6 / ds->syncs : 0,
+		       ds->sync_max_ns / 1e6);
+	}
+	printf("%lu X error(s)\n", display_errors());
+#ifdef ALLOC_WATCH
+	if (passes > 1)
+		printf("%lu heap allocation(s) after the first pass\n",
+		       allocs);
+	ret = allocs ? 2 : 0;
+#else
+	(void)allocs;
+	ret = 0;
+#endif
+
+close:
+	for (j = 0; j < ndisplays; j++)
+		display_close(&displays[j]);
+	free(recs);
+	return ret;
+}
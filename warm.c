@@ -0,0 +1,214 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "xsatmgr.h"
+
+/*******************************************************************************
+ * Warm state
+ *
+ * A socket-activated service exits when idle, and the next request starts
+ * it again. So that this first request does not pay for discovering every
+ * output, the service leaves its caches behind on exit: the atoms and
+ * outputs of every display, and the layers being composed. The next
+ * instance maps the file, and takes the caches of a display as they are if
+ * the RandR timestamps of the server still match, i.e. nothing was plugged,
+ * reconfigured, or restarted meanwhile. That takes one round trip instead
+ * of several per output. The CTMs of the outputs are not taken: writes by
+ * other clients leave the timestamps alone, so they have to be written
+ * again.
+ *
+ * The file is only meant for the same build: its layout is checked by size,
+ * and a mismatch makes for a cold start.
+ */
+
+#define WARM_MAGIC 0x4d575358	/* "XSWM" */
+#define WARM_VERSION 1
+
+/* Size of a warm state file holding n displays */
+#define WARM_BYTES(n) \
+	(offsetof(struct warm_state, displays) + \
+	 (n) * sizeof(struct warm_display))
+
+/**
+ * Map a warm state file.
+ *
+ * @path: Warm state file path.
+ * @warm: Filled in with the mapping.
+ *
+ * Return: 0 on success, -errno otherwise. A file from another build is
+ *         -EINVAL.
+ */
+int warm_map(const char *path, struct warm *warm)
+{
+	const struct warm_state *ws;
+	struct stat st;
+	void *map;
+	int fd, ret = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	if (st.st_size < (off_t)WARM_BYTES(0) ||
+	    st.st_size > (off_t)WARM_BYTES(MAX_DISPLAYS)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -errno;
+		goto out;
+	}
+
+	ws = map;
+	if (ws->magic != WARM_MAGIC || ws->version != WARM_VERSION ||
+	    ws->size != sizeof(*ws) || ws->ndisplays > MAX_DISPLAYS ||
+	    st.st_size != (off_t)WARM_BYTES(ws->ndisplays)) {
+		munmap(map, st.st_size);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	warm->state = ws;
+	warm->bytes = st.st_size;
+out:
+	close(fd);
+	return ret;
+}
+
+void warm_unmap(struct warm *warm)
+{
+	if (warm->state)
+		munmap((void *)warm->state, warm->bytes);
+	warm->state = NULL;
+	warm->bytes = 0;
+}
+
+/**
+ * Find the caches of a display in the warm state.
+ *
+ * Return: The caches, or NULL if the display was not served last time.
+ */
+const struct warm_display *warm_find(const struct warm *warm,
+				     const char *name)
+{
+	uint32_t i;
+
+	if (!warm || !warm->state)
+		return NULL;
+
+	for (i = 0; i < warm->state->ndisplays; i++)
+		if (!strcmp(warm->state->displays[i].name, name))
+			return &warm->state->displays[i];
+	return NULL;
+}
+
+/**
+ * Write the caches of the displays, and the composed layers, to a warm
+ * state file. The file is written aside and renamed over the old one, so
+ * the next instance never maps a torn file. Lost displays are left out.
+ *
+ * @path: Warm state file path.
+ * @compositor: Layers of the composing service.
+ * @displays: The displays
+ * @ndisplays: Number of displays.
+ *
+ * Return: 0 on success, -errno otherwise.
+ */
+int warm_save(const char *path, const struct compositor *compositor,
+	      const struct display_state *displays, int ndisplays)
+{
+	static struct warm_state ws;
+	const struct display_state *ds;
+	struct warm_display *wd;
+	char tmp_path[PATH_LEN];
+	ssize_t len;
+	int fd, i, ret = 0;
+
+	memset(&ws, 0, sizeof(ws));
+	ws.magic = WARM_MAGIC;
+	ws.version = WARM_VERSION;
+	ws.size = sizeof(ws);
+	ws.compositor = *compositor;
+
+	for (i = 0; i < ndisplays; i++) {
+		ds = &displays[i];
+		if (!ds->dpy)
+			continue;
+
+		wd = &ws.displays[ws.ndisplays++];
+		snprintf(wd->name, sizeof(wd->name), "%s", ds->name);
+		wd->ctm_atom = ds->ctm_atom;
+		wd->rr_time = ds->rr_time;
+		wd->rr_config_time = ds->rr_config_time;
+		wd->frame_ns = ds->frame_ns;
+		wd->noutputs = ds->noutputs;
+		memcpy(wd->outputs, ds->outputs,
+		       ds->noutputs * sizeof(ds->outputs[0]));
+	}
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	len = WARM_BYTES(ws.ndisplays);
+	errno = 0;
+	if (write(fd, &ws, len) != len)
+		ret = errno ? -errno : -EIO;
+	close(fd);
+
+	if (!ret && rename(tmp_path, path) < 0)
+		ret = -errno;
+	if (ret)
+		unlink(tmp_path);
+out:
+	if (ret)
+		printf("Failed to write warm state %s. %s\n", path,
+		       strerror(-ret));
+	else
+		printf("Warm state of %u display(s) written to %s\n",
+		       ws.ndisplays, path);
+	return ret;
+}
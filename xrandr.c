@@ -0,0 +1,721 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/extensions/Xrandr.h>
+
+#include "xsatmgr.h"
+
+/*******************************************************************************
+ * RandR helpers
+ */
+
+/**
+ * Find the output on the RandR screen resource by name.
+ *
+ * dpy: The X display
+ * res: The RandR screen resource
+ * name: The output name to search for.
+ *
+ * Return: The RROutput X-id if found, 0 (None) otherwise.
+ */
+RROutput find_output_by_name(Display *dpy, XRRScreenResources *res,
+			     const char *name)
+{
+	int i;
+	RROutput ret;
+	XRROutputInfo *output_info;
+
+	for (i = 0; i < res->noutput; i++) {
+		ret = res->outputs[i];
+		output_info = XRRGetOutputInfo (dpy, res, ret);
+
+		if (!strcmp(name, output_info->name)) {
+			XRRFreeOutputInfo(output_info);
+			return ret;
+		}
+
+		XRRFreeOutputInfo(output_info);
+	}
+	return 0;
+}
+
+/**
+ * Change a DRM blob property on the given output, without waiting for the
+ * server to process it. Used to batch several outputs behind one XSync.
+ *
+ * See set_output_blob() for parameters and return codes.
+ */
+static int change_output_blob(Display *dpy, RROutput output,
+			      const char *prop_name, void *blob_data,
+			      size_t blob_bytes, enum randr_format format)
+{
+	Atom prop_atom;
+	XRRPropertyInfo *prop_info;
+
+	/* Find the X Atom associated with the property name */
+	prop_atom = XInternAtom (dpy, prop_name, 1);
+	if (!prop_atom) {
+		printf("Property key '%s' not found.\n", prop_name);
+		return BadAtom;
+	}
+
+	/* Make sure the property exists */
+	prop_info = XRRQueryOutputProperty(dpy, output, prop_atom);
+	if (!prop_info) {
+		printf("Property key '%s' not found on output\n", prop_name);
+		return BadName;  /* Property not found */
+	}
+	XFree(prop_info);
+
+	/* Change the property 
+	 *
+	 * Due to some restrictions in RandR, array properties of 32-bit format
+	 * must be of type 'long'. See set_ctm() for details.
+	 *
+	 * To get the number of elements within blob_data, we take its size in
+	 * bytes, divided by the size of one of it's elements in bytes:
+	 *
+	 * blob_length = blob_bytes / (element_bytes)
+	 *             = blob_bytes / (format / 8)
+	 *             = blob_bytes / (format >> 3)
+	 */
+	XRRChangeOutputProperty(dpy, output, prop_atom,
+				XA_INTEGER, format, PropModeReplace,
+				blob_data, blob_bytes / (format >> 3));
+
+	return Success;
+}
+
+/**
+ * Set a DRM blob property on the given output. It calls XSync at the end to
+ * flush the change request so that it applies.
+ *
+ * @dpy: The X Display
+ * @output: RandR output to set the property on
+ * @prop_name: String name of the property.
+ * @blob_data: The data of the property blob.
+ * @blob_bytes: Size of the data, in bytes.
+ * @format: Format of each element within blob_data.
+ *
+ * Return: X-defined return codes:
+ *     - BadAtom if the given name string doesn't exist.
+ *     - BadName if the property referenced by the name string does not exist on
+ *       the given connector
+ *     - Success otherwise.
+ */
+int set_output_blob(Display *dpy, RROutput output,
+		    const char *prop_name, void *blob_data,
+		    size_t blob_bytes, enum randr_format format)
+{
+	int ret;
+
+	ret = change_output_blob(dpy, output, prop_name, blob_data,
+				 blob_bytes, format);
+	if (ret)
+		return ret;
+
+	/* Call XSync to apply it. */
+	XSync(dpy, 0);
+
+	return Success;
+}
+
+/**
+ * Set the de/regamma LUT. Since setting degamma and regamma follows similar
+ * procedures, a flag is used to determine which one is set. Also note the
+ * special case of setting SRGB gamma, explained further below.
+ *
+ * @dpy: The X display
+ * @output: The output on which to set de/regamma on.
+ * @coeffs: Coefficients used to create the DRM color LUT blob.
+ * @is_srgb: True if SRGB gamma is being programmed. This is a special case,
+ *           since amdgpu DC defaults to SRGB when no DRM blob (i.e. NULL) is
+ *           set. In other words, there is no need to create a blob (just set
+ *           the blob id to 0)
+ * @is_degamma: True if degamma is being set. Set regamma otherwise.
+ * @max_error: Largest interpolation error allowed for the regamma LUT to be
+ *             uploaded at the legacy size, see coeffs_to_lut(). The driver
+ *             only takes the degamma LUT at full size.
+ *
+ * Return: X-defined return codes, see set_output_blob().
+ */
+int set_gamma(Display *dpy, RROutput output, struct color3d *coeffs,
+	      int is_srgb, int is_degamma, unsigned int max_error)
+{
+	struct _drm_color_lut lut[LUT_SIZE];
+	const char *prop_name = is_degamma ? PROP_DEGAMMA : PROP_GAMMA;
+	unsigned int error;
+	int size;
+
+	/* An empty property clears the blob */
+	if (is_srgb)
+		return set_output_blob(dpy, output, prop_name, NULL, 0,
+				       FORMAT_16_BIT);
+
+	size = coeffs_to_lut(coeffs, lut, is_degamma ? 0 : max_error, &error);
+	if (size == LEGACY_LUT_SIZE)
+		printf("%s: %d entries, error %u within %u, %zu bytes saved\n",
+		       prop_name, size, error, max_error,
+		       (LUT_SIZE - LEGACY_LUT_SIZE) * sizeof(lut[0]));
+	else if (!is_degamma)
+		printf("%s: %d entries, error %u at %d entries over %u\n",
+		       prop_name, size, error, LEGACY_LUT_SIZE, max_error);
+
+	/* Each entry is four 16-bit values, which RandR takes as shorts */
+	return set_output_blob(dpy, output, prop_name, lut,
+			       size * sizeof(lut[0]), FORMAT_16_BIT);
+}
+
+/**
+ * Create a DRM color transform matrix using the given coefficients, and set
+ * the output's CRTC to use it.
+ */
+int set_ctm(Display *dpy, RROutput output, double *coeffs)
+{
+	size_t blob_size = sizeof(struct _drm_color_ctm);
+	struct _drm_color_ctm ctm;
+	long padded_ctm[18];
+
+	int ret;
+
+	coeffs_to_ctm(coeffs, &ctm);
+
+	/* Workaround:
+	 *
+	 * RandR currently uses long types for 32-bit integer format. However,
+	 * 64-bit systems will use 64-bits for long, causing data corruption
+	 * once RandR parses the data. Therefore, pad the blob_data to be long-
+	 * sized. This will work regardless of how long is defined (as long as
+	 * it's at least 32-bits).
+	 *
+	 * Note that we have a 32-bit format restriction; we have to interpret
+	 * each S31.32 fixed point number within the CTM in two parts: The
+	 * whole part (S31), and the fractional part (.32). They're then stored
+	 * (as separate parts) into a long-typed array. Of course, This problem
+	 * wouldn't exist if xserver accepted 64-bit formats.
+	 *
+	 * A gotcha here is the endianness of the S31.32 values. The whole part
+	 * will either come before or after the fractional part. (before in
+	 * big-endian format, and after in small-endian format). We could avoid
+	 * dealing with this by doing a straight memory copy, but we have to
+	 * ensure that each 32-bit element is padded to long-size in the
+	 * process.
+	 */
+	pack_ctm(&ctm, padded_ctm);
+
+	ret = set_output_blob(dpy, output, PROP_CTM, &padded_ctm,
+			      blob_size, FORMAT_32_BIT);
+
+	if (ret)
+		printf("Failed to set CTM. %d\n", ret);
+	return ret;
+}
+
+/*******************************************************************************
+ * Multi-output and multi-GPU helpers
+ */
+
+/**
+ * Resolve a comma separated list of output names into RandR outputs.
+ *
+ * @dpy: The X display
+ * @res: The RandR screen resource
+ * @names: Comma separated output names, e.g. "DisplayPort-0,HDMI-A-1"
+ * @targets: Resolved outputs are placed here.
+ * @max_targets: Size of the targets array.
+ *
+ * Return: Number of resolved outputs, or -1 if any name could not be found.
+ */
+int resolve_outputs(Display *dpy, XRRScreenResources *res, char *names,
+		    struct output_target *targets, int max_targets)
+{
+	char buf[MAX_OUTPUTS * OUTPUT_NAME_LEN];
+	char *name, *save;
+	int n = 0;
+
+	snprintf(buf, sizeof(buf), "%s", names);
+
+	for (name = strtok_r(buf, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		if (n == max_targets) {
+			printf("Too many outputs, at most %d supported.\n",
+			       max_targets);
+			return -1;
+		}
+
+		targets[n].id = find_output_by_name(dpy, res, name);
+		if (!targets[n].id) {
+			printf("Cannot find output %s.\n", name);
+			return -1;
+		}
+		targets[n].provider = None;
+		snprintf(targets[n].name, OUTPUT_NAME_LEN, "%s", name);
+		n++;
+	}
+
+	return n;
+}
+
+/**
+ * Group the resolved outputs by the RandR provider (i.e. GPU) driving them.
+ *
+ * On PRIME and multi-GPU setups, outputs on a secondary provider take a
+ * different (and usually slower) path through the server. Grouping lets us
+ * apply and time each GPU separately. Outputs that are not listed by any
+ * provider, or servers without provider support (RandR < 1.4), end up in a
+ * single catch-all group.
+ *
+ * @dpy: The X display
+ * @res: The RandR screen resource
+ * @targets: Outputs resolved with resolve_outputs(). Their provider field is
+ *           filled in.
+ * @ntargets: Number of outputs.
+ * @groups: The resulting groups are placed here.
+ * @max_groups: Size of the groups array.
+ *
+ * Return: Number of groups.
+ */
+int group_by_provider(Display *dpy, XRRScreenResources *res,
+		      struct output_target *targets, int ntargets,
+		      struct provider_group *groups, int max_groups)
+{
+	XRRProviderResources *pres;
+	XRRProviderInfo *pinfo;
+	struct provider_group *group;
+	int i, j, k, ngroups = 0;
+
+	pres = XRRGetProviderResources(dpy, DefaultRootWindow(dpy));
+
+	for (i = 0; pres && i < pres->nproviders; i++) {
+		pinfo = XRRGetProviderInfo(dpy, res, pres->providers[i]);
+		if (!pinfo)
+			continue;
+
+		for (j = 0; j < ntargets; j++) {
+			for (k = 0; k < pinfo->noutputs; k++) {
+				if (pinfo->outputs[k] != targets[j].id)
+					continue;
+				targets[j].provider = pres->providers[i];
+				break;
+			}
+		}
+
+		/* Only keep providers that drive one of our outputs */
+		for (j = 0; j < ntargets; j++)
+			if (targets[j].provider == pres->providers[i])
+				break;
+		if (j < ntargets && ngroups < max_groups - 1) {
+			group = &groups[ngroups++];
+			group->provider = pres->providers[i];
+			snprintf(group->name, OUTPUT_NAME_LEN, "%s",
+				 pinfo->name);
+			group->noutputs = 0;
+			group->elapsed_ns = 0;
+		}
+
+		XRRFreeProviderInfo(pinfo);
+	}
+
+	if (pres)
+		XRRFreeProviderResources(pres);
+
+	/* Catch-all group, for outputs without a (known) provider. */
+	group = &groups[ngroups];
+	group->provider = None;
+	snprintf(group->name, OUTPUT_NAME_LEN, "default");
+	group->noutputs = 0;
+	group->elapsed_ns = 0;
+
+	for (j = 0; j < ntargets; j++) {
+		for (i = 0; i < ngroups; i++) {
+			if (groups[i].provider == targets[j].provider)
+				break;
+		}
+		if (i == ngroups)
+			targets[j].provider = None;
+		groups[i].outputs[groups[i].noutputs++] = &targets[j];
+	}
+
+	if (group->noutputs)
+		ngroups++;
+
+	return ngroups;
+}
+
+/**
+ * Apply the same CTM to every output, one provider group at a time.
+ *
+ * The CTM is translated and packed once. Within a group, the property
+ * changes are pipelined behind a single XSync, so the time reported for a
+ * group is the time its GPU needed to commit all of its outputs. The X server
+ * processes requests from one client in order, so there is nothing to gain
+ * from issuing the groups from several threads.
+ *
+ * @dpy: The X display
+ * @groups: Groups created by group_by_provider(). elapsed_ns is filled in.
+ * @ngroups: Number of groups.
+ * @coeffs: Coefficients of the CTM to apply.
+ *
+ * Return: Success, or the first X error code encountered.
+ */
+int apply_ctm_groups(Display *dpy, struct provider_group *groups,
+		     int ngroups, double *coeffs)
+{
+	size_t blob_size = sizeof(struct _drm_color_ctm);
+	struct _drm_color_ctm ctm;
+	long padded_ctm[18];
+	int ids[MAX_OUTPUTS];
+	uint64_t start, write_start, sync_start, end;
+	int i, j, ret;
+
+	coeffs_to_ctm(coeffs, &ctm);
+	pack_ctm(&ctm, padded_ctm);
+
+	for (i = 0; i < ngroups; i++) {
+		start = now_ns();
+
+		for (j = 0; j < groups[i].noutputs; j++) {
+			ids[j] = metrics_output(groups[i].outputs[j]->name);
+			write_start = now_ns();
+			ret = change_output_blob(dpy, groups[i].outputs[j]->id,
+						 PROP_CTM, padded_ctm,
+						 blob_size, FORMAT_32_BIT);
+			recorder_apply(groups[i].outputs[j]->name,
+				       ret ? 0 : NextRequest(dpy) - 1, NULL,
+				       padded_ctm, ret);
+			if (ret) {
+				metrics_count(ids[j], METRIC_FAILURES);
+				printf("Failed to set CTM on %s. %d\n",
+				       groups[i].outputs[j]->name, ret);
+				return ret;
+			}
+			metrics_observe(ids[j], PHASE_WRITE,
+					now_ns() - write_start);
+			metrics_count(ids[j], METRIC_APPLIES);
+		}
+
+		sync_start = now_ns();
+		XSync(dpy, 0);
+
+		end = now_ns();
+		groups[i].elapsed_ns = end - start;
+		for (j = 0; j < groups[i].noutputs; j++)
+			metrics_observe(ids[j], PHASE_SYNC, end - sync_start);
+		printf("Provider %s: %d output(s) in %.3f ms\n",
+		       groups[i].name, groups[i].noutputs,
+		       groups[i].elapsed_ns / 1e6);
+	}
+
+	return Success;
+}
+
+/**
+ * Hash the EDID of an output, to key the color journal with.
+ *
+ * @dpy: The X display
+ * @output: RandR output
+ *
+ * Return: edid_hash() of the output's EDID, or 0 if it has none.
+ */
+uint64_t output_edid_hash(Display *dpy, RROutput output)
+{
+	unsigned long nitems, bytes_after;
+	unsigned char *edid = NULL;
+	uint64_t hash = 0;
+	Atom edid_atom, type;
+	int format;
+
+	edid_atom = XInternAtom(dpy, RR_PROPERTY_RANDR_EDID, 1);
+	if (!edid_atom)
+		return 0;
+
+	/* EDIDs are at most a few 128 byte blocks; length is in 32-bit units */
+	if (XRRGetOutputProperty(dpy, output, edid_atom, 0, 256, 0, 0,
+				 AnyPropertyType, &type, &format, &nitems,
+				 &bytes_after, &edid) != Success)
+		return 0;
+
+	if (edid && format == 8)
+		hash = edid_hash(edid, nitems);
+	if (edid)
+		XFree(edid);
+	return hash;
+}
+
+/*******************************************************************************
+ * Tiled monitor helpers
+ */
+
+/**
+ * Resolve all outputs making up a RandR 1.5 monitor. A tiled display driven
+ * by several streams shows up as one monitor with one output per tile.
+ *
+ * @dpy: The X display
+ * @res: The RandR screen resource
+ * @name: Monitor name, as listed by `xrandr --listmonitors`.
+ * @targets: Resolved outputs are placed here.
+ * @max_targets: Size of the targets array.
+ *
+ * Return: Number of outputs of the monitor, or -1 if it cannot be found.
+ */
+int resolve_monitor(Display *dpy, XRRScreenResources *res, const char *name,
+		    struct output_target *targets, int max_targets)
+{
+	XRRMonitorInfo *monitors;
+	XRROutputInfo *output_info;
+	char *monitor_name;
+	int i, j, nmonitors, n = -1;
+
+	monitors = XRRGetMonitors(dpy, DefaultRootWindow(dpy), 1, &nmonitors);
+	if (!monitors) {
+		printf("Cannot list monitors, RandR 1.5 is required.\n");
+		return -1;
+	}
+
+	for (i = 0; i < nmonitors && n < 0; i++) {
+		monitor_name = XGetAtomName(dpy, monitors[i].name);
+		if (monitor_name && !strcmp(monitor_name, name)) {
+			n = 0;
+			for (j = 0; j < monitors[i].noutput &&
+				    n < max_targets; j++) {
+				targets[n].id = monitors[i].outputs[j];
+				targets[n].provider = None;
+				output_info = XRRGetOutputInfo(dpy, res,
+							       targets[n].id);
+				snprintf(targets[n].name, OUTPUT_NAME_LEN,
+					 "%s", output_info ?
+					 output_info->name : "?");
+				if (output_info)
+					XRRFreeOutputInfo(output_info);
+				n++;
+			}
+		}
+		if (monitor_name)
+			XFree(monitor_name);
+	}
+
+	XRRFreeMonitors(monitors);
+
+	if (n <= 0)
+		printf("Cannot find monitor %s.\n", name);
+	return n;
+}
+
+/*
+ * State of a tile across a tiled apply.
+ *
+ * @prev: CTM the tile had before, to roll it back to.
+ * @has_prev: The tile had a CTM to roll back to.
+ * @serial: Request that wrote the tile.
+ * @write_ns: Time taken to queue the write.
+ */
+struct tile {
+	long prev[18];
+	int has_prev;
+	unsigned long serial;
+	uint64_t write_ns;
+};
+
+/* X errors caught during a tiled apply, see tile_error_handler() */
+static XErrorEvent tile_errors[MAX_OUTPUTS];
+static int tile_nerrors;
+
+/*
+ * Errors are matched to the tile writes that caused them after the fact,
+ * instead of exiting like the default handler does.
+ */
+static int tile_error_handler(Display *dpy, XErrorEvent *ev)
+{
+	if (tile_nerrors < MAX_OUTPUTS)
+		tile_errors[tile_nerrors++] = *ev;
+	return 0;
+}
+
+/* Error caused by a request, or Success. */
+static int tile_error(unsigned long serial)
+{
+	int i;
+
+	for (i = 0; i < tile_nerrors; i++)
+		if (tile_errors[i].serial == serial)
+			return tile_errors[i].error_code;
+	return Success;
+}
+
+/*
+ * Read the CTM of a tile, to roll it back to.
+ *
+ * Return: Success, or BadName if the tile has no CTM property.
+ */
+static int tile_read_ctm(Display *dpy, RROutput output, Atom atom,
+			 struct tile *tile)
+{
+	unsigned long nitems, bytes_after;
+	unsigned char *data = NULL;
+	Atom type = None;
+	int format;
+
+	memset(tile, 0, sizeof(*tile));
+	if (XRRGetOutputProperty(dpy, output, atom, 0, 18, False, False,
+				 AnyPropertyType, &type, &format, &nitems,
+				 &bytes_after, &data) != Success ||
+	    type == None) {
+		if (data)
+			XFree(data);
+		return BadName;
+	}
+
+	/* 32-bit items come back as longs, see set_ctm() */
+	if (format == FORMAT_32_BIT && nitems == 18) {
+		memcpy(tile->prev, data, sizeof(tile->prev));
+		tile->has_prev = 1;
+	}
+	XFree(data);
+	return Success;
+}
+
+/**
+ * Apply the same CTM to all tiles of a monitor as one unit.
+ *
+ * The server is grabbed for the duration of the apply, so no other client
+ * (in particular the compositor) gets to present a frame with only some of
+ * the tiles updated. All tiles are written behind a single XSync, and the
+ * time from the first write to that XSync is reported. Should any tile
+ * fail, those written are rolled back to the CTM they had, still under the
+ * grab, rather than leave a seam. Tiles whose CTM could not be read are
+ * reported as not rolled back.
+ *
+ * @dpy: The X display
+ * @targets: Outputs of the monitor, from resolve_monitor().
+ * @ntargets: Number of outputs.
+ * @coeffs: Coefficients of the CTM to apply.
+ *
+ * Return: Success, or the first X error code encountered.
+ */
+int apply_ctm_tiled(Display *dpy, struct output_target *targets,
+		    int ntargets, double *coeffs)
+{
+	struct tile tiles[MAX_OUTPUTS];
+	struct _drm_color_ctm ctm;
+	XErrorHandler old_handler;
+	Atom atom;
+	long padded_ctm[18];
+	uint64_t start, sync_start, end;
+	int i, id, error, nfailed = 0, nrolled = 0, nlost = 0;
+	int ret = Success;
+
+	coeffs_to_ctm(coeffs, &ctm);
+	pack_ctm(&ctm, padded_ctm);
+
+	atom = XInternAtom(dpy, PROP_CTM, True);
+	if (!atom) {
+		printf("Property key '%s' not found.\n", PROP_CTM);
+		return BadAtom;
+	}
+
+	/* Round trips are done before the grab */
+	for (i = 0; i < ntargets; i++) {
+		if (tile_read_ctm(dpy, targets[i].id, atom, &tiles[i])) {
+			printf("Property key '%s' not found on output %s\n",
+			       PROP_CTM, targets[i].name);
+			return BadName;
+		}
+	}
+
+	tile_nerrors = 0;
+	old_handler = XSetErrorHandler(tile_error_handler);
+
+	XGrabServer(dpy);
+	start = now_ns();
+	for (i = 0; i < ntargets; i++) {
+		tiles[i].serial = NextRequest(dpy);
+		XRRChangeOutputProperty(dpy, targets[i].id, atom,
+					XA_INTEGER, FORMAT_32_BIT,
+					PropModeReplace,
+					(unsigned char *)padded_ctm, 18);
+		tiles[i].write_ns = now_ns() - start;
+	}
+	sync_start = now_ns();
+	XSync(dpy, False);
+	end = now_ns();
+
+	for (i = 0; i < ntargets; i++) {
+		id = metrics_output(targets[i].name);
+		error = tile_error(tiles[i].serial);
+		recorder_apply(targets[i].name, tiles[i].serial,
+			       tiles[i].has_prev ? tiles[i].prev : NULL,
+			       padded_ctm, error);
+		if (error) {
+			metrics_count(id, METRIC_FAILURES);
+			printf("Failed to set CTM on %s. %d\n",
+			       targets[i].name, error);
+			if (!nfailed++)
+				ret = error;
+			continue;
+		}
+		metrics_observe(id, PHASE_WRITE, tiles[i].write_ns);
+		metrics_observe(id, PHASE_SYNC, end - sync_start);
+		metrics_count(id, METRIC_APPLIES);
+	}
+
+	/* Put back what the other tiles had, rather than leave a seam */
+	if (nfailed) {
+		for (i = 0; i < ntargets; i++) {
+			if (tile_error(tiles[i].serial))
+				continue;
+			if (!tiles[i].has_prev) {
+				printf("Cannot roll back %s, its CTM was not "
+				       "readable.\n", targets[i].name);
+				nlost++;
+				continue;
+			}
+			XRRChangeOutputProperty(dpy, targets[i].id,
+						atom, XA_INTEGER,
+						FORMAT_32_BIT, PropModeReplace,
+						(unsigned char *)tiles[i].prev,
+						18);
+			nrolled++;
+		}
+		XSync(dpy, False);
+		printf("Monitor: %d tile(s) failed, %d rolled back, %d not\n",
+		       nfailed, nrolled, nlost);
+	}
+
+	XUngrabServer(dpy);
+	XSync(dpy, False);
+	XSetErrorHandler(old_handler);
+
+	if (!ret)
+		printf("Monitor: %d tile(s) written and synced in %.3f ms\n",
+		       ntargets, (end - start) / 1e6);
+	return ret;
+}
@@ -0,0 +1,859 @@
+/*
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors: AMD
+ *
+ */
+
+#ifndef XSATMGR_H
+#define XSATMGR_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrandr.h>
+
+#define VERSION_STRING "alpha-v3"
+
+#define LUT_SIZE 4096
+
+/* Legacy gamma size, also accepted by the driver for the regamma LUT */
+#define LEGACY_LUT_SIZE 256
+
+/* Largest interpolation error allowed for a regamma LUT to be uploaded at
+ * the legacy size, in LUT units: one 10-bit step. */
+#define LUT_MAX_ERROR 64
+
+#define PROP_CTM "CTM"
+#define PROP_DEGAMMA "DEGAMMA_LUT"
+#define PROP_GAMMA "GAMMA_LUT"
+
+/* Upper bounds used to size the statically allocated output tables. */
+#define MAX_OUTPUTS 32
+#define MAX_PROVIDERS 8
+#define MAX_DISPLAYS 16
+#define OUTPUT_NAME_LEN 32
+#define PATH_LEN 256
+#define LINE_LEN 1024
+
+/* Frame period assumed when it cannot be read from the current modes */
+#define DEFAULT_FRAME_NS 16666667ull
+
+/* A display that acknowledged none of its writes for this long is stalled */
+#define STALL_NS 500000000ull
+
+/* Stack of the helper threads. Kept small: with -R, all of it is locked. */
+#define THREAD_STACK_SIZE (256 * 1024)
+
+/* Property written to have the server prove it is responsive */
+#define PROP_PING "_XSATMGR_PING"
+
+/* Journal read by the early boot restore, unless -j says otherwise. */
+#define JOURNAL_PATH "/var/lib/xsatmgr/journal"
+
+/*
+ * Cold-start budget of the early boot restore, from main() to commit done.
+ * Loading and relocating the shared libraries before main() is not counted:
+ * the process start time in /proc is in clock ticks, too coarse for it.
+ */
+#define BOOT_BUDGET_NS 10000000ull
+
+/**
+ * The below data structures are identical to the ones used by DRM. They are
+ * here to help us structure the data being passed to the kernel.
+ */
+struct _drm_color_ctm {
+	/* Transformation matrix in S31.32 format. */
+	int64_t matrix[9];
+};
+
+struct _drm_color_lut {
+	/* Data is U0.16 fixed point format. */
+	uint16_t red;
+	uint16_t green;
+	uint16_t blue;
+	uint16_t reserved;
+};
+
+/* One entry of a LUT, before it is quantized for DRM. */
+struct color3d {
+	double r;
+	double g;
+	double b;
+};
+
+enum randr_format {
+    FORMAT_16_BIT = 16,
+    FORMAT_32_BIT = 32,
+};
+
+/**
+ * An output selected on the command line, resolved against RandR.
+ *
+ * @id: RandR output X-id.
+ * @provider: RandR provider (GPU) the output hangs off. None if the server
+ *            does not expose providers.
+ * @name: Output name, as reported by RandR.
+ */
+struct output_target {
+	RROutput id;
+	RRProvider provider;
+	char name[OUTPUT_NAME_LEN];
+};
+
+/**
+ * Outputs grouped by the provider that drives them. Applies are issued one
+ * group at a time so that the time spent on each GPU can be reported.
+ *
+ * @provider: RandR provider X-id, or None for the catch-all group.
+ * @name: Provider name, as reported by RandR.
+ * @outputs: Outputs belonging to this provider.
+ * @elapsed_ns: Time taken to apply to all outputs of the group.
+ */
+struct provider_group {
+	RRProvider provider;
+	char name[OUTPUT_NAME_LEN];
+	int noutputs;
+	struct output_target *outputs[MAX_OUTPUTS];
+	uint64_t elapsed_ns;
+};
+
+/**
+ * A journal record, as stored on disk. The blob data follows the record.
+ *
+ * @edid_hash: edid_hash() of the connector's EDID, 0 if it has none.
+ * @connector: Connector name. Only used to match connectors without EDID.
+ * @prop: Name of the property the blob is set on, e.g. "CTM".
+ * @len: Size of the blob data, in bytes.
+ */
+struct journal_record {
+	uint64_t edid_hash;
+	char connector[OUTPUT_NAME_LEN];
+	char prop[16];
+	uint32_t len;
+	uint32_t reserved;
+};
+
+/* A journal mapped in memory with journal_map(). */
+struct journal {
+	const uint8_t *data;
+	size_t bytes;
+	uint32_t nrecords;
+};
+
+/**
+ * Cached state of an output, for the long-running modes.
+ *
+ * @id: RandR output X-id.
+ * @crtc: RandR CRTC driving the output, None if disabled.
+ * @name: Output name, as reported by RandR.
+ * @connected: Output is connected and driven by a CRTC.
+ * @has_ctm: Output exposes the CTM property.
+ * @applied: applied_ctm holds the last CTM written to the output.
+ * @applied_ctm: Last CTM written, packed for RandR (see set_ctm()).
+ * @pending: pending_ctm holds a CTM held back while the output sleeps.
+ * @pending_ctm: Latest CTM requested while the output sleeps.
+ * @metrics_id: Index of the output in the metrics, see metrics_output().
+ * @write_serial: X request serial of the last write, to match errors to it.
+ * @write_ns: now_ns() when the last write was sent.
+ * @unsynced: The server has not acknowledged the last write yet.
+ */
+struct output_state {
+	RROutput id;
+	RRCrtc crtc;
+	char name[OUTPUT_NAME_LEN];
+	int connected;
+	int has_ctm;
+	int applied;
+	long applied_ctm[18];
+	int pending;
+	long pending_ctm[18];
+	int metrics_id;
+	unsigned long write_serial;
+	uint64_t write_ns;
+	int unsynced;
+};
+
+/**
+ * Outputs as found by a scan of the server, see display_scan().
+ */
+struct output_scan {
+	int noutputs;
+	struct output_state outputs[MAX_OUTPUTS];
+	uint64_t frame_ns;
+	Time rr_time;
+	Time rr_config_time;
+};
+
+/* Round trips done by the worker of a display, see display_request() */
+#define WORK_REFRESH (1 << 0)
+#define WORK_POWER (1 << 1)
+#define WORK_CONNECT (1 << 2)
+
+/**
+ * Worker thread of a display. Everything that waits for a reply from the
+ * server runs there, on connections of its own, so that a hung server only
+ * ever holds up its worker.
+ *
+ * @thread: The worker thread.
+ * @lock: Protects everything up to the results.
+ * @cond: Signaled when work is requested, or the worker has to stop.
+ * @efd: Event fd, readable once work is done, see display_work_done().
+ * @requested: WORK_* bits to do.
+ * @finished: WORK_* bits done, with their results ready.
+ * @busy: The worker is doing work.
+ * @stop: The worker has to stop.
+ * @scan: Result of WORK_REFRESH and WORK_CONNECT.
+ * @dpms_off: Result of WORK_POWER.
+ * @conn: Result of WORK_CONNECT: the new connection, NULL if it failed.
+ * @connect_ns: When the new connection was made.
+ * @qdpy: Connection for the queries, owned by the worker.
+ */
+struct display_worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int efd;
+	int requested;
+	int finished;
+	int busy;
+	int stop;
+
+	/* Results */
+	struct output_scan scan;
+	int dpms_off;
+	struct display_state *conn;
+	uint64_t connect_ns;
+
+	/* Owned by the worker thread */
+	Display *qdpy;
+	Window qroot;
+	Atom qatom;
+	int qlost;
+	struct output_scan work_scan;
+};
+
+/**
+ * An X display with its atoms and outputs cached, so that applies do not
+ * need any lookup round trips or allocations.
+ */
+struct display_state {
+	Display *dpy;
+	char name[64];
+	Window root;
+	Atom ctm_atom;
+	int rr_event_base;
+	int rr_error_base;
+
+	int noutputs;
+	struct output_state outputs[MAX_OUTPUTS];
+
+	/* Shortest frame period of the active CRTCs */
+	uint64_t frame_ns;
+
+	/* RandR timestamps the caches were built at, see display_merge() */
+	Time rr_time;
+	Time rr_config_time;
+
+	/* Power state, see power.c */
+	int dpms_opcode;
+	int dpms_events;
+	int dpms_off;
+	int saver_event_base;
+	int saver_events;
+	int saver_on;
+
+	/* Writes not acknowledged by the server yet, see display_stalled() */
+	int inflight;
+	uint64_t inflight_since;
+
+	/* Ping not answered by the server yet, see display_ping() */
+	Window ping_win;
+	Atom ping_atom;
+	uint64_t ping_sent;
+
+	/* Runs the round trips, see display_request() */
+	struct display_worker worker;
+	int connecting;
+
+	/* Receives the key presses, see hotkeys_grab() */
+	struct hotkeys *hotkeys;
+
+	/* Set by Xlib when the connection is lost, see display_lost() */
+	int lost;
+	/* Reconnected, waiting for the held back CTMs to be acknowledged */
+	uint64_t restore_ns;
+
+	/* Statistics */
+	unsigned long applies;
+	unsigned long skipped;
+	unsigned long refreshes;
+	unsigned long deferred;
+	unsigned long wakeups;
+	unsigned long stalls;
+	unsigned long losses;
+	unsigned long syncs;
+	uint64_t sync_ns;
+	uint64_t sync_max_ns;
+};
+
+/* True if the screens are powered down, or hidden by the screensaver. */
+static inline int display_asleep(const struct display_state *ds)
+{
+	return ds->dpms_off || ds->saver_on;
+}
+
+#define MAX_LAYERS 32
+#define LAYER_NAME_LEN 32
+
+/**
+ * A color layer registered by a client of the composing service.
+ *
+ * @name: Layer name, chosen by the client. Setting a layer again with the
+ *        same name replaces it.
+ * @priority: Layers are applied in increasing priority order, i.e. the
+ *            highest priority layer is applied last.
+ * @outputs: Comma separated outputs the layer applies to, "*" for all.
+ * @coeffs: The layer's color transformation matrix.
+ */
+struct layer {
+	char name[LAYER_NAME_LEN];
+	int priority;
+	char outputs[MAX_OUTPUTS * OUTPUT_NAME_LEN];
+	double coeffs[9];
+};
+
+/* Layers of the composing service, sorted by priority. */
+struct compositor {
+	int nlayers;
+	struct layer layers[MAX_LAYERS];
+};
+
+/**
+ * The caches of a display, as left behind by the last instance, see warm.c.
+ *
+ * @name: Display name
+ * @ctm_atom: The CTM atom on this server.
+ * @rr_time: RandR timestamp the outputs were cached at.
+ * @rr_config_time: RandR configuration timestamp the outputs were cached at.
+ * @frame_ns: Shortest frame period of the active CRTCs.
+ * @outputs: Cached outputs. Their CTMs are not taken, other clients may
+ *           have changed them without touching the timestamps.
+ */
+struct warm_display {
+	char name[64];
+	Atom ctm_atom;
+	Time rr_time;
+	Time rr_config_time;
+	uint64_t frame_ns;
+	int noutputs;
+	struct output_state outputs[MAX_OUTPUTS];
+};
+
+/* Warm state file, as mapped. Only ndisplays displays are stored. */
+struct warm_state {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t ndisplays;
+	struct compositor compositor;
+	struct warm_display displays[MAX_DISPLAYS];
+};
+
+struct warm {
+	const struct warm_state *state;
+	size_t bytes;
+};
+
+#define CUE_NAME_LEN 32
+
+/**
+ * An output's part in a cue.
+ *
+ * @name: Output name.
+ * @coeffs: The output's look once the cue has played.
+ * @ctm: The same look, packed (see pack_ctm()).
+ */
+struct cue_output {
+	char name[OUTPUT_NAME_LEN];
+	double coeffs[9];
+	long ctm[18];
+};
+
+/**
+ * A compiled cue.
+ *
+ * @name: Cue name.
+ * @fade_ms: Fade duration.
+ * @nframes: Number of frames of the fade, at least 1.
+ * @weights: Weight of the cue's look at every frame of the fade, the last
+ *           one is 1.
+ */
+struct cue {
+	char name[CUE_NAME_LEN];
+	unsigned int fade_ms;
+	int nframes;
+	double *weights;
+	int noutputs;
+	struct cue_output outputs[MAX_OUTPUTS];
+};
+
+/* A loaded cue list. current is the last fired cue, -1 before the first. */
+struct cue_list {
+	int ncues;
+	struct cue *cues;
+	int current;
+};
+
+#define HOTKEYS 2
+#define HOTKEY_STEP 0.05
+#define HOTKEY_MAX_SAT 2.0
+#define HOTKEY_MAX_STEPS 1001
+
+/**
+ * A grabbed key.
+ *
+ * @sym: Key symbol.
+ * @mods: Modifiers that must be held with it, e.g. Mod4Mask.
+ * @delta: Steps taken per press, -1 or 1.
+ */
+struct hotkey {
+	KeySym sym;
+	unsigned int mods;
+	int delta;
+};
+
+/**
+ * Saturation stepping on global hotkeys, see hotkey.c.
+ *
+ * @keys: The down and up keys.
+ * @step_size: Saturation difference between two steps.
+ * @nsteps: Number of steps, from grayscale to HOTKEY_MAX_SAT.
+ * @table: Packed CTM (see pack_ctm()) of every step.
+ * @step: Current step.
+ * @delta: Steps pressed, but not written yet.
+ * @presses: Number of presses not written yet.
+ * @press_ns: now_ns() when the first of them was read.
+ * @write_ns: now_ns() of the last write.
+ */
+struct hotkeys {
+	struct hotkey keys[HOTKEYS];
+	double step_size;
+	int nsteps;
+	long (*table)[18];
+	int step;
+	int delta;
+	int presses;
+	uint64_t press_ns;
+	uint64_t write_ns;
+
+	/* Statistics */
+	unsigned long total_presses;
+	unsigned long writes;
+	uint64_t latency_ns;
+	uint64_t latency_max_ns;
+};
+
+/* Phases of an apply, timed separately */
+enum metric_phase {
+	PHASE_WRITE,	/* Queuing the property change */
+	PHASE_SYNC,	/* Round trip until the server processed it */
+	PHASE_COMMIT,	/* DRM atomic commit */
+	NUM_PHASES,
+};
+
+enum metric_counter {
+	METRIC_APPLIES,
+	METRIC_FAILURES,
+	METRIC_REASSERTS,	/* Held back CTMs written on wake up */
+	NUM_COUNTERS,
+};
+
+#define METRIC_BUCKETS 12
+#define METRICS_INTERVAL_S 15
+
+/* Counters and latency histograms of one output */
+struct output_metrics {
+	char name[OUTPUT_NAME_LEN];
+	unsigned long counters[NUM_COUNTERS];
+	unsigned long buckets[NUM_PHASES][METRIC_BUCKETS];
+	uint64_t sum_ns[NUM_PHASES];
+};
+
+struct metrics {
+	int noutputs;
+	struct output_metrics outputs[MAX_OUTPUTS];
+	unsigned long x_errors;
+
+	/* Lateness of frame-scheduled writes against their target frame */
+	unsigned long lateness_buckets[METRIC_BUCKETS];
+	uint64_t lateness_sum_ns;
+	unsigned long deadline_misses;
+};
+
+#define RECORDER_SIZE 4096	/* Power of two */
+#define RECORDER_PATH "/tmp/xsatmgr-flight.bin"
+
+#define FLIGHT_OLD_VALID (1 << 0)
+#define FLIGHT_ERROR (1 << 1)
+
+/**
+ * A flight recorder record, see recorder.c.
+ *
+ * @seq: Position in the ring, plus one. 0 while the record is written.
+ * @serial: X request serial of the write.
+ * @result: Success, or the error the write failed with.
+ * @old_ctm: S31.32 CTM the output had, if FLIGHT_OLD_VALID.
+ * @new_ctm: S31.32 CTM written.
+ */
+struct flight_record {
+	uint64_t seq;
+	uint64_t time_ns;
+	uint64_t serial;
+	int32_t result;
+	uint32_t flags;
+	char output[OUTPUT_NAME_LEN];
+	uint64_t old_ctm[9];
+	uint64_t new_ctm[9];
+};
+
+#define PENDING_VALUE_LEN 64
+
+/**
+ * A one-shot request handed over to the run in flight, see coalesce.c.
+ *
+ * @monitor: name is a RandR monitor, rather than an output.
+ * @name: Output or monitor name.
+ * @value: Value, as given with -c.
+ * @journal: Journal path, as given with -j, or empty.
+ */
+struct pending_request {
+	int monitor;
+	char name[OUTPUT_NAME_LEN];
+	char value[PENDING_VALUE_LEN];
+	char journal[PATH_LEN];
+};
+
+/* Coalescing state of a one-shot run */
+struct coalesce {
+	int lock_fd;
+	int slot_fd;
+	unsigned long handed_over;
+	unsigned long superseded;
+};
+
+/* Real-time settings of the apply thread, see rt.c */
+struct rt_config {
+	int enabled;
+	int policy;
+	int priority;
+	int cpu;	/* -1 for any */
+};
+
+/**
+ * Configuration of the long-running modes, from the command line.
+ *
+ * @display: X display name, NULL for the DISPLAY environment variable.
+ * @outputs: Comma separated outputs applied to when a request names none.
+ *           The composing service manages these outputs, or all of them if
+ *           NULL.
+ * @stream: Read requests from stdin.
+ * @socket_path: Serve color layers on this unix socket.
+ * @cue_path: Play the cue list in this file.
+ * @hotkeys: Step the saturation of the outputs on these keys, see hotkey.c.
+ * @metrics_path: Export metrics to this Prometheus textfile, see metrics.c.
+ * @metrics_interval: Seconds between metrics writes, 0 for
+ *                    METRICS_INTERVAL_S.
+ * @recorder_path: Dump the flight recorder here on error, see recorder.c.
+ * @trace_path: Trace every apply request to this file, see trace.c.
+ * @warm_path: Warm state file, read on start and written on exit.
+ * @idle_s: Exit after this long without a request, 0 to keep running.
+ * @rt: Real-time settings of the event loop, see rt.c.
+ */
+struct daemon_config {
+	const char *display;
+	char *outputs;
+	int stream;
+	const char *socket_path;
+	const char *cue_path;
+	const char *hotkeys;
+	const char *metrics_path;
+	unsigned int metrics_interval;
+	const char *recorder_path;
+	const char *trace_path;
+	const char *warm_path;
+	unsigned int idle_s;
+	struct rt_config rt;
+};
+
+/* Monotonic clock in nanoseconds, used for all timing reports. */
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Start a helper thread with a THREAD_STACK_SIZE stack, see pthread_create. */
+static inline int thread_start(pthread_t *thread, void *(*fn)(void *),
+			       void *arg)
+{
+	pthread_attr_t attr;
+	int ret;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+	ret = pthread_create(thread, &attr, fn, arg);
+	pthread_attr_destroy(&attr);
+	return ret;
+}
+
+/* Check if name is in the comma separated list names. */
+static inline int name_in_list(const char *name, const char *names)
+{
+	size_t len = strlen(name);
+	const char *p = names;
+
+	while ((p = strstr(p, name))) {
+		if ((p == names || p[-1] == ',') &&
+		    (p[len] == ',' || p[len] == '\0'))
+			return 1;
+		p += len;
+	}
+	return 0;
+}
+
+/*
+ * color.c
+ */
+void coeffs_to_ctm(const double *coeffs, struct _drm_color_ctm *ctm);
+void ctm_to_coeffs(const struct _drm_color_ctm *ctm, double *coeffs);
+void pack_ctm(const struct _drm_color_ctm *ctm, long *padded_ctm);
+void unpack_ctm(const long *padded_ctm, struct _drm_color_ctm *ctm);
+void saturation_to_coeffs(double value, double *coeffs);
+int parse_saturation(const char *opt, double *coeffs);
+int parse_matrix(const char *opt, double *coeffs);
+void mat3_mul(const double *a, const double *b, double *out);
+int parse_user_ctm(char *ctm_opt, double *coeffs);
+int parse_user_gamma(char *gamma_opt, struct color3d *coeffs, int *is_srgb);
+int coeffs_to_lut(const struct color3d *coeffs, struct _drm_color_lut *lut,
+		  unsigned int max_error, unsigned int *error);
+
+/*
+ * xrandr.c
+ */
+RROutput find_output_by_name(Display *dpy, XRRScreenResources *res,
+			     const char *name);
+int set_output_blob(Display *dpy, RROutput output,
+		    const char *prop_name, void *blob_data,
+		    size_t blob_bytes, enum randr_format format);
+int set_gamma(Display *dpy, RROutput output, struct color3d *coeffs,
+	      int is_srgb, int is_degamma, unsigned int max_error);
+int set_ctm(Display *dpy, RROutput output, double *coeffs);
+int resolve_outputs(Display *dpy, XRRScreenResources *res, char *names,
+		    struct output_target *targets, int max_targets);
+int group_by_provider(Display *dpy, XRRScreenResources *res,
+		      struct output_target *targets, int ntargets,
+		      struct provider_group *groups, int max_groups);
+int apply_ctm_groups(Display *dpy, struct provider_group *groups,
+		     int ngroups, double *coeffs);
+
+uint64_t output_edid_hash(Display *dpy, RROutput output);
+int resolve_monitor(Display *dpy, XRRScreenResources *res, const char *name,
+		    struct output_target *targets, int max_targets);
+int apply_ctm_tiled(Display *dpy, struct output_target *targets,
+		    int ntargets, double *coeffs);
+
+/*
+ * drm.c
+ */
+int drm_apply_ctm(char *names, double *coeffs, double *plane_coeffs,
+		  const char *journal_path);
+int drm_restore_journal(const char *path, uint64_t start_ns);
+
+/*
+ * coalesce.c
+ */
+int coalesce_begin(struct coalesce *c, const char *display,
+		   const struct pending_request *reqs, int nreqs);
+int coalesce_next(struct coalesce *c, struct pending_request *reqs);
+
+/*
+ * display.c
+ */
+int display_open(struct display_state *ds, const char *name);
+void display_close(struct display_state *ds);
+void display_set_mock(int mock);
+void display_set_warm(const struct warm *warm);
+void display_lost(struct display_state *ds);
+void display_reconnect(struct display_state *ds);
+void display_request(struct display_state *ds, int work);
+int display_work_done(struct display_state *ds);
+void display_ping(struct display_state *ds);
+struct output_state *display_find_output(struct display_state *ds,
+					 const char *name);
+int display_set_packed(struct display_state *ds, struct output_state *out,
+		       const long *padded_ctm);
+int display_set_ctm(struct display_state *ds, struct output_state *out,
+		    const struct _drm_color_ctm *ctm);
+void display_flush(struct display_state *ds);
+int display_stalled(const struct display_state *ds);
+int display_apply_pending(struct display_state *ds);
+void display_handle_events(struct display_state *ds);
+unsigned long display_errors(void);
+
+/*
+ * compose.c
+ */
+int compositor_set_layer(struct compositor *c, const char *name,
+			 int priority, const char *outputs,
+			 const double *coeffs);
+int compositor_remove_layer(struct compositor *c, const char *name);
+void compositor_compose(const struct compositor *c, const char *output,
+			double *coeffs);
+int send_request(const char *socket_path, const char *request);
+int send_layer_request(const char *socket_path, const char *layer,
+		       const char *outputs, const char *value);
+
+/*
+ * cue.c
+ */
+int cue_list_load(struct cue_list *cl, const char *path, uint64_t frame_ns);
+void cue_list_free(struct cue_list *cl);
+int cue_list_find(const struct cue_list *cl, const char *name);
+void cue_blend(const struct cue *cue, int i, int frame, const double *from,
+	       long *padded_ctm);
+
+/*
+ * hotkey.c
+ */
+int hotkeys_load(struct hotkeys *hk, const char *spec);
+void hotkeys_free(struct hotkeys *hk);
+int hotkeys_grab(struct hotkeys *hk, struct display_state *ds);
+int hotkeys_handle_event(struct hotkeys *hk, XEvent *ev);
+const long *hotkeys_advance(struct hotkeys *hk);
+void hotkeys_written(struct hotkeys *hk);
+
+/*
+ * metrics.c
+ */
+int metrics_output(const char *name);
+void metrics_count(int id, enum metric_counter counter);
+void metrics_observe(int id, enum metric_phase phase, uint64_t ns);
+void metrics_lateness(uint64_t ns, int missed);
+const struct metrics *metrics_get(void);
+int metrics_bucket_bound(int bucket, uint64_t *ns);
+int metrics_start(const char *path);
+void metrics_publish(void);
+void metrics_stop(void);
+int metrics_append(const char *path);
+
+/*
+ * recorder.c
+ */
+void recorder_apply(const char *output, unsigned long serial,
+		    const long *old_ctm, const long *new_ctm, int result);
+void recorder_error(const char *output, unsigned long serial, int error);
+void recorder_set_path(const char *path);
+int recorder_dump(const char *path);
+int recorder_decode(const char *path);
+
+/*
+ * warm.c
+ */
+int warm_map(const char *path, struct warm *warm);
+void warm_unmap(struct warm *warm);
+const struct warm_display *warm_find(const struct warm *warm,
+				     const char *name);
+int warm_save(const char *path, const struct compositor *compositor,
+	      const struct display_state *displays, int ndisplays);
+
+/*
+ * trace.c
+ */
+int trace_start(const char *path, const struct display_state *displays,
+		int ndisplays);
+void trace_apply(const struct display_state *ds, const char *output,
+		 const long *padded_ctm);
+void trace_stop(void);
+int trace_replay(const char *spec, const char *names);
+
+/*
+ * rt.c
+ */
+int rt_parse(const char *spec, struct rt_config *rt);
+int rt_run(const struct rt_config *rt, uint64_t period_ns,
+	   void *(*fn)(void *), void *arg);
+
+/*
+ * power.c
+ */
+void power_init(struct display_state *ds);
+int power_handle_event(struct display_state *ds, XEvent *ev);
+int power_query(Display *dpy);
+
+/*
+ * daemon.c
+ */
+int daemon_run(const struct daemon_config *cfg);
+
+/*
+ * allocwatch.c, only built with ALLOC_WATCH=1
+ */
+#ifdef ALLOC_WATCH
+unsigned long heap_allocations(void);
+void heap_ignore_begin(void);
+void heap_ignore_end(void);
+#else
+static inline unsigned long heap_allocations(void)
+{
+	return 0;
+}
+
+static inline void heap_ignore_begin(void)
+{
+}
+
+static inline void heap_ignore_end(void)
+{
+}
+#endif
+
+/*
+ * journal.c
+ */
+uint64_t edid_hash(const void *edid, size_t len);
+int journal_map(const char *path, struct journal *journal);
+void journal_unmap(struct journal *journal);
+const struct journal_record *journal_next(const struct journal *journal,
+					  const struct journal_record *rec);
+const struct journal_record *journal_find(const struct journal *journal,
+					  uint64_t edid_hash,
+					  const char *connector,
+					  const char *prop);
+int journal_store(const char *path, const struct journal_record *updates,
+		  const void *const *data, int nupdates);
+
+#endif /* XSATMGR_H */